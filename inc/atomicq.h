@@ -0,0 +1,106 @@
+/*
+  Copyright (c) 2015
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2015-Mar-16 11:20 (EDT)
+  Function: lock-free queues + pools
+
+*/
+
+#ifndef __fbdb_atomicq_h_
+#define __fbdb_atomicq_h_
+
+#include "misc.h"
+
+// many threads push, one thread takes everything at once
+// T needs: T *_qnext
+template <class T>
+class AtomicQueue {
+    T * volatile _head;
+
+public:
+    AtomicQueue() { _head = 0; }
+
+    bool empty(void) const { return !_head; }
+
+    void push(T *e){
+        T *h;
+
+        do {
+            h = _head;
+            e->_qnext = h;
+        } while( ATOMIC_CASPTR(_head, h, e) != h );
+    }
+
+    // returns a list, oldest first
+    T *take(void){
+        T *l = (T*) ATOMIC_SETPTR(_head, (T*)0);
+        T *r = 0;
+
+        // reverse
+        while( l ){
+            T *n = l->_qnext;
+            l->_qnext = r;
+            r = l;
+            l = n;
+        }
+        return r;
+    }
+};
+
+// preallocated records, handed out without locking.
+// when they run out, more are allocated (and deleted when returned)
+// the free list head carries a counter, so a record that is taken and
+// put back between our read and our swap does not fool us
+// T needs: int _poolidx, int _poolnext
+template <class T>
+class AtomicPool {
+    T			*_recs;
+    volatile uint64_t	_free;		// count << 32 | index + 1. 0 => empty
+
+public:
+    AtomicPool(int n){
+        _recs = new T[n];
+        for(int i=0; i<n; i++){
+            _recs[i]._poolidx  = i;
+            _recs[i]._poolnext = (i + 1 < n) ? i + 2 : 0;
+        }
+        _free = n ? 1 : 0;
+    }
+    ~AtomicPool(){ delete [] _recs; }
+
+    T *get(void){
+        while(1){
+            uint64_t h = _free;
+            int i = h & 0xFFFFFFFF;
+
+            if( !i ){
+                T *e = new T;
+                e->_poolidx = -1;
+                return e;
+            }
+
+            T *e = _recs + i - 1;
+            uint64_t n = (((h >> 32) + 1) << 32) | (uint32_t)e->_poolnext;
+            if( ATOMIC_CAS64(_free, h, n) == h ) return e;
+        }
+    }
+
+    void put(T *e){
+
+        if( e->_poolidx < 0 ){
+            delete e;
+            return;
+        }
+
+        while(1){
+            uint64_t h = _free;
+            e->_poolnext = h & 0xFFFFFFFF;
+            uint64_t n = (((h >> 32) + 1) << 32) | (uint32_t)(e->_poolidx + 1);
+            if( ATOMIC_CAS64(_free, h, n) == h ) return;
+        }
+    }
+
+    DISALLOW_COPY(AtomicPool);
+};
+
+#endif /* __fbdb_atomicq_h_ */
@@ -0,0 +1,83 @@
+/*
+  Copyright (c) 2015
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2015-Mar-09 14:02 (EDT)
+  Function: storage of large values outside of the database
+
+*/
+
+#ifndef __fbdb_blob_h_
+#define __fbdb_blob_h_
+
+#include "lock.h"
+#include "thread.h"
+#include <map>
+
+class Database;
+class DBConf;
+
+// stored as the DBRecord value, for DBTYP_BLOB
+struct BlobPtr {
+    int32_t	fileno;
+    int32_t	len;
+    int64_t	off;		// of the value
+};
+
+// in the blob file, followed by the key, then the value
+struct BlobHeader {
+    uint32_t	magic;
+    int32_t	shard;
+    int32_t	keylen;
+    int32_t	datalen;
+    int64_t	ver;
+    int64_t	expire;
+};
+
+#define BLOB_MAGIC	0x426C6F62
+
+// append-only files of values. the database keeps a BlobPtr.
+// dead values are reclaimed by copying the live ones out of
+// mostly dead files, then removing the file.
+class BlobStore {
+    Mutex	_wlock;		// appending
+    Mutex	_mlock;		// maintenance thread
+    CondVar	_mcond;
+    pthread_t	_mtid;
+    bool	_mrunning;
+    bool	_stop;
+    RWLock	_flock;		// file table
+    Database	*_be;
+    string	_dir;
+    int64_t	_maxsize;	// start a new file after
+    int		_gcpct;		// collect files with less than this % live
+    int		_curno;		// file being appended to
+    int		_curfd;
+    int64_t	_cursize;
+    std::map<int,int> _fds;	// fileno => fd
+
+public:
+    BlobStore(Database *, DBConf *);
+    ~BlobStore();
+
+    int  write(const string& key, int shard, int64_t ver, int64_t exp, int len, const uchar *data, BlobPtr *);
+    int  read(const BlobPtr *, string *);
+    int  sync(void);
+    void gc(void);
+    void maint(void);
+    void stop(void);
+
+    static bool in_use(DBConf *);
+
+private:
+    void filename(int, string *);
+    int  get_fd(int);
+    int  start_file(void);
+    bool gc_file(int);
+    bool pause(int);
+    bool stopping(void);
+
+    DISALLOW_COPY(BlobStore);
+};
+
+
+#endif /* __fbdb_blob_h_ */
@@ -0,0 +1,51 @@
+/*
+  Copyright (c) 2015
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2015-Mar-23 14:05 (EDT)
+  Function: bulk transfers
+
+*/
+
+#ifndef __fbdb_bulk_h_
+#define __fbdb_bulk_h_
+
+#include "netutil.h"
+
+#include <deque>
+
+#define BULK_WINDOW	4		// chunks in flight
+#define BULK_CHUNKRECS	256		// records per chunk
+#define BULK_CHUNKSIZE	(256*1024)	// bytes per chunk, approx.
+
+// stream many requests to one peer, on one connection.
+// requests are sent without waiting for replies, until the window
+// is full, then we wait for the oldest reply before sending more.
+// the subclass provides _res (for the replies), and on_reply
+class BulkXfer {
+    struct Chunk {
+        uint32_t			msgid;
+        google::protobuf::Message	*req;
+    };
+
+    PConn		_pc;
+    int			_reqno;
+    std::deque<Chunk>	_inflight;
+
+    void recv_one(void);
+
+protected:
+    google::protobuf::Message	*_res;
+
+    void send(google::protobuf::Message *);	// we delete it when done
+    void finish(void);				// wait for everything in flight
+
+    virtual void on_reply(google::protobuf::Message *req, google::protobuf::Message *res) = 0;	// res = 0 => failed
+
+public:
+    BulkXfer(const NetAddr *, int, int);
+    virtual ~BulkXfer();
+
+    DISALLOW_COPY(BulkXfer);
+};
+
+#endif /* __fbdb_bulk_h_ */
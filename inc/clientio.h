@@ -22,6 +22,10 @@ protected:
     int				_wrpos;
     int				_rlen;
     bool			_polling;
+    bool			_errreply;	// last reply was an error
+    int				_errcode;	// its status code. 0 => none (request not understood)
+    bool			_reused;	// connection came from the pool
+    bool			_retried;	// already retried on a new connection
     lrtime_t			_timeout;
 protected:
     lrtime_t			_rel_timeout;
@@ -31,6 +35,8 @@ public:
     virtual ~ClientIO();
     void set_timeout(lrtime_t);
     void start(void);
+    bool error_reply(void) const { return _errreply; }
+    int  error_code(void) const  { return _errcode; }
 protected:
     void retry(const NetAddr&);
     void discard(void);
@@ -42,6 +48,7 @@ private:
     void do_error(const char *);
     void do_work(void);
     void _close(void);
+    void _release(void);
 
     virtual void on_error(void)    = 0;
     virtual void on_success(void)  = 0;
@@ -37,6 +37,22 @@ public:
     int			expire;
     int			replicas;
     int			ringbits;
+    int			scan_readahead;		// KB, maintenance scans
+    int			scan_rate;		// rows/sec, maintenance scans. 0 => unlimited
+    int			cache_size;		// MB, block cache. 0 => backend default
+    int			bloom_bits;		// bloom filter bits per key. 0 => none
+    int			write_buffer;		// MB
+    int			compactions;		// background compaction threads
+    string		compression;		// none, snappy, ...
+    int			blob_min;		// bytes. larger values go in the blob store. 0 => off
+    int			blob_file_size;		// MB
+    int			blob_gc;		// % live, below which blob files are collected
+    int			merkle_cache;		// MB, upper level merkle nodes kept in memory
+    int			merkle_leaves;		// MB, merkle leaves cached for write-back
+    int			merkle_threads;		// merkle flush workers
+    string		merkle_hash;		// md5, murmur3
+    string		shard_hash;		// md5, murmur3
+    int			merkle_xor;		// incremental leaf hashes
 
     DBConf();
     DISALLOW_COPY(DBConf);
@@ -54,9 +70,13 @@ class Config {
 public:
     int			hw_cpus;
     int			tcp_threads;
+    int			tcp_reactors;
+    int			tcp_workers;
     int			udp_threads;
     int			cio_threads;
     int			ae_threads;
+    int			peer_conns;		// idle connections kept per peer
+    int			peer_conn_idle;		// seconds
 
     int 		port_console;
     int 		port_server;
@@ -66,6 +86,7 @@ public:
     char 		debugflags[256/8];
     char 		traceflags[256/8];
 
+    string		tcp_mode;		// threads | epoll
     string 		environment;
     string		basedir;
     string		datacenter;
@@ -74,6 +95,7 @@ public:
 
     ACL_List		acls;
     NetAddr_List	seedpeers;
+    list<string>	throttle;		// class resource KB/sec
     DBCf_List		dbs;
 
     string		error_mailto;
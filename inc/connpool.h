@@ -0,0 +1,19 @@
+/*
+  Copyright (c) 2014
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2015-Mar-02 11:20 (EST)
+  Function: pool of established connections to peers
+
+*/
+
+#ifndef __fbdb_connpool_h_
+#define __fbdb_connpool_h_
+
+// borrow an idle keep-alive connection to the peer. -1 => none available
+extern int  connpool_get(const NetAddr *);
+// return a connection (idle, no requests in flight) for reuse
+extern void connpool_put(const NetAddr *, int);
+// close connections idle too long
+extern void connpool_maint(void);
+
+#endif /* __fbdb_connpool_h_ */
@@ -9,19 +9,58 @@
 #ifndef __fbdb_database_h_
 #define __fbdb_database_h_
 
+#include <map>
+#include <set>
+
 class DBConf;
 class ACPY2MapDatum;
 class ACPY2CheckReply;
+class ACPY2DiffRequest;
 class ACPY2DistRequest;
 class Merkle;
 class Expire;
 class Lambda;
 class Ring;
+class BlobStore;
+struct BlobPtr;
+struct DBRecord;
+
+// view of backend data, valid only for the duration of the callback
+class DBSlice {
+public:
+    const char *data;
+    int         size;
+
+    DBSlice(const char *d, int s) { data = d; size = s; }
+    string str(void) const { return string(data, size); }
+};
+
+#define RANGE_MAINT	1	// background scan: snapshot, no cache fill, rate limited
+#define RANGE_UNPACED	2	// with RANGE_MAINT: not rate limited. offline, at startup
 
 // closure standin
 class LambdaRange {
 public:
-    virtual bool call(const string&, const string&) = 0;
+    virtual bool call(const DBSlice&, const DBSlice&) = 0;
+};
+
+// a group of writes, applied to the backend atomically
+class DBBatch {
+    std::map<string, string> _pend;	// so we can read our own writes
+    std::set<string>         _gone;
+protected:
+    // key includes the subkey prefix
+    virtual void _put(const string&, int, const uchar *) = 0;
+    virtual void _del(const string&) = 0;
+public:
+    int		count;
+
+    DBBatch() { count = 0; }
+    virtual ~DBBatch() {}
+    void put(char, const string&, int, const uchar *);
+    void put(char c, const string& k, const string& v){ put(c, k, v.size(), (const uchar*)v.data()); }
+    void del(char, const string&);
+    int  get(char, const string&, string *);	// 1 => found, -1 => deleted, 0 => not in batch
 };
 
 #define DBPUTST_DONE	0	// data was accepted, and saved
@@ -38,20 +77,34 @@ protected:
     Expire	*_expr;
     Ring	*_ring;
     int64_t	_expire;
+    int		_scan_readahead;	// bytes
+    int		_scan_rate;		// rows/sec
+    BlobStore	*_blob;
+    int		_shardhash;		// HASH_*
+    int		_blob_min;		// store values this large in the blob store. 0 => never
 
     Database(DBConf*);
     virtual int  _get(char, const string&, string *) = 0;
     virtual int  _put(char, const string&, int, const uchar*) = 0;
     virtual int  _del(char, const string&) = 0;
-    virtual bool _range(char, const string &, const string&, LambdaRange *) = 0;
+    virtual int  _get_meta(char, const string&, DBRecord *);	// just the header
+    virtual bool _range(char, const string &, const string&, LambdaRange *, int flags=0) = 0;
+    virtual DBBatch *_batch_begin(void) = 0;
+    virtual int  _batch_commit(DBBatch *) = 0;	// writes + deletes the batch
 
     int _put(char c, const string& k, const string& v){ _put(c, k, v.size(), (const uchar*)v.data()); }
+    int  put_check(ACPY2MapDatum *, int64_t *, int *, int *);
+    void scan_pace(int64_t, int64_t, int64_t);
+    int  record_value(const string&, string *);
+    int  blob_live(const string&, int64_t, const BlobPtr*);
+    int  blob_move(const string&, int, int64_t, const BlobPtr*, const string&);
 
 public:
     virtual ~Database();
 
     int  get(ACPY2MapDatum *res);
     int  put(ACPY2MapDatum *req, int*);
+    void put_set(int, ACPY2MapDatum **, int *, int *);
     int  want_it(const string&, int64_t);
     int64_t have_ver(const string&);
     int  remove(const string&, int64_t);
@@ -60,11 +113,14 @@ public:
     int  set_internal(char, const string& key, int, const uchar*);
     int  del_internal(char, const string& key);
     int  get_merkle(int level, int shard, int64_t ver, int, ACPY2CheckReply*);
+    int  diff_merkle(ACPY2DiffRequest*, ACPY2CheckReply*);
     int  distrib(int, ACPY2DistRequest*);
     bool ae(void);
     void configure(void);
     int64_t ring_version(void) const;
     void upgrade(void);
+    void check_merkle(void);
+    void check_shardhash(void);
 
     friend class BackendConf;
     friend class Merkle;
@@ -72,6 +128,7 @@ public:
     friend class Ring;
     friend class MerkRepartLR;
     friend class MerkDeleteLR;
+    friend class BlobStore;
 
     DISALLOW_COPY(Database);
 };
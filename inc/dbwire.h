@@ -11,6 +11,7 @@
 
 #define DBTYP_DELETED	0
 #define DBTYP_DATA	1
+#define DBTYP_BLOB	2	// value is a BlobPtr
 // ...
 
 // on disk record
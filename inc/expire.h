@@ -10,18 +10,22 @@
 #define __fbdb_expire_h_
 
 #include "lock.h"
-#include <queue>
+#include "atomicq.h"
 #include <deque>
-using std::priority_queue;
 
 class Database;
+class DBBatch;
+
+#define EXPIRE_POOL	16384	// preallocated notes
 
 class ExpireNote {
 public:
     string 	key;
     int64_t	exp;
 
-    ExpireNote(const string& k, int64_t e) : key(k) { exp = e; }
+    ExpireNote	*_qnext;
+    int		_poolidx;
+    int		_poolnext;
 
     // does not matter whether this sorts ascending or descending
     struct comparator {
@@ -31,13 +35,10 @@ public:
     };
 };
 
-
-typedef priority_queue<ExpireNote*, std::deque<ExpireNote*>, ExpireNote::comparator> ExpireQueue;
-
 class Expire {
-    Mutex	_lock;
     Database	*_be;
-    ExpireQueue *_pq;
+    AtomicQueue<ExpireNote> _q;
+    AtomicPool<ExpireNote>  _pool;
 
 public:
     Expire(Database*);
@@ -46,8 +47,7 @@ public:
     void add(const string& key, int64_t exp);
     void expire(void);
 private:
-    void flush_put(const string&, deque<string> *);
-    void expire_edge(void);
+    void flush_put(const string&, deque<string> *, DBBatch *);
     void expire_spec(void);
 };
 
@@ -0,0 +1,23 @@
+/*
+  Copyright (c) 2015
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2015-Mar-18 10:42 (EDT)
+  Function: fast non-cryptographic hashes
+
+*/
+
+#ifndef __fbdb_hash_h_
+#define __fbdb_hash_h_
+
+// hash algorithms. the numbers go over the wire, do not change them
+#define HASH_MD5	0
+#define HASH_MURMUR3	1
+
+extern int	   hash_alg(const string&);		// -1 => unknown
+extern const char *hash_name(int);
+extern void	   hash_bin(int, const uchar *, int, char *, int);
+
+extern void	   murmur3_128(const uchar *, int, uint32_t, uchar *);
+extern uint32_t	   murmur3_32(const uchar *, int, uint32_t);
+
+#endif /* __fbdb_hash_h_ */
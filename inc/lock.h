@@ -27,6 +27,7 @@ public:
 
 private:
     DISALLOW_COPY(Mutex);
+    friend class CondVar;
 };
 
 // ################################################################
@@ -68,4 +69,23 @@ private:
 };
 
 
+// ################################################################
+
+class CondVar {
+private:
+    pthread_cond_t _cond;
+
+public:
+    CondVar();
+    ~CondVar();
+    void wait(Mutex *);
+    int  timedwait(Mutex *, int);	// msec. 0 => signaled
+    void signal(void);
+    void broadcast(void);
+
+private:
+    DISALLOW_COPY(CondVar);
+};
+
+
 #endif //__fbdb_lock_h_
@@ -10,9 +10,12 @@
 #define __fbdb_merkle_h_
 
 #include "lock.h"
+#include "atomicq.h"
 
 #include <vector>
 #include <deque>
+#include <list>
+#include <map>
 using std::vector;
 using std::deque;
 
@@ -20,9 +23,20 @@ using std::deque;
 #define MERKLE_HEIGHT	12	// pretend the tree is this high, but don't build it all
 #define MERKLE_BUILD	12 	// build tree on the version only, not the part
 #define MERKLE_HASHLEN	16	// md5 is this big
+#define MERKLE_CACHELEVEL 8	// keep nodes at or above this level in memory
+#define MERKLE_KEYLEN	9	// binary node keys: level, treeid, version
+#define MERKLE_FORMATKEY "format"
+#define MERKLE_FORMAT	"bin2"
+#define MERKLE_POOL	16384	// preallocated change records
+#define MERKLE_HASHXOR	0x100	// leaf hash is the xor of the record hashes (| HASH_*)
+#define MERKLE_DIFFNODES 1024	// most nodes sent in one diff request
+#define MERKLE_DIFFMAX	4096	// most results in one diff reply, whatever the peer asks for
+#define MERKLE_DIFFBYTES 1048576	// ... and about this many bytes
 
 
 // on disk format of non-leaf nodes
+//   MerkleNode[n], in slot order, then <bitmap:16> of the slots present
+// older nodes are only the array, and are converted when used
 struct MerkleNode {
     uint64_t	slot     : 4;
     uint64_t	children : 5;
@@ -33,13 +47,47 @@ struct MerkleNode {
 };
 
 
+// on disk format of leaf nodes
+//   <count:32> <offset:32>[count] <records>
+//   record: <version:64> <shard:32> <keylen:16> <key>
+// the offsets are from the start of the records, in (version, key) order.
+// native byte order, unaligned.
+#define MERKLE_LEAFRECLEN	14
+#define MERKLE_MAXKEYLEN	65535	// keylen is 16 bits. longer keys are refused
+
+class MerkleLeaf {
+    const char	*_data;
+    int		_count;
+
+    const char *rec(int) const;
+public:
+    MerkleLeaf(const char *, int);
+    int		count(void) const { return _count; }
+    int64_t	version(int) const;
+    int		shard(int) const;
+    const char *key(int, int *) const;
+    string	keystr(int) const;
+    int		find(const string&, int64_t, bool *) const;
+    void	hash(int, uchar *) const;
+    void	xhash(int, uchar *) const;
+    static void rechash(int, const char *, int, int64_t, int, uchar *);
+
+    // modify in place
+    static int  insert(string *, int, const string&, int64_t, int);
+    static void remove(string *, int);
+};
+
 struct NetAddr;
 class Database;
+class DBConf;
 class ACPY2CheckReply;
 class ACPY2CheckValue;
 class ACPY2GetSet;
+class ACPY2DiffRequest;
 
-class Tinfo;
+struct AETask;
+struct AEBatch;
+class DBBatch;
 
 // changes that need to be applied
 class MerkleChange {
@@ -51,17 +99,36 @@ public:
     int		_children;
     bool	_fixme;
     uint8_t    	_hash[MERKLE_HASHLEN];
+
+    MerkleChange *_qnext;
+    int		_poolidx;
+    int		_poolnext;
 };
 
+// recently used leaves, one per lock shard, protected by the shard lock.
+// dirty leaves are written out by the flush thread, or when evicted
 class MerkleLeafCache {
 public:
-    string	_mkey;
-    string	_data;
-    int		_count;
-    int 	_treeid;
-    uint64_t 	_ver;
-    bool	_fixme;
-    bool	_dirty;
+    struct Ent {
+        string		_data;
+        int		_count;
+        int 		_treeid;
+        uint64_t 	_ver;
+        int		_size;		// accounted
+        bool		_fixme;
+        bool		_dirty;
+        bool		_hvalid;	// _hash is current (incremental hashing)
+        uint8_t		_hash[MERKLE_HASHLEN];
+        std::list<string>::iterator _lru;
+    };
+
+    int64_t		_size;
+    int64_t		_max;
+    int			_ndirty;
+    std::list<string>	_lru;		// most recent at front
+    std::map<string,Ent> _ents;
+
+    MerkleLeafCache() { _size = 0; _max = 0; _ndirty = 0; }
 };
 
 // too speed up AE checks
@@ -73,42 +140,110 @@ struct MerkleCache {
 };
 
 typedef deque<MerkleChange*>		 MerkleChangeQ;
+typedef std::map<int, MerkleChangeQ*>	 MerkleChangeQMap;	// by treeid
+typedef vector< std::pair<string,string> > MerkleNodePend;	// node writes not yet committed
+
+extern void merkle_key(int, int, uint64_t, string *);
+
+// resident copies of the upper level nodes, bounded by size
+// writes bump a generation, so a reader cannot put back a value
+// it read from disk before the write
+#define MERKLE_NCGEN	61
+
+class MerkleNodeCache {
+    struct Ent {
+        string			  data;
+        std::list<string>::iterator lru;
+    };
+
+    Mutex		_lock;
+    int64_t		_size;
+    int64_t		_max;
+    uint32_t		_gen[MERKLE_NCGEN];
+    std::list<string>	_lru;		// most recent at front
+    std::map<string,Ent> _ents;
+
+    int  genno(const string&);
+    void remove(std::map<string,Ent>::iterator);
+public:
+    MerkleNodeCache();
+    void     set_max(int64_t m) { _max = m; }
+    bool     get(const string&, string *);
+    uint32_t gen(const string&);
+    void     fill(const string&, const string&, uint32_t);
+    void     update(const string&, const string&);
+    void     clear(void);
+};
 
 class Merkle {
-    Mutex            _lock;			// to protect this object's queues
+    Mutex            _flock;			// one flush at a time
+    Mutex            _wlock;			// flush workers
+    CondVar          _wcond;			// work to do
+    CondVar          _wdone;			// work done
+    deque<MerkleChangeQ*> _work;		// trees waiting for a worker
+    int              _wbusy;
+    int              _nworker;
+    int              _hashalg;			// HASH_*
+    bool             _hashxor;			// incremental leaf hashes
     Mutex            _nlock[MERKLE_NLOCK]; 	// to protect on disk nodes (sharded)
     MerkleLeafCache  _cache[MERKLE_NLOCK];
     Database        *_be;
-    MerkleChangeQ   *_mnm;			// queue of non-leaf nodes to update
+    AtomicQueue<MerkleChange> _mnm;		// non-leaf nodes to update
+    AtomicPool<MerkleChange>  _mpool;
+    MerkleNodeCache  _ncache;
 
 public:
-    Merkle(Database*);
+    Merkle(Database*, DBConf*);
     void add(const string&, int, int, int64_t);
     void del(const string&, int, int, int64_t);
+    bool add(const string&, int, int, int64_t, DBBatch*);	// leaf lock held. 1 => changed
+    bool del(const string&, int, int, int64_t, DBBatch*);	// leaf lock held. 1 => changed
+    int  leaf_lock_number(int, int64_t);
+    void leaf_lock(int);
+    void leaf_unlock(int);
     bool exists(const string&, int, int, int64_t);
     void fix(int, int64_t);
     void fix(int, int, int64_t);
     void clear_node(int, int, int64_t);
     int  get_node_and_lock(int, int, int64_t, string*);
     int  get(int, int, int64_t, ACPY2CheckReply *);
+    int  diff(ACPY2DiffRequest *, ACPY2CheckReply *);
+    void diff_request(int, int, int64_t, ACPY2DiffRequest *);
     void flush(void);
+    void flush_worker(void);
     void check(void);
-    bool ae(int, int, NetAddr*, uint64_t*, uint64_t*);
     bool ae_fetch(int, int, ACPY2GetSet*, NetAddr*);
-    void ae_work(Tinfo*);
+    void ae_fetched(int, ACPY2GetSet*);
+    void ae_check(int, AETask*, int);
+    void ae_result(AEBatch*, AETask*, ACPY2CheckReply*, bool);
     bool compare_result(MerkleCache*, ACPY2CheckValue*);
     int  get_leaf( const string& map, int level, int treeid, int64_t ver, const string& val, ACPY2CheckReply *res);
     int  get_upper(const string& map, int level, int treeid, int64_t ver, const string& val, ACPY2CheckReply *res, bool stable);
     bool repartition(int, int64_t*);
     void upgrade(void);
+    void check_format(void);
 private:
-    void q_leafnext(int, uint64_t, int, const string *, bool fix=0);
+    void rebuild(void);
+    void format(string*);
+    int  hash_scheme(void) const { return _hashalg | (_hashxor ? MERKLE_HASHXOR : 0); }
+    void _flush(void);
+    void q_leafnext(int, uint64_t, int, const string *, const uchar *, bool fix=0);
+    void q_change(MerkleChange*);
     bool apply_update_maybe(MerkleChange*, MerkleChange*);
-    bool apply_updates(MerkleChangeQ*);
-    string *leafcache_get(int, const string&);
-    void leafcache_set(int, int, int64_t, int, bool fix=0);
-    void leafcache_flush(int);
-    bool leafcache_maybe_flush(int);
+    bool apply_updates(MerkleChangeQ*, DBBatch*, MerkleNodePend*);
+    void flush_tree(MerkleChangeQ*);
+    void node_read(const string&, string *, DBBatch*);
+    void node_write(const string&, const string *, DBBatch*);
+    void node_get(int, const string&, string *);
+    void node_commit(DBBatch*, MerkleNodePend*);
+    string *leafcache_get(int, const string&, DBBatch*);
+    void leafcache_set(int, int, int64_t, int, const uchar *, bool fix=0);
+    void leafcache_write(MerkleLeafCache*, const string&, MerkleLeafCache::Ent*, DBBatch*);
+    void leafcache_written(MerkleLeafCache*, MerkleLeafCache::Ent*);
+    void leafcache_flush(int, DBBatch*);
+    void leafcache_flushed(int);
+    void leafcache_flush_group(int, int);
+    void leafcache_clear(void);
 
     DISALLOW_COPY(Merkle);
 };
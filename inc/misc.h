@@ -34,12 +34,16 @@ inline int probability(float p){ return random() < p * 0x7FFFFFFF; }
 #  define ATOMIC_SETPTR(a,b)		((a)  = (b))
 #  define ATOMIC_ADD32(a,b)		((a) += (b))
 #  define ATOMIC_ADD64(a,b)		((a) += (b))
+#  define ATOMIC_CAS64(a,b,c)		((a) == (b) ? ((a) = (c), (b)) : (a))
+#  define ATOMIC_CASPTR(a,b,c)		((a) == (b) ? ((a) = (c), (b)) : (a))
 #else
 #  define ATOMIC_SET32(a,b)		atomic_swap_32( (uint32_t*)&a, b )
 #  define ATOMIC_SET64(a,b)		atomic_swap_64( (uint64_t*)&a, b )
 #  define ATOMIC_SETPTR(a,b)		atomic_swap_ptr( &a, b)
 #  define ATOMIC_ADD32(a,b)		atomic_add_32(  (uint32_t*)&a, b )
 #  define ATOMIC_ADD64(a,b)		atomic_add_64(  (uint64_t*)&a, b )
+#  define ATOMIC_CAS64(a,b,c)		atomic_cas_64(  (uint64_t*)&a, b, c )
+#  define ATOMIC_CASPTR(a,b,c)		atomic_cas_ptr( &a, b, c )
 #endif
 
 
@@ -47,6 +51,6 @@ extern void unique(string *);
 extern int  current_load(void);
 extern int  base64_encode(const unsigned char *, int, char *, int);
 extern void split(const string &src, char delim, deque<string> *dst);
-extern uint shard_hash(const string&);
+extern uint shard_hash(const string&, int alg=0);	// alg: HASH_*, see hash.h
 
 #endif // __fbdb_misc_h_
@@ -9,6 +9,9 @@
 #ifndef __fbdb_netutil_h_
 #define __fbdb_netutil_h_
 
+#include <map>
+#include <set>
+
 extern int parse_net_addr(const char *, NetAddr *);
 
 extern int  tcp_connect(NetAddr *, int);
@@ -21,6 +24,41 @@ extern void set_nbio(int);
 extern int make_request(const char *, int, int, google::protobuf::Message *, google::protobuf::Message *);
 extern int make_request(NetAddr *,    int, int, google::protobuf::Message *, google::protobuf::Message *);
 extern int serialize_reply(NTD *, google::protobuf::Message *, int);
+extern int serialize_request(NTD *, int, bool, google::protobuf::Message *, int, int flags=0);
+
+
+// persistent connection to a peer
+// many requests may be in flight, replies are matched up by msgidno
+// not thread safe - use one per thread
+class PConn {
+    NetAddr		_addr;
+    int			_fd;
+    int			_timeout;
+    bool		_keepalive;	// peer has agreed to keep the connection
+    bool		_reused;
+    bool		_error;		// last reply was an error
+    int			_errcode;	// its status code. 0 => none (request not understood)
+    std::set<uint32_t>	_inflight;	// sent, no reply yet
+    std::map<uint32_t, NTD*> _replies;	// recvd, not yet collected
+
+    bool connect(void);
+    void clear(void);
+    void dropped(void);
+
+public:
+    PConn(const NetAddr *, int);
+    ~PConn();
+    int  send(int, google::protobuf::Message *, uint32_t *);
+    int  recv(uint32_t, google::protobuf::Message *);
+    int  request(int, google::protobuf::Message *, google::protobuf::Message *);
+    int  pipeline_depth(int max){ return _keepalive ? max : 1; }
+    bool error_reply(void) const { return _error; }
+    int  error_code(void) const  { return _errcode; }
+    void release(void);
+    void close(void);
+
+    DISALLOW_COPY(PConn);
+};
 
 static inline void
 cvt_header_from_network(protocol_header *ph){
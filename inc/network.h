@@ -55,6 +55,8 @@ typedef struct {
 # define PHMT_Y2_DIST		34
 # define PHMT_Y2_CHECK		35
 # define PHMT_Y2_RINGCF		36
+# define PHMT_Y2_PUTSET		37
+# define PHMT_Y2_DIFF		38
 
 
 // ...
@@ -63,6 +65,7 @@ typedef struct {
 # define PHFLAG_ISERROR		0x4
 # define PHFLAG_DATA_ENCR	0x8
 # define PHFLAG_CONT_ENCR	0x10
+# define PHFLAG_KEEPALIVE	0x20		// leave the connection open, more requests will follow
 } protocol_header;
 
 class NTD {
@@ -130,7 +133,7 @@ static inline void ntd_copy_header_for_reply(struct NTD *ntd){
     po->version        = PHVERSION;
     po->msgidno        = pi->msgidno;
     po->type           = pi->type;
-    po->flags          = PHFLAG_ISREPLY;
+    po->flags          = PHFLAG_ISREPLY | (pi->flags & PHFLAG_KEEPALIVE);
     po->auth_length    = 0;
     po->content_length = 0;
     po->data_length    = 0;
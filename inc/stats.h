@@ -20,6 +20,8 @@ struct Stats {
     int64_t	distrib;
     int64_t	distrib_errs;
     int64_t	distrib_seen;
+    int64_t	distrib_batch;
+    int64_t	distrib_drop;
 
     lrtime_t	last_ae_time;
 };
@@ -12,12 +12,16 @@
 class ACPY2MapDatum;
 class ACPY2CheckReply;
 class ACPY2DistRequest;
+class ACPY2PutSet;
+class ACPY2DiffRequest;
 
 extern int store_get(const char *db, ACPY2MapDatum *res);
 extern int store_put(const char *db, ACPY2MapDatum *req, int64_t*, int*);
+extern void store_put_set(ACPY2PutSet *req, int *, int64_t*, int*);
 extern int store_get_internal(const char *db, char sub, const string& key, string *res);
 extern int store_set_internal(const char *db, char sub, const string& key, int len, uchar *data);
 extern int store_get_merkle(const char *db, int level, int shard, int64_t ver, int max, ACPY2CheckReply *res);
+extern int store_diff_merkle(const char *db, ACPY2DiffRequest *req, ACPY2CheckReply *res);
 extern int store_distrib(const char *db, int, ACPY2DistRequest *req);
 extern void store_upgrade(const char *db);
 
@@ -0,0 +1,32 @@
+/*
+  Copyright (c) 2015
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2015-Mar-25 11:30 (EDT)
+  Function: background traffic throttling
+
+*/
+
+#ifndef __fbdb_throttle_h_
+#define __fbdb_throttle_h_
+
+// traffic classes
+#define THROT_FOREGROUND	0	// client requests. counted, never held back
+#define THROT_REPLICATION	1	// distribution, anti-entropy
+#define THROT_MAINTENANCE	2	// repartition, expire, scans
+#define THROT_NCLASS		3
+
+// resources
+#define THROT_DISK		0	// bytes read or written
+#define THROT_NET		1	// bytes sent or received
+#define THROT_NRES		2
+
+class Config;
+
+extern void throttle(int, int, int64_t);		// wait until the budget allows
+extern void throttle_note(int, int, int64_t);		// charge, but do not wait
+extern bool throttle_set(const string&, const string&, int, string *);	// from the console
+extern void throttle_report(string *);
+extern void throttle_configure(Config *);		// from the config file
+extern int  throttle_class(int);			// validate a class from the network
+
+#endif /* __fbdb_throttle_h_ */
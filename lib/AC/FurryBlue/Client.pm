@@ -36,6 +36,7 @@ my %MSGTYPE =
   y2db_distrib		=> { num => 34, reqc => 'ACPY2DistRequest',   resc => 'ACPY2DistReply' },
   y2db_check		=> { num => 35, reqc => 'ACPY2CheckRequest',  resc => 'ACPY2CheckReply' },
   y2db_ringcf		=> { num => 36, reqc => 'ACPY2RingConfReq',   resc => 'ACPY2RingConfReply' },
+  y2db_putset		=> { num => 37, reqc => 'ACPY2PutSet',        resc => 'ACPY2PutSetReply' },
  );
 
 for my $name (keys %MSGTYPE){
@@ -59,6 +60,7 @@ sub new {
         datacenter => my_datacenter(),
         copies     => 1,
         timeout    => 10,
+        shard_hash => 'md5',
 
         # servers { id => {addr, port, ...} }
         # mapservers []	 - have our map
@@ -213,13 +215,70 @@ sub _read_ringcf {
 
 }
 
+# must match the servers' shard_hash: md5 (default) or murmur3
 sub _shard {
     my $me  = shift;
     my $key = shift;
 
+    return _murmur3_32($key) if $me->{shard_hash} eq 'murmur3';
     return unpack( 'N', md5($key) );
 }
 
+# 32 bit multiply, without overflowing into floating point
+sub _mul32 {
+    my $a = shift;
+    my $b = shift;
+
+    return ((($a & 0xFFFF) * $b) + (((($a >> 16) * $b) & 0xFFFF) << 16)) & 0xFFFFFFFF;
+}
+
+sub _rotl32 {
+    my $x = shift;
+    my $r = shift;
+
+    return (($x << $r) | ($x >> (32 - $r))) & 0xFFFFFFFF;
+}
+
+# MurmurHash3 x86_32, seed 0. same as the server
+# known answers are in src/test_hash.cc, keep them in agreement
+sub _murmur3_32 {
+    my $data = shift;
+
+    my $len = length($data);
+    my $nb  = int($len / 4);
+    my $h   = 0;
+
+    for my $k (unpack("V$nb", $data)){
+        $k = _mul32($k, 0xcc9e2d51);
+        $k = _rotl32($k, 15);
+        $k = _mul32($k, 0x1b873593);
+        $h ^= $k;
+        $h = _rotl32($h, 13);
+        $h = (_mul32($h, 5) + 0xe6546b64) & 0xFFFFFFFF;
+    }
+
+    my @t = unpack('C*', substr($data, $nb * 4));
+    if( @t ){
+        my $k = 0;
+        $k ^= $t[2] << 16 if @t > 2;
+        $k ^= $t[1] << 8  if @t > 1;
+        $k ^= $t[0];
+        $k = _mul32($k, 0xcc9e2d51);
+        $k = _rotl32($k, 15);
+        $k = _mul32($k, 0x1b873593);
+        $h ^= $k;
+    }
+
+    $h ^= $len;
+    $h ^= $h >> 16;
+    $h = _mul32($h, 0x85ebca6b);
+    $h ^= $h >> 13;
+    $h = _mul32($h, 0xc2b2ae35);
+    $h ^= $h >> 16;
+
+    return $h;
+}
+
 sub _servers_for_key {
     my $me  = shift;
     my $key = shift;
@@ -390,6 +449,46 @@ sub distribute {
     return $me->_getset($key, $req);
 }
 
+# many at once: [ [key, ver, val, prog], ... ]
+sub distribute_set {
+    my $me   = shift;
+    my $recs = shift;
+
+    return unless $recs && @$recs;
+    $me->{retries} = 25 unless $me->{retries};
+
+    my @data;
+    for my $r (@$recs){
+        my($key, $ver, $val, $prog) = @$r;
+        next unless $key && $ver;
+
+        push @data, {
+            sender	=> "$HOSTNAME/$$",
+            hop		=> 0,
+            expire	=> (time() + 30) * 1000000,	# usec
+            data	=> {
+                map	=> $me->{map},
+                key	=> $key,
+                version	=> $ver,
+                value	=> $val,
+                program	=> $prog,
+            },
+        };
+    }
+    return unless @data;
+
+    my $req = $me->{proto}->encode_request( {
+        type		=> 'y2db_putset',
+        msgidno		=> rand(0xFFFFFFFF),
+        want_reply	=> 1,
+    }, {
+        data		=> \@data,
+    } );
+
+    # any server will do, it passes along what it does not store
+    return $me->_getset($recs->[0][0], $req);
+}
+
 
 ################################################################
 
@@ -136,5 +136,55 @@ use Google::ProtocolBuffers;
         );
     }
 
+    unless (ACPY2PutSet->can('_pb_fields_list')) {
+        Google::ProtocolBuffers->create_message(
+            'ACPY2PutSet',
+            [
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_REPEATED(), 
+                    'ACPY2DistRequest', 
+                    'data', 1, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT32(), 
+                    'traffic', 2, undef
+                ],
+
+            ],
+            { 'create_accessors' => 1, 'follow_best_practice' => 1,  }
+        );
+    }
+
+    unless (ACPY2PutSetReply->can('_pb_fields_list')) {
+        Google::ProtocolBuffers->create_message(
+            'ACPY2PutSetReply',
+            [
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_REQUIRED(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT32(), 
+                    'status_code', 1, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_REQUIRED(), 
+                    Google::ProtocolBuffers::Constants::TYPE_STRING(), 
+                    'status_message', 2, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_REPEATED(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT32(), 
+                    'result_code', 3, undef
+                ],
+                [
+                    Google::ProtocolBuffers::Constants::LABEL_OPTIONAL(), 
+                    Google::ProtocolBuffers::Constants::TYPE_INT64(), 
+                    'conf_time', 4, undef
+                ],
+
+            ],
+            { 'create_accessors' => 1, 'follow_best_practice' => 1,  }
+        );
+    }
+
 }
 1;
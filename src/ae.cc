@@ -23,6 +23,9 @@
 #include "stats.h"
 #include "runmode.h"
 #include "thread.h"
+#include "hash.h"
+#include "bulk.h"
+#include "throttle.h"
 
 #include <ctype.h>
 #include <stdlib.h>
@@ -35,30 +38,100 @@
 
 #define TIMEOUT		30
 #define TOONEW		(60 * 1000000)	// 1 minute, microsecs
-#define MAXFETCH	256
+#define FETCHCHUNK	64	// keys per fetch request
 #define MAXRESULTS	1024
 #define MAXERR		20
+#define PIPELINE	8	// check requests in flight per thread
 
 extern bool db_uptodate;
 
+// anti-entropy runs on a persistent pool of ae_threads workers.
+// every local partition is checked at once, each against its own peer.
+// each worker has its own deque of nodes to check. it pushes the mismatched
+// nodes it finds, and pops LIFO - walks its subtrees depth first, keeps the deque small.
+// an idle worker steals from the front of another's deque - the oldest
+// entries are highest in the tree, and carry the most work.
+
+// one partition being checked against one peer
+class AESweep {
+public:
+    NetAddr  *peer;
+    int       part;
+    int       treeid;
+    bool      ok;
+    bool      abort;
+    bool      nodiff;		// peer does not do diffs
+    int       errs;		// consecutive failed conversations
+    int       pending;		// tasks queued or running
+    int64_t   mismatch;
+    int64_t   nsynced;
+
+    AESweep(){ peer = 0; part = 0; treeid = 0; ok = 1; abort = 0; nodiff = 0; errs = 0; pending = 0; mismatch = 0; nsynced = 0; }
+};
+
+struct AETask {
+    Merkle   *mk;
+    AESweep  *sweep;
+    uint64_t  version;
+    int       level;
+};
+
+class AEPool {
+    Mutex          _lock;		// protects everything but the deques
+    CondVar        _work;		// tasks were queued
+    CondVar        _done;		// a sweep finished
+    int            _nworker;
+    int            _nqueued;
+    deque<AETask> *_dq;			// one per worker
+    Mutex         *_dqlock;
+
+public:
+    AEPool(){ _nworker = 0; _nqueued = 0; _dq = 0; _dqlock = 0; }
+    void start(void);
+    void add(int, Merkle *, AESweep *, int, uint64_t);
+    int  take(int, AETask *, int);
+    void done(AESweep *, int, int64_t, int64_t, bool, bool);
+    void wait(vector<AESweep*> *);
+    void worker(int);
+};
+
+static AEPool ae_pool;
+
 // this gets run periodically via store_maint()
+// all of the local partitions are checked at once, on the ae thread pool
 bool
 Database::ae(void){
     bool ok = 1;
     int npart = _ring->num_parts();
-    uint64_t nsync = 0;
-    uint64_t mism  = 0;
+    vector<AESweep*> sweep;
 
     DEBUG("ae %s %d", _name.c_str(), npart);
+    ae_pool.start();
+
     for(int p=0; p<npart; p++ ){
         if( !_ring->is_local(p) ) continue;
-        int treeid = _ring->treeid(p);
         // compare merkle tree with random peer
         RP_Server *s = _ring->random_peer(p);
         if( !s ) continue;
-        int r = _merk->ae(p, treeid, & s->bestaddr, &nsync, &mism);
-        if( !r ) ok = 0;
-        VERBOSE("ae %s ok=%d mismatch=%lld synced=%lld", _name.c_str(), r, mism, nsync);
+
+        AESweep *sw = new AESweep;
+        sw->peer   = & s->bestaddr;
+        sw->part   = p;
+        sw->treeid = _ring->treeid(p);
+        sweep.push_back(sw);
+
+        DEBUG("AE check %s[%d](%d) with %s", _name.c_str(), p, sw->treeid, sw->peer->name.c_str());
+        // start at the root
+        ae_pool.add( -1, _merk, sw, MERKLE_HEIGHT - MERKLE_BUILD, 0 );
+    }
+
+    ae_pool.wait( &sweep );
+
+    for(int i=0; i<sweep.size(); i++){
+        AESweep *sw = sweep[i];
+        if( !sw->ok || sw->abort ) ok = 0;
+        VERBOSE("ae %s[%d] ok=%d mismatch=%lld synced=%lld", _name.c_str(), sw->part, sw->ok, sw->mismatch, sw->nsynced);
+        delete sw;
     }
 
     return ok;
@@ -116,74 +189,160 @@ Ring::random_peer(int part, const NetAddr *butnot){
 
 /****************************************************************/
 
+static void *
+ae_worker_start(void *x){
+    ae_pool.worker( (int)(long)x );
+    return 0;
+}
 
-struct ToDo {
-    uint64_t	version;
-    int		level;
-};
+// started once, the first time we run
+void
+AEPool::start(void){
 
-class BadNode {
-    bool         emptyp;;
-    deque<ToDo*> dq;
-    Mutex	 lock;
-public:
-    void add(int level, uint64_t ver);
-    bool empty(void);
-    ToDo *pop(void);
-};
+    if( _nworker ) return;
 
-bool
-BadNode::empty(void){
+    int n = config->ae_threads;
+    if( n < 1 ) n = 1;
 
-    return emptyp;
+    _dq     = new deque<AETask>[n];
+    _dqlock = new Mutex[n];
+    _nworker = n;
+
+    DEBUG("starting %d ae threads", n);
+    for(int i=0; i<n; i++){
+        start_thread( ae_worker_start, (void*)(long)i, 0 );
+    }
 }
 
+// wkr = -1 => anyone
 void
-BadNode::add(int l, uint64_t v){
+AEPool::add(int wkr, Merkle *mk, AESweep *sw, int level, uint64_t ver){
+    AETask t;
+
+    t.mk      = mk;
+    t.sweep   = sw;
+    t.level   = level;
+    t.version = ver;
+
+    if( wkr < 0 ) wkr = random_n(_nworker);
 
-    lock.lock();
+    _lock.lock();
+    sw->pending ++;
+    _nqueued ++;
+    _lock.unlock();
 
-    ToDo *t = new ToDo;
-    t->level   = l;
-    t->version = v;
-    dq.push_back(t);
-    emptyp = 0;
+    _dqlock[wkr].lock();
+    _dq[wkr].push_back(t);
+    _dqlock[wkr].unlock();
 
-    lock.unlock();
+    _lock.lock();
+    _work.signal();
+    _lock.unlock();
 }
 
-ToDo*
-BadNode::pop(void){
-    ToDo *t = 0;
+// up to max tasks, all from the same sweep, so they can share a connection
+int
+AEPool::take(int wkr, AETask *t, int max){
+    int n = 0;
+
+    // our own, newest first
+    _dqlock[wkr].lock();
+    while( n < max && !_dq[wkr].empty() ){
+        AETask &e = _dq[wkr].back();
+        if( n && e.sweep != t[0].sweep ) break;
+        t[n++] = e;
+        _dq[wkr].pop_back();
+    }
+    _dqlock[wkr].unlock();
+
+    // steal someone else's oldest
+    int r = random_n(_nworker);
+    for(int i=0; !n && i<_nworker; i++){
+        int v = (r + i) % _nworker;
+        if( v == wkr ) continue;
+
+        _dqlock[v].lock();
+        while( n < max && !_dq[v].empty() ){
+            AETask &e = _dq[v].front();
+            if( n && e.sweep != t[0].sweep ) break;
+            t[n++] = e;
+            _dq[v].pop_front();
+        }
+        _dqlock[v].unlock();
+    }
+
+    if( n ){
+        _lock.lock();
+        _nqueued -= n;
+        _lock.unlock();
+    }
+
+    return n;
+}
 
-    // process nodes in LIFO order - walks in DFS order, and keeps list small
-    // FIFO order => breadth-first => big list
+void
+AEPool::done(AESweep *sw, int ntask, int64_t mism, int64_t nsync, bool ok, bool failed){
 
-    lock.lock();
-    if( dq.empty() ){
-        emptyp = 1;
+    _lock.lock();
+    sw->pending  -= ntask;
+    sw->mismatch += mism;
+    sw->nsynced  += nsync;
+    if( !ok ) sw->ok = 0;
+
+    if( failed ){
+        // give up on this peer
+        if( ++ sw->errs > MAXERR ) sw->abort = 1;
     }else{
-        t = dq.back();
-        dq.pop_back();
+        sw->errs = 0;
     }
-    lock.unlock();
-    return t;
+
+    if( !sw->pending ) _done.broadcast();
+    _lock.unlock();
 }
 
-class Tinfo {
-public:
-    Merkle  *mk;
-    BadNode *bn;
-    NetAddr *peer;
-    int      part;
-    int      treeid;
-    bool     ok;
-    bool     active;
-    int64_t  mismatch;
-    int64_t  nsynced;
-
-    Tinfo(){ ok = 1; active = 0; mismatch = 0; nsynced = 0; mk = 0; bn = 0;}
-};
+// until every sweep is finished
+void
+AEPool::wait(vector<AESweep*> *sweep){
+
+    _lock.lock();
+    while(1){
+        bool busy = 0;
+        for(int i=0; i<sweep->size(); i++){
+            if( sweep->at(i)->pending ) busy = 1;
+        }
+        if( !busy ) break;
+        _done.timedwait( &_lock, 1000 );
+    }
+    _lock.unlock();
+}
+
+void
+AEPool::worker(int wkr){
+    AETask task[PIPELINE];
+
+    while(1){
+        _lock.lock();
+        while( _nqueued <= 0 ){
+            _work.timedwait( &_lock, 1000 );
+        }
+        _lock.unlock();
+
+        int n = take(wkr, task, PIPELINE);
+        if( !n ) continue;
+
+        AESweep *sw = task[0].sweep;
+
+        if( sw->abort || runmode.is_stopping() ){
+            // drop them
+            done(sw, n, 0, 0, 0, 0);
+            continue;
+        }
+
+        task[0].mk->ae_check(wkr, task, n);
+    }
+}
+
+/****************************************************************/
 
 
 static int
@@ -197,210 +356,284 @@ highest_level(ACPY2CheckReply &r){
     return h;
 }
 
+// fetch the keys we are missing from the peer, streamed down one connection
+class AEFetch : public BulkXfer {
+    Merkle      *_mk;
+    AESweep     *_sweep;
+    ACPY2GetSet *_cur;
+    ACPY2GetSet  _reply;
+
+    virtual void on_reply(google::protobuf::Message *, google::protobuf::Message *);
+public:
+    bool         ok;
+
+    AEFetch(Merkle *, AESweep *);
+    virtual ~AEFetch();
+    ACPY2MapDatum *add(void);
+    void flush(void);
+};
+
+AEFetch::AEFetch(Merkle *mk, AESweep *sw)
+    : BulkXfer(sw->peer, PHMT_Y2_GET, TIMEOUT) {
+
+    _mk    = mk;
+    _sweep = sw;
+    _cur   = 0;
+    _res   = &_reply;
+    ok     = 1;
+}
+
+AEFetch::~AEFetch(){
+    flush();
+}
+
+ACPY2MapDatum *
+AEFetch::add(void){
+
+    if( _cur && _cur->data_size() >= FETCHCHUNK ){
+        send(_cur);
+        _cur = 0;
+    }
+    if( !_cur ) _cur = new ACPY2GetSet;
+
+    return _cur->add_data();
+}
+
+void
+AEFetch::flush(void){
+
+    if( _cur && _cur->data_size() ){
+        send(_cur);
+        _cur = 0;
+    }
+    delete _cur;
+    _cur = 0;
+
+    finish();
+}
+
 void
-ae_work_start( Tinfo *ti ){
-    ti->mk->ae_work( ti );
+AEFetch::on_reply(google::protobuf::Message *req, google::protobuf::Message *res){
+
+    if( res ){
+        _mk->ae_fetched( _sweep->treeid, (ACPY2GetSet*)res );
+        return;
+    }
+
+    // failed - try again, the old way. which will also try another server
+    if( ! _mk->ae_fetch(_sweep->part, _sweep->treeid, (ACPY2GetSet*)req, _sweep->peer) ) ok = 0;
 }
 
 /****************************************************************/
 
+// per batch state, while checking with a peer
+struct AEBatch {
+    AESweep     *sweep;
+    int          wkr;
+    hrtime_t     tnew;
+    MerkleCache  cache;
+    AEFetch     *fetch;
+    int64_t      mismatch;
+    int64_t      nsynced;
+    bool         ok;
+};
+
+// check a batch of nodes with the peer
+// peers that can, diff whole subtrees at once. others, one node at a time.
 void
-Merkle::ae_work(Tinfo *ti){
+Merkle::ae_check(int wkr, AETask *task, int ntask){
     ACPY2CheckRequest  req;
+    ACPY2DiffRequest   dreq;
     ACPY2CheckReply    res;
-    ACPY2GetSet        getreq;
-    MerkleCache        cache;
-    BadNode           *badnode = ti->bn;
-    hrtime_t           tnew    = lr_usec() - TOONEW;
-    int                errs    = 0;
+    AEBatch            b;
+    AESweep           *sw = task[0].sweep;
+    PConn              pc(sw->peer, TIMEOUT);
+    AEFetch            fetch(this, sw);
+    uint32_t           msgid[PIPELINE];
+    bool               isdiff[PIPELINE];
+    int                ndone  = 0;
+    bool               failed = 0;
+
+    stats.last_ae_time = lr_now();
+
+    b.sweep    = sw;
+    b.fetch    = &fetch;
+    b.wkr      = wkr;
+    b.tnew     = lr_usec() - TOONEW;
+    b.mismatch = 0;
+    b.nsynced  = 0;
+    b.ok       = 1;
 
-    ti->active = 1;
     req.set_map( _be->_name );
-    req.set_treeid( ti->treeid );
+    req.set_treeid( sw->treeid );
     req.set_maxresult( MAXRESULTS );
 
 
-    while( 1 ){
-        stats.last_ae_time = lr_now();
+    while( ndone < ntask && !failed ){
         if( runmode.is_stopping() ) break;
+        if( sw->abort ) break;
+
+        // send as many requests down the connection as it will take
+        // before waiting for any of the replies
+        int depth = pc.pipeline_depth(PIPELINE);
+        int nsent = 0;
+
+        while( nsent < depth && ndone + nsent < ntask ){
+            AETask *t = task + ndone + nsent;
+            int r;
+
+            if( t->level < 11 ) DEBUG(" check node %02d_%016llX", t->level, t->version);
+            // build request + send to peer
+            isdiff[nsent] = !sw->nodiff && t->level < MERKLE_HEIGHT;
+
+            if( isdiff[nsent] ){
+                dreq.Clear();
+                dreq.set_map( _be->_name );
+                dreq.set_treeid( sw->treeid );
+                dreq.set_level( t->level );
+                dreq.set_version( t->version );
+                dreq.set_maxresult( MAXRESULTS );
+                diff_request( t->level, sw->treeid, t->version, &dreq );
+
+                r = pc.send(PHMT_Y2_DIFF, &dreq, msgid + nsent);
+            }else{
+                req.set_level(   t->level );
+                req.set_version( t->version );
 
-        ToDo *t = badnode->pop();
-        if( !t ){
-            sleep(5);
-            t = badnode->pop();
-        }
-        if( !t ) break;
-
-        if( t->level < 11 ) DEBUG(" check node %02d_%016llX", t->level, t->version);
-        // build request + send to peer
-        req.set_level(   t->level );
-        req.set_version( t->version );
-        delete t;
-
-        int r = make_request(ti->peer, PHMT_Y2_CHECK, TIMEOUT, &req, &res);
-        if( !r ){
-            DEBUG(" conversation failed");
-            ti->ok = 0;
+                r = pc.send(PHMT_Y2_CHECK, &req, msgid + nsent);
+            }
 
-            if( ++errs > MAXERR ) break;
-            continue;
+            if( !r ){
+                failed = 1;
+                break;
+            }
+            nsent ++;
         }
-        int added = 0;
-        errs = 0;
-        // compare results
-        // find highest level result, ignore others
-        int highest = highest_level(res);
-        // DEBUG("  got %d highest at %d", res.check_size(), highest);
-
-        for(int i=0; i<res.check_size(); i++){
-            ACPY2CheckValue *c = res.mutable_check(i);
-            if( c->level() < highest ) continue;
-            if( c->version() > tnew )  continue;	// too new, don't bother
-
-            if( c->level() > MERKLE_HEIGHT ){
-                // do we need this key?
-                // DEBUG("  key %02d_%016llX %s", c->level(), c->version(), c->key().c_str());
-
-                int  npart = _be->_ring->partno( c->shard() );
-                bool local = (npart == ti->part) || _be->_ring->is_local(npart);
-                if( !local ) continue;
-                if( c->key().empty() ) continue;
-
-                int64_t havever = _be->have_ver( c->key() );
-                bool want = havever < c->version();
-
-                if( want ){
-                    ti->nsynced  ++;
-                    added ++;
-                    ACPY2MapDatum *d = getreq.add_data();
-                    d->set_map( _be->_name );
-                    d->set_key( c->key() );
-                    d->set_version( c->version() );
-                    //DEBUG("   need key %s", c->key().c_str());
-
-                    if( getreq.data_size() >= MAXFETCH ){
-                        // process keys
-                        if( ! ae_fetch(ti->part, ti->treeid, &getreq, ti->peer) ) ti->ok = 0;
-                    }
-                }else if( havever == c->version() ){
-                    // we went this far for a key we already have
-                    // make sure it is in the merkle tree
-                    if( db_uptodate && _be->_ring->is_stable() && ! exists( c->key(), ti->treeid, c->shard(), c->version() ) ){
-                        VERBOSE("   +fix key %016llX %s", c->version(), c->key().c_str());
-                        add( c->key(), ti->treeid, c->shard(), c->version() );
-                        // fix( ti->treeid, c->version() );
-                    }else{
-                        // DEBUG("   ok key %016llX %s", c->version(), c->key().c_str());
-                    }
-                }else{
-                    DEBUG("   dont want key have=%016llX != offer=%016llX %s", havever, c->version(), c->key().c_str());
 
-                    if( db_uptodate && _be->_ring->is_stable() && exists( c->key(), ti->treeid, c->shard(), c->version() ) ){
-                        VERBOSE("   -fix key %016llX %s", c->version(), c->key().c_str());
-                        del( c->key(), ti->treeid, c->shard(), c->version() );
-                    }
-                }
-
-            }else{
-
-                // check the hash
-                if( c->isvalid() && !compare_result( &cache, c ) ){
-                    // hash mismatch
-                    badnode->add( c->level(), c->version() );
-                    ti->mismatch ++;
-                    added ++;
-                    // DEBUG("  node %02d_%016llX  => ne", c->level(), c->version());
-                }else{
-                    // hash same
-                    // DEBUG("  node %02d_%016llX  => OK", c->level(), c->version());
+        for(int i=0; i<nsent && !failed; i++){
+            AETask *t = task + ndone;
+
+            if( !pc.recv(msgid[i], &res) ){
+                if( isdiff[i] && pc.error_reply() && !pc.error_code() ){
+                    // older peer, does not know diffs. check this one again, the old way
+                    // (any other error, eg. shutting down, is just a failure)
+                    VERBOSE("AE %s: peer %s does not support diff", _be->_name.c_str(), sw->peer->name.c_str());
+                    sw->nodiff = 1;
+                    ae_pool.add( wkr, this, sw, t->level, t->version );
+                    ndone ++;
+                    continue;
                 }
+                failed = 1;
+                break;
             }
+            ndone ++;
+            throttle(THROT_REPLICATION, THROT_NET, res.ByteSize());
+
+            if( res.hashalg() != hash_scheme() ){
+                // the hashes will never match. don't fetch everything
+                VERBOSE("AE %s: peer %s uses merkle hash %X, not %X", _be->_name.c_str(), sw->peer->name.c_str(),
+                        res.hashalg(), hash_scheme());
+                sw->abort = 1;
+                b.ok = 0;
+                break;
+            }
+
+            ae_result(&b, t, &res, isdiff[i]);
         }
-#if 1
-        if( !added && req.level() && db_uptodate && _be->_ring->is_stable() ){
-            // we requested this node, but nothing under it was missing
-            DEBUG("fix node %x %d %016llX", ti->treeid, req.level(), req.version());
-            fix( ti->treeid, req.level(), req.version() );
-        }
-#endif
     }
 
-    if( ! ae_fetch( ti->part, ti->treeid, &getreq, ti->peer ) ) ti->ok = 0;
-    ti->active = 0;
-}
-
-
-bool
-Merkle::ae(int part, int treeid, NetAddr *peer, uint64_t *nsync, uint64_t *mism){
-    bool    ok       = 1;
-    int64_t mismatch = 0;
-    int64_t synced   = 0;
-    BadNode badnode;
-
-    DEBUG("AE check %s[%d](%d) with %s", _be->_name.c_str(), part, treeid, peer->name.c_str());
-
-    *nsync = 0;
-    *mism  = 0;
-    int nthr = config->ae_threads;
-    Tinfo *ti = new Tinfo[nthr];
-
-    // init helper thread info
-    for(int i=0; i<nthr; i++){
-        ti[i].mk     = this;
-        ti[i].bn     = &badnode;
-        ti[i].peer   = peer;
-        ti[i].treeid = treeid;
-        ti[i].part   = part;
+    if( failed ){
+        DEBUG(" conversation failed");
+        b.ok = 0;
+        // try these again later (unless we give up on the peer)
+        for( ; ndone<ntask; ndone++){
+            ae_pool.add( wkr, this, sw, task[ndone].level, task[ndone].version );
+        }
     }
 
-    // start at the root
-    badnode.add( MERKLE_HEIGHT - MERKLE_BUILD, 0 );
+    fetch.flush();
+    if( !fetch.ok ) b.ok = 0;
+    ae_pool.done(sw, ntask, b.mismatch, b.nsynced, b.ok, failed);
+}
 
-    // start/restart threads
-    // start one thread, wait. if still work to do, start another, wait, etc.
-    while(1){
-        if( runmode.is_stopping() ) break;
-        if( badnode.empty() )       break;
-
-        for(int i=0; i<nthr; i++){
-            if( runmode.is_stopping() ) break;
-            if( badnode.empty() )       break;
-            if( ti[i].active )          continue;
-
-            DEBUG("starting ae thread");
-            start_thread( (void* (*)(void*))ae_work_start, (void*)(ti + i), 0 );
-
-            // delay before starting more
-            int d;
-            if( !i ){
-                d = 60;
-            }else if( i < nthr/2 ){
-                d = 30;
+// compare the peer's reply with our tree
+void
+Merkle::ae_result(AEBatch *b, AETask *t, ACPY2CheckReply *res, bool isdiff){
+    AESweep *sw = b->sweep;
+    int added   = 0;
+
+    // compare results
+    // find highest level result, ignore others
+    // a diff reply is already just the differences, at any level
+    int highest = isdiff ? 0 : highest_level(*res);
+    // DEBUG("  got %d highest at %d", res->check_size(), highest);
+
+    for(int i=0; i<res->check_size(); i++){
+        ACPY2CheckValue *c = res->mutable_check(i);
+        if( c->level() < highest ) continue;
+        if( c->version() > b->tnew ) continue;	// too new, don't bother
+
+        if( c->level() > MERKLE_HEIGHT ){
+            // do we need this key?
+            // DEBUG("  key %02d_%016llX %s", c->level(), c->version(), c->key().c_str());
+
+            int  npart = _be->_ring->partno( c->shard() );
+            bool local = (npart == sw->part) || _be->_ring->is_local(npart);
+            if( !local ) continue;
+            if( c->key().empty() ) continue;
+
+            int64_t havever = _be->have_ver( c->key() );
+            bool want = havever < c->version();
+
+            if( want ){
+                b->nsynced ++;
+                added ++;
+                // sent as soon as there are enough
+                ACPY2MapDatum *d = b->fetch->add();
+                d->set_map( _be->_name );
+                d->set_key( c->key() );
+                d->set_version( c->version() );
+                //DEBUG("   need key %s", c->key().c_str());
+            }else if( havever == c->version() ){
+                // we went this far for a key we already have
+                // make sure it is in the merkle tree
+                if( db_uptodate && _be->_ring->is_stable() && ! exists( c->key(), sw->treeid, c->shard(), c->version() ) ){
+                    VERBOSE("   +fix key %016llX %s", c->version(), c->key().c_str());
+                    add( c->key(), sw->treeid, c->shard(), c->version() );
+                }else{
+                    // DEBUG("   ok key %016llX %s", c->version(), c->key().c_str());
+                }
             }else{
-                d = 60;
+                DEBUG("   dont want key have=%016llX != offer=%016llX %s", havever, c->version(), c->key().c_str());
+
+                if( db_uptodate && _be->_ring->is_stable() && exists( c->key(), sw->treeid, c->shard(), c->version() ) ){
+                    VERBOSE("   -fix key %016llX %s", c->version(), c->key().c_str());
+                    del( c->key(), sw->treeid, c->shard(), c->version() );
+                }
             }
 
-            for(int j=0; j<d; j++){
-                sleep(1);
-                if( runmode.is_stopping() ) break;
-                if( badnode.empty() )       break;
+        }else{
 
+            // check the hash
+            if( c->isvalid() && !compare_result( &b->cache, c ) ){
+                // hash mismatch - on our own deque, someone may steal it
+                ae_pool.add( b->wkr, this, sw, c->level(), c->version() );
+                b->mismatch ++;
+                added ++;
+                // DEBUG("  node %02d_%016llX  => ne", c->level(), c->version());
+            }else{
+                // hash same
+                // DEBUG("  node %02d_%016llX  => OK", c->level(), c->version());
             }
         }
     }
-
-    // wait until all threads done
-    for(int i=0; i<nthr; i++){
-        while( ti[i].active ) sleep(1);
-        mismatch += ti[i].mismatch;
-        synced   += ti[i].nsynced;
-        if( ! ti[i].ok ) ok = 0;
+#if 1
+    if( !added && t->level && db_uptodate && _be->_ring->is_stable() ){
+        // we requested this node, but nothing under it was missing
+        DEBUG("fix node %x %d %016llX", sw->treeid, t->level, t->version);
+        fix( sw->treeid, t->level, t->version );
     }
-
-    delete [] ti;
-    *mism  = mismatch;
-    *nsync = synced;
-    return ok;
+#endif
 }
 
 
@@ -425,26 +658,34 @@ Merkle::ae_fetch(int part, int treeid, ACPY2GetSet *req, NetAddr *peer){
         }
     }
 
-    if( ok ){
-        // process results
-        for(int i=0; i<req->data_size(); i++){
-            ACPY2MapDatum *r = req->mutable_data(i);
-            //DEBUG("   put %s", r->key().c_str());
-            int rp = _be->put( r, (int*)0);
-
-            if( rp == DBPUTST_HAVE ){
-                // we requested this, but already have it? is it missing from the merkle tree?
-                DEBUG("fix key %s", r->key().c_str());
-                add( r->key(), treeid, r->shard(), r->version() );
-                // fix( treeid, r->version() );
-            }
-            INCSTAT( ae_fetched );
-        }
-    }
-
+    if( ok ) ae_fetched(treeid, req);
 
     req->Clear();
 
     return ok;
 }
 
+// store the keys we fetched
+void
+Merkle::ae_fetched(int treeid, ACPY2GetSet *res){
+
+    for(int i=0; i<res->data_size(); i++){
+        ACPY2MapDatum *r = res->mutable_data(i);
+        int size = r->key().size() + r->value().size();
+
+        throttle(THROT_REPLICATION, THROT_NET,  size);
+        throttle(THROT_REPLICATION, THROT_DISK, size);
+
+        //DEBUG("   put %s", r->key().c_str());
+        int rp = _be->put( r, (int*)0);
+
+        if( rp == DBPUTST_HAVE ){
+            // we requested this, but already have it? is it missing from the merkle tree?
+            DEBUG("fix key %s", r->key().c_str());
+            add( r->key(), treeid, r->shard(), r->version() );
+            // fix( treeid, r->version() );
+        }
+        INCSTAT( ae_fetched );
+    }
+}
+
@@ -15,6 +15,8 @@
 #include "merkle.h"
 #include "expire.h"
 #include "database.h"
+#include "blob.h"
+#include "hrtime.h"
 
 #include <ctype.h>
 #include <stdlib.h>
@@ -22,17 +24,25 @@
 #include <string.h>
 
 #include "leveldb/db.h"
+#include "leveldb/write_batch.h"
+#include "leveldb/cache.h"
+#include "leveldb/filter_policy.h"
 
+#define SCANPACE	256	// rows between rate checks
 
 class BE_LevelDB : public Database {
 private:
     leveldb::DB*        _db;
+    leveldb::Cache*	_cache;
+    const leveldb::FilterPolicy* _filter;
 
 public:
     virtual int  _get(char, const string& , string *);
     virtual int  _put(char, const string& , int, const uchar *);
     virtual int  _del(char, const string& );
-    virtual bool _range(char, const string &, const string&, LambdaRange *);
+    virtual bool _range(char, const string &, const string&, LambdaRange *, int flags=0);
+    virtual DBBatch *_batch_begin(void);
+    virtual int  _batch_commit(DBBatch *);
 
     BE_LevelDB(DBConf*);
     virtual ~BE_LevelDB();
@@ -41,6 +51,14 @@ public:
 };
 
 
+class LevelDBBatch : public DBBatch {
+public:
+    leveldb::WriteBatch	wb;
+protected:
+    virtual void _put(const string& k, int len, const uchar *data){ wb.Put(k, leveldb::Slice((const char*)data, len)); }
+    virtual void _del(const string& k){ wb.Delete(k); }
+};
+
 static Database *create_be(DBConf *);
 
 static const BackendConf _be_leveldb_conf( "leveldb", create_be );
@@ -58,6 +76,30 @@ BE_LevelDB::BE_LevelDB(DBConf *cf) : Database(cf) {
 
     leveldb::Options options;
     options.create_if_missing = true;
+
+    _cache  = 0;
+    _filter = 0;
+
+    if( cf->cache_size ){
+        _cache = leveldb::NewLRUCache( cf->cache_size * 1024LL * 1024 );
+        options.block_cache = _cache;
+    }
+    if( cf->bloom_bits ){
+        _filter = leveldb::NewBloomFilterPolicy( cf->bloom_bits );
+        options.filter_policy = _filter;
+    }
+    if( cf->write_buffer )
+        options.write_buffer_size = cf->write_buffer * 1024LL * 1024;
+
+    if( cf->compression == "none" )
+        options.compression = leveldb::kNoCompression;
+    else if( cf->compression == "snappy" )
+        options.compression = leveldb::kSnappyCompression;
+    else
+        PROBLEM("compression '%s' not supported by leveldb, using default", cf->compression.c_str());
+
+    // NB - leveldb has a single compaction thread. 'compactions' is ignored
+
     leveldb::Status status = leveldb::DB::Open(options, cf->pathname.c_str(), &_db);
 
     if( !status.ok() ){
@@ -68,10 +110,14 @@ BE_LevelDB::BE_LevelDB(DBConf *cf) : Database(cf) {
 }
 
 BE_LevelDB::~BE_LevelDB(){
+    if( _blob ) _blob->stop();
     _merk->flush();
     _expr->flush();
     delete _db;
     _db = 0;
+    // the db uses these. delete after closing
+    delete _cache;
+    delete _filter;
     DEBUG("closed");
 }
 
@@ -102,23 +148,42 @@ BE_LevelDB::_del(char sub, const string& key){
 }
 
 bool
-BE_LevelDB::_range(char sub, const string& start, const string& end, LambdaRange *lr){
+BE_LevelDB::_range(char sub, const string& start, const string& end, LambdaRange *lr, int flags){
     MKSUBKEY(k, sub, start);
     bool ret = 1;
+    int64_t nrow = 0;
+    int64_t nbyte = 0;
+    int64_t t0   = hr_usec();
+
+    leveldb::ReadOptions ro;
+    const leveldb::Snapshot *snap = 0;
+
+    if( flags & RANGE_MAINT ){
+        // don't push the hot data out of the cache, and see a stable view
+        snap = _db->GetSnapshot();
+        ro.snapshot   = snap;
+        ro.fill_cache = false;
+    }
 
-    leveldb::Iterator* it = _db->NewIterator(leveldb::ReadOptions());
+    leveldb::Iterator* it = _db->NewIterator(ro);
     for (it->Seek(k); it->Valid(); it->Next()) {
 
+        if( (flags & RANGE_MAINT) && !(flags & RANGE_UNPACED) && (++nrow % SCANPACE) == 0 ){
+            scan_pace(t0, nrow, nbyte);
+            nbyte = 0;
+        }
+
         leveldb::Slice kks = it->key();
         // check + remove prefix
         if( kks[0] != sub ) break;
         kks.remove_prefix(1);
 
-        string kk = kks.ToString();
-        if( end.compare(kk) < 0 ) break;
-        string kv = it->value().ToString();
+        if( kks.compare(leveldb::Slice(end)) > 0 ) break;
+        leveldb::Slice kvs = it->value();
+        nbyte += kks.size() + kvs.size();
 
-        int ok = lr->call( kk, kv );
+        // no copies - the slices are valid until the iterator moves
+        int ok = lr->call( DBSlice(kks.data(), kks.size()), DBSlice(kvs.data(), kvs.size()) );
         if( !ok ){
             ret = 0;
             break;
@@ -126,6 +191,28 @@ BE_LevelDB::_range(char sub, const string& start, const string& end, LambdaRange
     }
 
     delete it;
+    if( snap ) _db->ReleaseSnapshot(snap);
     return ret;	// 0 => terminated prematurely, 1 => reached end
 }
 
+DBBatch *
+BE_LevelDB::_batch_begin(void){
+    return new LevelDBBatch;
+}
+
+int
+BE_LevelDB::_batch_commit(DBBatch *b){
+    LevelDBBatch *bb = (LevelDBBatch*) b;
+    int ok = 1;
+
+    if( b->count ){
+        leveldb::Status s = _db->Write(leveldb::WriteOptions(), & bb->wb);
+        if( !s.ok() ){
+            PROBLEM("write batch failed: %s", s.ToString().c_str());
+            ok = 0;
+        }
+    }
+
+    delete bb;
+    return ok;
+}
@@ -2,7 +2,7 @@
   Copyright (c) 2014
   Author: Jeff Weisberg <jaw @ solvemedia.com>
   Created: 2014-Nov-18 11:56 (EST)
-  Function: leveldb backend
+  Function: rocksdb backend
 
 */
 #define CURRENT_SUBSYSTEM	'b'
@@ -15,6 +15,9 @@
 #include "merkle.h"
 #include "expire.h"
 #include "database.h"
+#include "blob.h"
+#include "dbwire.h"
+#include "hrtime.h"
 
 #include <ctype.h>
 #include <stdlib.h>
@@ -22,25 +25,67 @@
 #include <string.h>
 
 #include "rocksdb/db.h"
+#include "rocksdb/write_batch.h"
+#include "rocksdb/cache.h"
+#include "rocksdb/filter_policy.h"
+#include "rocksdb/table.h"
+
+#include <vector>
+
+#define SCANPACE	256	// rows between rate checks
+#define MIGRATEBATCH	1000	// records per write, when migrating
+#define MIGRATEDKEY	"#migrated"	// in the default family, once the move is done
+
+// each subkey namespace gets its own column family
+static struct {
+    char	sub;
+    const char *name;
+} cfname[] = {
+    { 'd',	"data"      },
+    { 'm',	"merkle"    },
+    { 'x',	"expire"    },
+    { 'p',	"partition" },
+};
 
+#define NCF	(sizeof(cfname) / sizeof(cfname[0]))
 
 class BE_RocksDB : public Database {
 private:
     rocksdb::DB*        _db;
+    rocksdb::ColumnFamilyHandle *_cf[256];	// by subkey. 0 => default family, with prefix
+    rocksdb::ColumnFamilyHandle *_cfdefault;
+    std::vector<rocksdb::ColumnFamilyHandle*> _cfh;
+
+    void migrate(void);
 
 public:
     virtual int  _get(char, const string& , string *);
     virtual int  _put(char, const string& , int, const uchar *);
     virtual int  _del(char, const string& );
-    virtual bool _range(char, const string &, const string&, LambdaRange *);
+    virtual int  _get_meta(char, const string&, DBRecord *);
+    virtual bool _range(char, const string &, const string&, LambdaRange *, int flags=0);
+    virtual DBBatch *_batch_begin(void);
+    virtual int  _batch_commit(DBBatch *);
 
     BE_RocksDB(DBConf*);
     virtual ~BE_RocksDB();
 
     DISALLOW_COPY(BE_RocksDB);
+    friend class RocksDBBatch;
 };
 
 
+class RocksDBBatch : public DBBatch {
+    BE_RocksDB		*_be;
+public:
+    rocksdb::WriteBatch	wb;
+
+    RocksDBBatch(BE_RocksDB *b) { _be = b; }
+protected:
+    virtual void _put(const string& k, int len, const uchar *data);
+    virtual void _del(const string& k);
+};
+
 static Database *create_be(DBConf *);
 
 static const BackendConf _be_rocksdb_conf( "rocksdb", create_be );
@@ -54,33 +99,173 @@ create_be(DBConf *cf){
 
 //################################################################
 
+static struct {
+    const char *name;
+    rocksdb::CompressionType type;
+} compressname[] = {
+    { "none",	rocksdb::kNoCompression    },
+    { "snappy",	rocksdb::kSnappyCompression },
+    { "zlib",	rocksdb::kZlibCompression  },
+    { "bzip2",	rocksdb::kBZip2Compression },
+    { "lz4",	rocksdb::kLZ4Compression   },
+    { "lz4hc",	rocksdb::kLZ4HCCompression },
+};
+
+static rocksdb::CompressionType
+compression_type(const string& name){
+
+    for(int i=0; i<sizeof(compressname)/sizeof(compressname[0]); i++){
+        if( name == compressname[i].name ) return compressname[i].type;
+    }
+
+    PROBLEM("unknown compression '%s', using snappy", name.c_str());
+    return rocksdb::kSnappyCompression;
+}
+
 BE_RocksDB::BE_RocksDB(DBConf *cf) : Database(cf) {
 
     rocksdb::Options options;
 
     // options.statistics = rocksdb::CreateDBStatistics();
 
-    options.write_buffer_size           =  16 * 1024 * 1024;
     options.target_file_size_base       = 256 * 1024 * 1024;
     //options.compaction_readahead_size = 2 * 1024 * 1024;
     options.max_write_buffer_number     = 4;
     options.target_file_size_multiplier = 4;
-    options.max_background_compactions  = 4;
+
+    if( cf->write_buffer )
+        options.write_buffer_size = cf->write_buffer * 1024LL * 1024;
+    if( cf->compactions > 0 ){
+        // compaction threads + 1 flush thread
+        options.IncreaseParallelism( cf->compactions + 1 );
+        options.max_background_compactions = cf->compactions;
+    }
+
+    // block cache + bloom filter. most AE lookups are for keys we do not have
+    rocksdb::BlockBasedTableOptions topt;
+    if( cf->cache_size )
+        topt.block_cache = rocksdb::NewLRUCache( cf->cache_size * 1024LL * 1024 );
+    if( cf->bloom_bits )
+        topt.filter_policy.reset( rocksdb::NewBloomFilterPolicy( cf->bloom_bits ) );
+    options.table_factory.reset( rocksdb::NewBlockBasedTableFactory(topt) );
+
+    options.compression = compression_type( cf->compression );
 
     options.create_if_missing = true;
+    options.create_missing_column_families = true;
+
+    // column families, tuned per namespace
+    std::vector<rocksdb::ColumnFamilyDescriptor> cfd;
+    cfd.push_back( rocksdb::ColumnFamilyDescriptor(rocksdb::kDefaultColumnFamilyName, options) );
+
+    for(int i=0; i<NCF; i++){
+        rocksdb::ColumnFamilyOptions co(options);
+
+        switch( cfname[i].sub ){
+        case 'm':
+            // small, hot, rewritten constantly. hashes do not compress.
+            // smaller files, so the churn compacts quickly and stays out of the data files
+            co.compression = rocksdb::kNoCompression;
+            co.target_file_size_base = 16 * 1024 * 1024;
+            co.target_file_size_multiplier = 1;
+            // compact early + keep the levels small, so overwritten nodes are dropped quickly
+            co.level0_file_num_compaction_trigger = 2;
+            co.max_bytes_for_level_base = 64 * 1024 * 1024;
+            co.max_bytes_for_level_multiplier = 8;
+            break;
+        case 'x':
+        case 'p':
+            co.target_file_size_base = 16 * 1024 * 1024;
+            break;
+        default:
+            // data: large, mostly write once. as configured
+            break;
+        }
+        cfd.push_back( rocksdb::ColumnFamilyDescriptor(cfname[i].name, co) );
+    }
 
-    rocksdb::Status status = rocksdb::DB::Open(options, cf->pathname.c_str(), &_db);
+    rocksdb::Status status = rocksdb::DB::Open(options, cf->pathname.c_str(), cfd, &_cfh, &_db);
 
     if( !status.ok() ){
         FATAL("cannot open db '%s': %s", cf->pathname.c_str(), status.ToString().c_str());
     }
 
+    memset(_cf, 0, sizeof(_cf));
+    _cfdefault = _cfh[0];
+    for(int i=0; i<NCF; i++){
+        _cf[ (uchar)cfname[i].sub ] = _cfh[i + 1];
+    }
+
     VERBOSE("opened database '%s'", cf->pathname.c_str());
+
+    migrate();
+}
+
+// older databases kept everything in the default column family,
+// with the subkey as a prefix. move it to the per-subkey families.
+void
+BE_RocksDB::migrate(void){
+    rocksdb::ReadOptions ro;
+    rocksdb::WriteBatch  wb;
+    string done;
+    int64_t n = 0;
+
+    // already done?
+    rocksdb::Status ms = _db->Get(rocksdb::ReadOptions(), _cfdefault, MIGRATEDKEY, &done);
+    if( ms.ok() ) return;
+
+    ro.fill_cache = false;
+    rocksdb::Iterator *it = _db->NewIterator(ro, _cfdefault);
+
+    for(it->SeekToFirst(); it->Valid(); it->Next()){
+        rocksdb::Slice k = it->key();
+        if( !k.size() ) continue;
+
+        rocksdb::ColumnFamilyHandle *cf = _cf[ (uchar)k[0] ];
+        if( !cf ) continue;
+
+        if( !n ) VERBOSE("migrating database to column families");
+
+        wb.Put(cf, rocksdb::Slice(k.data() + 1, k.size() - 1), it->value());
+        wb.Delete(_cfdefault, k);
+        n ++;
+
+        if( n % MIGRATEBATCH == 0 ){
+            rocksdb::Status s = _db->Write(rocksdb::WriteOptions(), &wb);
+            if( !s.ok() ) FATAL("migration failed: %s", s.ToString().c_str());
+            wb.Clear();
+        }
+        if( n % 1000000 == 0 ) VERBOSE("migrated %lld", n);
+    }
+
+    if( n % MIGRATEBATCH ){
+        rocksdb::Status s = _db->Write(rocksdb::WriteOptions(), &wb);
+        if( !s.ok() ) FATAL("migration failed: %s", s.ToString().c_str());
+    }
+
+    delete it;
+
+    if( n ){
+        VERBOSE("migrated %lld records", n);
+        // the old copies are all tombstones now. get rid of them
+        rocksdb::Status s = _db->CompactRange(_cfdefault, 0, 0);
+        if( !s.ok() ) PROBLEM("compact failed: %s", s.ToString().c_str());
+    }
+
+    rocksdb::Status s = _db->Put(rocksdb::WriteOptions(), _cfdefault, MIGRATEDKEY, "1");
+    if( !s.ok() ) PROBLEM("cannot mark database migrated: %s", s.ToString().c_str());
 }
 
 BE_RocksDB::~BE_RocksDB(){
+    if( _blob ) _blob->stop();
     _merk->flush();
     _expr->flush();
+
+    for(int i=0; i<_cfh.size(); i++){
+        _db->DestroyColumnFamilyHandle( _cfh[i] );
+    }
+    _cfh.clear();
+
     delete _db;
     _db = 0;
     DEBUG("closed");
@@ -88,24 +273,65 @@ BE_RocksDB::~BE_RocksDB(){
 
 int
 BE_RocksDB::_get(char sub, const string& key, string *res){
+    rocksdb::ColumnFamilyHandle *cf = _cf[ (uchar)sub ];
+
+    if( cf ){
+        rocksdb::Status s = _db->Get(rocksdb::ReadOptions(), cf, key, res);
+        return s.ok();
+    }
+
     MKSUBKEY(k, sub, key);
 
     rocksdb::Status s = _db->Get(rocksdb::ReadOptions(), k, res);
     return s.ok();
 }
 
+// pin the value in the block cache, copy out only the header
+int
+BE_RocksDB::_get_meta(char sub, const string& key, DBRecord *res){
+    rocksdb::ColumnFamilyHandle *cf = _cf[ (uchar)sub ];
+    rocksdb::PinnableSlice ps;
+    rocksdb::Status s;
+
+    if( cf ){
+        s = _db->Get(rocksdb::ReadOptions(), cf, key, &ps);
+    }else{
+        MKSUBKEY(k, sub, key);
+        s = _db->Get(rocksdb::ReadOptions(), _cfdefault, k, &ps);
+    }
+
+    if( !s.ok() || ps.size() < sizeof(DBRecord) ) return 0;
+
+    memcpy(res, ps.data(), sizeof(DBRecord));
+    return 1;
+}
+
 int
 BE_RocksDB::_put(char sub, const string& key, int len, const uchar *data){
+    rocksdb::ColumnFamilyHandle *cf = _cf[ (uchar)sub ];
+    rocksdb::Slice ds( (char*)data, len);
+
+    if( cf ){
+        rocksdb::Status s = _db->Put(rocksdb::WriteOptions(), cf, key, ds);
+        return s.ok();
+    }
+
     MKSUBKEY(k, sub, key);
 
     // DEBUG("=>%s", k.c_str());
-    rocksdb::Slice ds( (char*)data, len);
     rocksdb::Status s = _db->Put(rocksdb::WriteOptions(), k, ds);
     return s.ok();
 }
 
 int
 BE_RocksDB::_del(char sub, const string& key){
+    rocksdb::ColumnFamilyHandle *cf = _cf[ (uchar)sub ];
+
+    if( cf ){
+        _db->Delete(rocksdb::WriteOptions(), cf, key);
+        return 1;
+    }
+
     MKSUBKEY(k, sub, key);
 
     _db->Delete(rocksdb::WriteOptions(), k);
@@ -113,24 +339,56 @@ BE_RocksDB::_del(char sub, const string& key){
 }
 
 bool
-BE_RocksDB::_range(char sub, const string& start, const string& end, LambdaRange *lr){
-    MKSUBKEY(k, sub, start);
+BE_RocksDB::_range(char sub, const string& start, const string& end, LambdaRange *lr, int flags){
+    rocksdb::ColumnFamilyHandle *cf = _cf[ (uchar)sub ];
     bool ret = 1;
+    int64_t nrow = 0;
+    int64_t nbyte = 0;
+    int64_t t0   = hr_usec();
+
+    rocksdb::ReadOptions ro;
+    const rocksdb::Snapshot *snap = 0;
+
+    if( flags & RANGE_MAINT ){
+        // don't push the hot data out of the cache, and see a stable view
+        snap = _db->GetSnapshot();
+        ro.snapshot   = snap;
+        ro.fill_cache = false;
+        ro.readahead_size = _scan_readahead;
+    }
 
-    rocksdb::Iterator* it = _db->NewIterator(rocksdb::ReadOptions());
-    for (it->Seek(k); it->Valid(); it->Next()) {
+    rocksdb::Iterator* it;
+
+    if( cf ){
+        it = _db->NewIterator(ro, cf);
+        it->Seek(start);
+    }else{
+        MKSUBKEY(k, sub, start);
+        it = _db->NewIterator(ro);
+        it->Seek(k);
+    }
+
+    for ( ; it->Valid(); it->Next()) {
+
+        if( (flags & RANGE_MAINT) && !(flags & RANGE_UNPACED) && (++nrow % SCANPACE) == 0 ){
+            scan_pace(t0, nrow, nbyte);
+            nbyte = 0;
+        }
 
         rocksdb::Slice kks = it->key();
 
-        // check + remove prefix
-        if( kks[0] != sub ) break;
-        kks.remove_prefix(1);
+        if( !cf ){
+            // check + remove prefix
+            if( kks[0] != sub ) break;
+            kks.remove_prefix(1);
+        }
 
-        string kk = kks.ToString();
-        if( end.compare(kk) < 0 ) break;
-        string kv = it->value().ToString();
+        if( kks.compare(rocksdb::Slice(end)) > 0 ) break;
+        rocksdb::Slice kvs = it->value();
+        nbyte += kks.size() + kvs.size();
 
-        int ok = lr->call( kk, kv );
+        // no copies - the slices are valid until the iterator moves
+        int ok = lr->call( DBSlice(kks.data(), kks.size()), DBSlice(kvs.data(), kvs.size()) );
         if( !ok ){
             ret = 0;
             break;
@@ -138,6 +396,52 @@ BE_RocksDB::_range(char sub, const string& start, const string& end, LambdaRange
     }
 
     delete it;
+    if( snap ) _db->ReleaseSnapshot(snap);
     return ret;	// 0 => terminated prematurely, 1 => reached end
 }
 
+DBBatch *
+BE_RocksDB::_batch_begin(void){
+    return new RocksDBBatch(this);
+}
+
+int
+BE_RocksDB::_batch_commit(DBBatch *b){
+    RocksDBBatch *bb = (RocksDBBatch*) b;
+    int ok = 1;
+
+    if( b->count ){
+        rocksdb::Status s = _db->Write(rocksdb::WriteOptions(), & bb->wb);
+        if( !s.ok() ){
+            PROBLEM("write batch failed: %s", s.ToString().c_str());
+            ok = 0;
+        }
+    }
+
+    delete bb;
+    return ok;
+}
+
+//################################################################
+
+// k includes the subkey prefix
+void
+RocksDBBatch::_put(const string& k, int len, const uchar *data){
+    rocksdb::ColumnFamilyHandle *cf = _be->_cf[ (uchar)k[0] ];
+    rocksdb::Slice v( (const char*)data, len );
+
+    if( cf )
+        wb.Put(cf, rocksdb::Slice(k.data() + 1, k.size() - 1), v);
+    else
+        wb.Put(k, v);
+}
+
+void
+RocksDBBatch::_del(const string& k){
+    rocksdb::ColumnFamilyHandle *cf = _be->_cf[ (uchar)k[0] ];
+
+    if( cf )
+        wb.Delete(cf, rocksdb::Slice(k.data() + 1, k.size() - 1));
+    else
+        wb.Delete(k);
+}
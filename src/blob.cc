@@ -0,0 +1,391 @@
+/*
+  Copyright (c) 2015
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2015-Mar-09 14:02 (EDT)
+  Function: storage of large values outside of the database
+
+*/
+
+#define CURRENT_SUBSYSTEM	'D'
+
+#include "defs.h"
+#include "diag.h"
+#include "config.h"
+#include "misc.h"
+#include "thread.h"
+#include "hrtime.h"
+#include "lock.h"
+#include "runmode.h"
+#include "database.h"
+#include "blob.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <vector>
+
+#define GCINTERVAL	600	// seconds
+
+// one maintenance thread per store
+static void*
+blob_maint(void *x){
+    BlobStore *b = (BlobStore*)x;
+
+    b->maint();
+    return 0;
+}
+
+//################################################################
+
+// a store is needed to put new values in, or to read the old ones
+bool
+BlobStore::in_use(DBConf *cf){
+    struct stat st;
+
+    if( cf->blob_min ) return 1;
+    string dir = cf->pathname + ".blob";
+    return stat( dir.c_str(), &st ) == 0;
+}
+
+BlobStore::BlobStore(Database *be, DBConf *cf){
+    _be      = be;
+    _dir     = cf->pathname + ".blob";
+    _maxsize = cf->blob_file_size * 1024LL * 1024;
+    _gcpct   = cf->blob_gc;
+    _curno   = 0;
+    _curfd   = -1;
+    _cursize = 0;
+    _stop    = 0;
+
+    // find existing files
+    DIR *d = opendir( _dir.c_str() );
+    if( d ){
+        struct dirent *de;
+        string path;
+
+        while( (de = readdir(d)) ){
+            int n;
+            if( sscanf(de->d_name, "%d.blob", &n) != 1 ) continue;
+
+            filename(n, &path);
+            int fd = open(path.c_str(), O_RDONLY);
+            if( fd == -1 ){
+                PROBLEM("cannot open blob file %s: %s", path.c_str(), strerror(errno));
+                continue;
+            }
+            _fds[n] = fd;
+            if( n > _curno ) _curno = n;
+        }
+        closedir(d);
+        DEBUG("blob store %s: %d files", _dir.c_str(), _fds.size());
+    }
+
+    // new values go into a new file, created when needed
+    // NB: not detached - we wait for it to finish before going away
+    _mrunning = pthread_create(&_mtid, 0, blob_maint, (void*)this) == 0;
+    if( !_mrunning ) PROBLEM("cannot create blob maintenance thread");
+}
+
+BlobStore::~BlobStore(){
+
+    stop();
+
+    for(std::map<int,int>::iterator it=_fds.begin(); it != _fds.end(); it++){
+        close( it->second );
+    }
+}
+
+// stop the maintenance thread, and wait for it
+// the database calls this before it closes
+void
+BlobStore::stop(void){
+
+    _mlock.lock();
+    _stop = 1;
+    _mcond.broadcast();
+    bool running = _mrunning;
+    _mrunning = 0;
+    _mlock.unlock();
+
+    if( running ) pthread_join(_mtid, 0);
+}
+
+bool
+BlobStore::stopping(void){
+    return _stop || runmode.is_stopping();
+}
+
+// sleep for a while. 1 => time to stop
+bool
+BlobStore::pause(int secs){
+
+    _mlock.lock();
+    for(int i=0; i<secs && !stopping(); i++){
+        _mcond.timedwait(&_mlock, 1000);
+    }
+    _mlock.unlock();
+
+    return stopping();
+}
+
+void
+BlobStore::maint(void){
+
+    if( pause(60) ) return;
+
+    while(1){
+        gc();
+        if( pause(GCINTERVAL) ) return;
+    }
+}
+
+void
+BlobStore::filename(int n, string *path){
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "/%08d.blob", n);
+    path->assign( _dir );
+    path->append( buf );
+}
+
+int
+BlobStore::get_fd(int n){
+    int fd = -1;
+
+    _flock.r_lock();
+    std::map<int,int>::iterator it = _fds.find(n);
+    if( it != _fds.end() ) fd = it->second;
+    _flock.r_unlock();
+
+    return fd;
+}
+
+// _wlock is held
+int
+BlobStore::start_file(void){
+    string path;
+
+    if( _curfd == -1 ) mkdir( _dir.c_str(), 0755 );
+
+    // whatever is in the old file must be on disk before anything in the new one
+    if( _curfd != -1 && fdatasync(_curfd) )
+        PROBLEM("blob sync failed: %s", strerror(errno));
+
+    int n = _curno + 1;
+    filename(n, &path);
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if( fd == -1 ){
+        PROBLEM("cannot create blob file %s: %s", path.c_str(), strerror(errno));
+        return 0;
+    }
+
+    DEBUG("new blob file %s", path.c_str());
+
+    _flock.w_lock();
+    _fds[n] = fd;
+    _flock.w_unlock();
+
+    _curno   = n;
+    _curfd   = fd;
+    _cursize = 0;
+    return 1;
+}
+
+// 0 => failed, caller should store the value inline
+int
+BlobStore::write(const string& key, int shard, int64_t ver, int64_t exp, int len, const uchar *data, BlobPtr *p){
+    BlobHeader h;
+
+    h.magic   = BLOB_MAGIC;
+    h.shard   = shard;
+    h.keylen  = key.size();
+    h.datalen = len;
+    h.ver     = ver;
+    h.expire  = exp;
+
+    struct iovec iov[3];
+    iov[0].iov_base = (char*)&h;
+    iov[0].iov_len  = sizeof(h);
+    iov[1].iov_base = (char*)key.data();
+    iov[1].iov_len  = key.size();
+    iov[2].iov_base = (char*)data;
+    iov[2].iov_len  = len;
+
+    ssize_t tot = sizeof(h) + key.size() + len;
+
+    _wlock.lock();
+
+    if( _curfd == -1 || _cursize >= _maxsize ){
+        if( !start_file() ){
+            _wlock.unlock();
+            return 0;
+        }
+    }
+
+    int64_t off = _cursize;
+    ssize_t w   = writev(_curfd, iov, 3);
+
+    if( w != tot ){
+        PROBLEM("blob write failed: %s", strerror(errno));
+        // the file may now have a partial record. use a new one
+        _cursize = _maxsize;
+        _wlock.unlock();
+        return 0;
+    }
+
+    _cursize += tot;
+    p->fileno = _curno;
+    _wlock.unlock();
+
+    p->off = off + sizeof(h) + key.size();
+    p->len = len;
+
+    return 1;
+}
+
+// get everything written so far onto disk
+// the database must not point at a value until it is
+// 0 => failed
+int
+BlobStore::sync(void){
+
+    _wlock.lock();
+    int ok = (_curfd == -1) || !fdatasync(_curfd);
+    _wlock.unlock();
+
+    if( !ok ) PROBLEM("blob sync failed: %s", strerror(errno));
+    return ok;
+}
+
+int
+BlobStore::read(const BlobPtr *p, string *res){
+
+    res->resize( p->len );
+
+    _flock.r_lock();
+    std::map<int,int>::iterator it = _fds.find(p->fileno);
+    int fd = (it == _fds.end()) ? -1 : it->second;
+
+    ssize_t r = (fd == -1) ? -1 : pread(fd, &(*res)[0], p->len, p->off);
+    _flock.r_unlock();
+
+    if( r != p->len ){
+        DEBUG("blob read failed %d/%lld", p->fileno, p->off);
+        res->clear();
+        return 0;
+    }
+
+    return 1;
+}
+
+//################################################################
+
+// read the entry at off
+static int
+next_entry(int fd, int64_t off, int64_t size, int fileno, BlobHeader *h, string *key, BlobPtr *p){
+
+    if( off + (int64_t)sizeof(BlobHeader) > size ) return 0;
+    if( pread(fd, h, sizeof(BlobHeader), off) != sizeof(BlobHeader) ) return 0;
+
+    if( h->magic != BLOB_MAGIC || h->keylen < 0 || h->datalen < 0 ){
+        PROBLEM("corrupt blob file %d at %lld", fileno, off);
+        return 0;
+    }
+
+    key->resize( h->keylen );
+    if( h->keylen && pread(fd, &(*key)[0], h->keylen, off + sizeof(BlobHeader)) != h->keylen ) return 0;
+
+    p->fileno = fileno;
+    p->len    = h->datalen;
+    p->off    = off + sizeof(BlobHeader) + h->keylen;
+
+    if( p->off + p->len > size ) return 0;	// partial write
+    return 1;
+}
+
+// copy the live values out of a mostly dead file, and remove it
+bool
+BlobStore::gc_file(int n){
+    BlobHeader h;
+    BlobPtr    p;
+    string     key, val;
+    struct stat st;
+
+    int fd = get_fd(n);
+    if( fd == -1 ) return 0;
+    if( fstat(fd, &st) ) return 0;
+
+    int64_t size = st.st_size;
+    int64_t now  = lr_usec();
+    int64_t live = 0;
+
+    // how much is live?
+    for(int64_t off=0; next_entry(fd, off, size, n, &h, &key, &p); off = p.off + p.len){
+        if( h.expire && h.expire < now ) continue;
+        if( _be->blob_live(key, h.ver, &p) ) live += sizeof(h) + h.keylen + h.datalen;
+    }
+
+    DEBUG("blob file %d: %lld of %lld live", n, live, size);
+    if( live * 100 >= size * _gcpct ) return 0;
+
+    // move the live values
+    int64_t moved = 0;
+    for(int64_t off=0; next_entry(fd, off, size, n, &h, &key, &p); off = p.off + p.len){
+        if( stopping() ) return 0;
+        if( h.expire && h.expire < now ) continue;
+
+        val.resize( p.len );
+        if( p.len && pread(fd, &val[0], p.len, p.off) != p.len ){
+            PROBLEM("blob read failed %d/%lld: %s", n, p.off, strerror(errno));
+            return 0;
+        }
+        if( ! _be->blob_move(key, h.shard, h.ver, &p, val) ){
+            // still live, but could not be moved. try again later
+            return 0;
+        }
+        moved += p.len;
+    }
+
+    // nothing references it anymore
+    string path;
+    filename(n, &path);
+
+    _flock.w_lock();
+    _fds.erase(n);
+    close(fd);
+    _flock.w_unlock();
+
+    unlink( path.c_str() );
+    VERBOSE("removed blob file %s, moved %lld of %lld bytes", path.c_str(), moved, size);
+    return 1;
+}
+
+void
+BlobStore::gc(void){
+    std::vector<int> files;
+
+    // the file being appended to is not collected
+    _wlock.lock();
+    int cur = (_curfd == -1) ? -1 : _curno;
+    _wlock.unlock();
+
+    _flock.r_lock();
+    for(std::map<int,int>::iterator it=_fds.begin(); it != _fds.end(); it++){
+        if( it->first != cur ) files.push_back( it->first );
+    }
+    _flock.r_unlock();
+
+    for(int i=0; i<files.size(); i++){
+        if( stopping() ) return;
+        gc_file( files[i] );
+    }
+}
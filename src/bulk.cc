@@ -0,0 +1,85 @@
+/*
+  Copyright (c) 2015
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2015-Mar-23 14:05 (EDT)
+  Function: bulk transfers
+
+*/
+
+#define CURRENT_SUBSYSTEM	'B'
+
+#include "defs.h"
+#include "diag.h"
+#include "config.h"
+#include "misc.h"
+#include "network.h"
+#include "netutil.h"
+#include "bulk.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+BulkXfer::BulkXfer(const NetAddr *a, int reqno, int to)
+    : _pc(a, to) {
+
+    _reqno = reqno;
+    _res   = 0;
+}
+
+// subclasses should finish() first, so the replies are theirs to handle
+BulkXfer::~BulkXfer(){
+
+    for(int i=0; i<_inflight.size(); i++){
+        delete _inflight[i].req;
+    }
+}
+
+void
+BulkXfer::send(google::protobuf::Message *req){
+    Chunk c;
+
+    // wait for room
+    // until the peer agrees to keep the connection, only one at a time
+    while( _inflight.size() >= _pc.pipeline_depth(BULK_WINDOW) ){
+        recv_one();
+    }
+
+    c.req = req;
+
+    if( !_pc.send(_reqno, req, &c.msgid) ){
+        DEBUG("send failed");
+        // anything still in flight on this connection is lost too
+        while( !_inflight.empty() ) recv_one();
+        on_reply(req, 0);
+        delete req;
+        return;
+    }
+
+    _inflight.push_back(c);
+}
+
+void
+BulkXfer::recv_one(void){
+
+    if( _inflight.empty() ) return;
+
+    Chunk c = _inflight.front();
+    _inflight.pop_front();
+
+    _res->Clear();
+    if( _pc.recv(c.msgid, _res) ){
+        on_reply(c.req, _res);
+    }else{
+        DEBUG("recv failed");
+        on_reply(c.req, 0);
+    }
+
+    delete c.req;
+}
+
+void
+BulkXfer::finish(void){
+
+    while( !_inflight.empty() ) recv_one();
+}
@@ -18,6 +18,7 @@
 #include "runmode.h"
 #include "clientio.h"
 #include "crypto.h"
+#include "connpool.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -36,6 +37,8 @@
 #include <sys/loadavg.h>
 #include <poll.h>
 
+#include "std_reply.pb.h"
+
 #include <vector>
 using std::vector;
 
@@ -223,10 +226,10 @@ clientio_loop(void* x){
 
 /*
   we speak only our own  protocol
-    connect
+    connect (or borrow an idle connection from the pool)
     send request
     read response
-    done
+    done (return the connection to the pool, if the peer agrees)
 */
 
 ClientIO::ClientIO(const NetAddr& addr, int reqno, const google::protobuf::Message *req){
@@ -239,6 +242,10 @@ ClientIO::ClientIO(const NetAddr& addr, int reqno, const google::protobuf::Messa
     _rlen        = 0;
     _wrpos       = 0;
     _polling     = 0;
+    _errreply    = 0;
+    _errcode     = 0;
+    _reused      = 0;
+    _retried     = 0;
 
     // serialize to write buffer
     // prepend proto header
@@ -263,6 +270,7 @@ ClientIO::ClientIO(const NetAddr& addr, int reqno, const google::protobuf::Messa
     protocol_header *pho = (protocol_header*) _wbuf.data();
     pho->version        = PHVERSION;
     pho->flags          = is_enc ? (PHFLAG_WANTREPLY | PHFLAG_DATA_ENCR) : PHFLAG_WANTREPLY;
+    pho->flags         |= PHFLAG_KEEPALIVE;
     pho->type           = reqno;
     pho->msgidno        = random_n(0xFFFFFFFF);
     pho->auth_length    = 0;
@@ -280,27 +288,38 @@ void
 ClientIO::start(void){
     struct sockaddr_in sa;
 
-    // open socket + start connecting
+    // reuse an established connection, if we have one
+    // (but not if it just failed us)
+    int pfd = _retried ? -1 : connpool_get( &_addr );
+    _reused = pfd != -1;
 
-    sa.sin_family      = AF_INET;
-    sa.sin_port        = htons(_addr.port);
-    sa.sin_addr.s_addr = _addr.ipv4;
+    if( pfd != -1 ){
+        _fd = pfd;
+    }else{
+        // open socket + start connecting
 
-    _fd = socket(PF_INET, SOCK_STREAM, 0);
-    if( _fd == -1 ){
-	FATAL("cannot create tcp4 socket: %s", strerror(errno));
-    }
+        sa.sin_family      = AF_INET;
+        sa.sin_port        = htons(_addr.port);
+        sa.sin_addr.s_addr = _addr.ipv4;
+
+        _fd = socket(PF_INET, SOCK_STREAM, 0);
+        if( _fd == -1 ){
+            FATAL("cannot create tcp4 socket: %s", strerror(errno));
+        }
 
-    DEBUG("connect %s %d => %d", inet_ntoa(sa.sin_addr), _addr.port, _fd);
+        DEBUG("connect %s %d => %d", inet_ntoa(sa.sin_addr), _addr.port, _fd);
 
-    init_tcp(_fd);
-    set_nbio(_fd);
+        init_tcp(_fd);
+        set_nbio(_fd);
+    }
 
     _wrpos = 0;
     _rlen  = 0;
+    _errreply = 0;
+    _errcode  = 0;
     _rbuf.clear();
     _rbuf.reserve( BUFSIZE );
-    _state = STATE_CONNECTING;
+    _state = (pfd != -1) ? STATE_WRITING : STATE_CONNECTING;
     if( _rel_timeout ) _timeout = lr_now() + _rel_timeout;
 
     dslock.w_lock();
@@ -314,6 +333,8 @@ ClientIO::start(void){
     clvec[_fd] = this;
     dslock.w_unlock();
 
+    if( pfd != -1 ) return;
+
     int i = connect(_fd, (sockaddr*)&sa, sizeof(sa));
     if( i == -1 && errno != EINPROGRESS ){
         DEBUG("cannot connect: %s", strerror(errno));
@@ -342,6 +363,7 @@ ClientIO::retry(const NetAddr& addr){
     _state   = STATE_PENDING;
     _rlen    = 0;
     _wrpos   = 0;
+    _retried = 0;
 
     start();
 }
@@ -429,6 +451,8 @@ ClientIO::do_read(void){
 
 void
 ClientIO::do_timeout(void){
+    // a slow peer, not a stale connection. do not try again
+    _reused = 0;
     do_error("time out");
 }
 
@@ -438,19 +462,39 @@ ClientIO::do_error(const char *msg){
     _close();
     DEBUG("client %s io failed: %s", _addr.name.c_str(), msg);
 
+    // the peer may have dropped an idle connection just as we reused it. try again, once.
+    if( _reused && !_retried && _rbuf.empty() ){
+        DEBUG("retrying on a new connection");
+        _retried = 1;
+        _state   = STATE_PENDING;
+        start();
+        return;
+    }
+
     on_error();
 }
 
 void
 ClientIO::do_work(void){
 
-    _close();
-
     DEBUG("working");
     protocol_header *ph = (protocol_header*) _rbuf.data();
     cvt_header_from_network( ph );
 
+    // if the peer agreed, keep the connection for the next request
+    if( ph->flags & PHFLAG_KEEPALIVE )
+        _release();
+    else
+        _close();
+
     if( ph->flags & PHFLAG_ISERROR ){
+        // reply_error says why. an unknown request type gets no reason
+        _errreply = 1;
+        if( ph->data_length ){
+            ACPStdReply e;
+            e.ParsePartialFromArray( _rbuf.data() + sizeof(protocol_header) + ph->auth_length, ph->data_length );
+            _errcode = e.status_code();
+        }
         on_error();
         return;
     }
@@ -477,6 +521,18 @@ ClientIO::do_work(void){
     on_success();
 }
 
+void
+ClientIO::_release(void){
+
+    if( !_fd ) return;
+
+    dslock.w_lock();
+    clvec[ _fd ] = 0;
+    dslock.w_unlock();
+    connpool_put( &_addr, _fd );
+    _fd = 0;
+}
+
 void
 ClientIO::_close(void){
 
@@ -15,6 +15,7 @@
 #include "config.h"
 #include "misc.h"
 #include "network.h"
+#include "throttle.h"
 
 #include <ctype.h>
 #include <stdlib.h>
@@ -74,13 +75,18 @@ static int set_debug(Config *, string *);
 static int set_trace(Config *, string *);
 static int add_acl(Config *, string *);
 static int add_peer(Config *, string *);
+static int add_throttle(Config *, string *);
 static int ignore_conf(Config *cf, string *s) { return 0; }
 static int set_expire(DBConf *, string *);
 
 SET_INT_VAL(tcp_threads, 0);
+SET_INT_VAL(tcp_reactors, 0);
+SET_INT_VAL(tcp_workers, 0);
 SET_INT_VAL(udp_threads, 0);
 SET_INT_VAL(cio_threads, 0);
 SET_INT_VAL(ae_threads, 0);
+SET_INT_VAL(peer_conns, 0);
+SET_INT_VAL(peer_conn_idle, 0);
 SET_INT_VAL(port_server, 0);
 SET_INT_VAL(port_console, 0);
 SET_INT_VAL(debuglevel, 0);
@@ -88,6 +94,7 @@ SET_INT_VAL(debuglevel, 0);
 SET_INT_VAL(available, 0);
 SET_INT_VAL(hw_cpus, 0);
 
+SET_STR_VAL(tcp_mode);
 SET_STR_VAL(environment);
 SET_STR_VAL(basedir);
 SET_STR_VAL(datacenter);
@@ -100,6 +107,22 @@ SET_STR_VAL_DB(pathname);
 SET_STR_VAL_DB(backend);
 SET_INT_VAL_DB(replicas, 1);
 SET_INT_VAL_DB(ringbits, 1);
+SET_INT_VAL_DB(scan_readahead, 1);
+SET_INT_VAL_DB(scan_rate, 0);
+SET_INT_VAL_DB(cache_size, 0);
+SET_INT_VAL_DB(bloom_bits, 0);
+SET_INT_VAL_DB(write_buffer, 1);
+SET_INT_VAL_DB(compactions, 1);
+SET_STR_VAL_DB(compression);
+SET_INT_VAL_DB(blob_min, 0);
+SET_INT_VAL_DB(blob_file_size, 1);
+SET_INT_VAL_DB(blob_gc, 1);
+SET_INT_VAL_DB(merkle_cache, 0);
+SET_INT_VAL_DB(merkle_leaves, 0);
+SET_INT_VAL_DB(merkle_threads, 1);
+SET_STR_VAL_DB(merkle_hash);
+SET_STR_VAL_DB(shard_hash);
+SET_INT_VAL_DB(merkle_xor, 0);
 
 
 
@@ -111,9 +134,14 @@ static struct {
     { "port",           set_port_server    },
     { "console",        set_port_console    },
     { "tcp_threads",	set_tcp_threads	   },
+    { "tcp_mode",	set_tcp_mode	   },
+    { "tcp_reactors",	set_tcp_reactors   },
+    { "tcp_workers",	set_tcp_workers	   },
     { "udp_threads",	set_udp_threads	   },
     { "out_threads",	set_cio_threads	   },
     { "ae_threads",	set_ae_threads	   },
+    { "peer_conns",	set_peer_conns	   },
+    { "peer_conn_idle",	set_peer_conn_idle },
     { "environment",    set_environment    },
     { "basedir",	set_basedir        },
     { "secret",		set_secret 	   },
@@ -125,6 +153,7 @@ static struct {
     { "available",      set_available      },
     { "allow",		add_acl     	   },
     { "seedpeer",	add_peer 	   },
+    { "throttle",	add_throttle	   },
     { "datacenter",	set_datacenter     },
     { "rack",		set_rack           },
     { "syslog",		ignore_conf        },	// NYI
@@ -139,6 +168,22 @@ static struct {
     { "expire",         set_expire         },
     { "replicas",	set_replicas	   },
     { "ringbits",	set_ringbits	   },
+    { "scan_readahead",	set_scan_readahead },
+    { "scan_rate",	set_scan_rate      },
+    { "cache_size",	set_cache_size     },
+    { "bloom_bits",	set_bloom_bits     },
+    { "write_buffer",	set_write_buffer   },
+    { "compactions",	set_compactions    },
+    { "compression",	set_compression    },
+    { "blob_min",	set_blob_min       },
+    { "blob_file_size",	set_blob_file_size },
+    { "blob_gc",	set_blob_gc        },
+    { "merkle_cache",	set_merkle_cache   },
+    { "merkle_leaves",	set_merkle_leaves  },
+    { "merkle_threads",	set_merkle_threads },
+    { "merkle_hash",	set_merkle_hash    },
+    { "shard_hash",	set_shard_hash     },
+    { "merkle_xor",	set_merkle_xor     },
 };
 
 
@@ -162,6 +207,8 @@ static struct {
     { "server",           'S' },
     { "merkle",           'M' },
     { "distrib",          'L' },
+    { "bulk",             'B' },
+    { "throttle",         'h' },
     { "partition",	  'R' },
     { "ae",		  'A' },
     { "client",           'I' },
@@ -327,6 +374,7 @@ read_config(const char *filename){
 
     Config *old = config;
     ATOMIC_SETPTR( config, cf);
+    throttle_configure( cf );
 
     if( old ){
         sleep(2);
@@ -456,6 +504,18 @@ add_peer(Config *cf, string *v){
     return 0;
 }
 
+// class resource KB/sec. checked when applied
+static int
+add_throttle(Config *cf, string *v){
+
+    if(!v){
+	FATAL("throttle class resource KB/sec");
+    }
+
+    cf->throttle.push_back( *v );
+    return 0;
+}
+
 static int
 set_expire(DBConf *mcf, string *v){
 
@@ -509,9 +569,14 @@ Config::Config(){
     available      = 1;
     udp_threads	   = 2;
     tcp_threads	   = 4;
+    tcp_reactors   = 2;
+    tcp_workers	   = 16;
     cio_threads	   = 8;
     ae_threads	   = 2;
+    peer_conns     = 8;
+    peer_conn_idle = 1;
     environment.assign("unknown");
+    tcp_mode.assign("threads");
 
     memset(debugflags, 0, sizeof(debugflags));
     memset(traceflags, 0, sizeof(traceflags));
@@ -537,7 +602,23 @@ Config::~Config(){
 //################################################################
 
 DBConf::DBConf(){
-    expire      = 0;
+    expire      	= 0;
+    scan_readahead	= 2048;
+    scan_rate		= 100000;
+    cache_size		= 128;
+    bloom_bits		= 10;
+    write_buffer	= 16;
+    compactions		= 4;
+    compression.assign("snappy");
+    blob_min		= 0;
+    blob_file_size	= 256;
+    blob_gc		= 50;
+    merkle_cache	= 32;
+    merkle_leaves	= 16;
+    merkle_threads	= 4;
+    merkle_hash.assign("md5");
+    shard_hash.assign("md5");
+    merkle_xor		= 0;
 }
 
 //################################################################
@@ -0,0 +1,146 @@
+/*
+  Copyright (c) 2014
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2015-Mar-02 11:20 (EST)
+  Function: pool of established connections to peers
+
+*/
+#define CURRENT_SUBSYSTEM	'N'
+
+#include "defs.h"
+#include "diag.h"
+#include "config.h"
+#include "lock.h"
+#include "hrtime.h"
+#include "network.h"
+#include "connpool.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <map>
+#include <deque>
+using std::map;
+using std::deque;
+
+#define MAXPERPEER	8
+#define MAXIDLE		1	// seconds. keep well under the server's keepalive timeout (2s threaded)
+
+struct PoolEnt {
+    int		fd;
+    lrtime_t	used;
+};
+
+typedef deque<PoolEnt> PoolList;	// most recently used at the back
+
+static Mutex  poollock;
+static map<uint64_t, PoolList> pool;	// ip+port => idle connections
+static lrtime_t lastmaint = 0;
+
+
+static inline uint64_t
+peer_key(const NetAddr *a){
+    return (((uint64_t)a->ipv4) << 16) | (a->port & 0xFFFF);
+}
+
+static int
+max_per_peer(void){
+    if( config && config->peer_conns ) return config->peer_conns;
+    return MAXPERPEER;
+}
+
+static int
+max_idle(void){
+    if( config && config->peer_conn_idle ) return config->peer_conn_idle;
+    return MAXIDLE;
+}
+
+// an idle connection should have nothing to read
+// readable => peer closed it (or sent junk). either way it is no good
+static bool
+is_healthy(int fd){
+    struct pollfd pf[1];
+
+    pf[0].fd      = fd;
+    pf[0].events  = POLLIN;
+    pf[0].revents = 0;
+
+    int r = poll(pf, 1, 0);
+    return r == 0;
+}
+
+int
+connpool_get(const NetAddr *addr){
+    int fd = -1;
+    lrtime_t old = lr_now() - max_idle();
+
+    poollock.lock();
+    map<uint64_t, PoolList>::iterator it = pool.find( peer_key(addr) );
+
+    if( it != pool.end() ){
+        PoolList *pl = & it->second;
+
+        while( !pl->empty() ){
+            PoolEnt e = pl->back();
+            pl->pop_back();
+
+            if( e.used > old && is_healthy(e.fd) ){
+                fd = e.fd;
+                break;
+            }
+
+            DEBUG("discarding stale connection to %s", addr->name.c_str());
+            close(e.fd);
+        }
+    }
+    poollock.unlock();
+
+    if( fd != -1 ) DEBUG("reusing connection to %s", addr->name.c_str());
+    return fd;
+}
+
+void
+connpool_put(const NetAddr *addr, int fd){
+    PoolEnt e;
+
+    e.fd   = fd;
+    e.used = lr_now();
+
+    poollock.lock();
+    PoolList *pl = & pool[ peer_key(addr) ];
+
+    if( pl->size() >= max_per_peer() ){
+        // enough already. drop the oldest
+        close( pl->front().fd );
+        pl->pop_front();
+    }
+    pl->push_back(e);
+
+    bool maint = lastmaint != e.used;
+    poollock.unlock();
+
+    if( maint ) connpool_maint();
+}
+
+void
+connpool_maint(void){
+    lrtime_t now = lr_now();
+    lrtime_t old = now - max_idle();
+
+    poollock.lock();
+    lastmaint = now;
+
+    for(map<uint64_t, PoolList>::iterator it=pool.begin(); it != pool.end(); it++){
+        PoolList *pl = & it->second;
+
+        while( !pl->empty() && pl->front().used <= old ){
+            close( pl->front().fd );
+            pl->pop_front();
+        }
+    }
+
+    poollock.unlock();
+}
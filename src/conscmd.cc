@@ -19,6 +19,7 @@
 #include "runmode.h"
 #include "stats.h"
 #include "partition.h"
+#include "throttle.h"
 
 #include <string.h>
 #include <ctype.h>
@@ -55,6 +56,7 @@ static int cmd_rbits(Console *, const char *, int);
 static int cmd_rreps(Console *, const char *, int);
 static int cmd_raddn(Console *, const char *, int);
 static int cmd_rrmn(Console *, const char *, int);
+static int cmd_throt(Console *, const char *, int);
 
 
 static struct {
@@ -81,6 +83,7 @@ static struct {
     { "ringreplicas",   1, cmd_rreps }, // set # replicas
     { "ringadd",        1, cmd_raddn },	// add node
     { "ringrm",         1, cmd_rrmn  },	// remove node
+    { "throttle",       1, cmd_throt },	// background traffic limits
     { "help",           1, cmd_help },
     { "?",              0, cmd_help },
 
@@ -336,6 +339,35 @@ cmd_rrmn(Console *con, const char *cmd, int len){
 }
 
 
+// throttle
+// throttle class resource KB/sec
+static int
+cmd_throt(Console *con, const char *cmd, int len){
+    vector<string> argv;
+    string err;
+
+    parse(cmd, len, &argv);
+
+    if( argv.empty() ){
+        string out;
+        throttle_report( &out );
+        con->output(out.c_str());
+        return 1;
+    }
+    if( argv.size() != 3 ){
+        con->output("throttle [class resource KB/sec]\n");
+        return 1;
+    }
+
+    if( ! throttle_set(argv[0], argv[1], atoi(argv[2].c_str()), &err) ){
+        con->output("error: ");
+        con->output(err.c_str());
+        con->output("\n");
+    }
+
+    return 1;
+}
+
 
 static int
 cmd_status(Console *con, const char *cmd, int len){
@@ -20,11 +20,16 @@
 #include "expire.h"
 #include "partition.h"
 #include "database.h"
+#include "blob.h"
+#include "hash.h"
+#include "throttle.h"
 
 #include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <algorithm>
 
 #include "y2db_getset.pb.h"
 #include "y2db_check.pb.h"
@@ -32,6 +37,8 @@
 
 #define TOONEW		(60 * 1000000)	// 1 minute, microsecs
 #define NDBLOCK 1029
+#define PUTSET_STACK	8	// put sets this small need no allocations
+#define SHARDHASHKEY	"shardhash"	// in 'p'
 Mutex datalock[NDBLOCK];
 
 
@@ -44,7 +51,16 @@ Database::Database(DBConf *cf){
     // convert to microsecs
     _expire = cf->expire * 1000000LL;
     _name   = cf->name;
-    _merk   = new Merkle(this);
+    _scan_readahead = cf->scan_readahead * 1024;
+    _scan_rate      = cf->scan_rate;
+    _blob_min       = cf->blob_min;
+    _shardhash      = hash_alg( cf->shard_hash );
+    if( _shardhash < 0 ){
+        PROBLEM("unknown shard_hash '%s', using md5", cf->shard_hash.c_str());
+        _shardhash = HASH_MD5;
+    }
+    _blob   = BlobStore::in_use(cf) ? new BlobStore(this, cf) : 0;
+    _merk   = new Merkle(this, cf);
     _expr   = new Expire(this);
     _ring   = new Ring(this, cf);
 
@@ -55,6 +71,7 @@ Database::~Database(){
     delete _merk;
     delete _expr;
     delete _ring;
+    delete _blob;
 }
 
 void
@@ -89,7 +106,7 @@ Database::get(ACPY2MapDatum *res){
         // someone asked for this particular version, but we do not have.
         // make sure our merkle is not misreporting
         if( db_uptodate ){
-            int shard  = shard_hash( res->key() );
+            int shard  = shard_hash( res->key(), _shardhash );
             int part   = _ring->partno( res->shard() );
             int treeid = _ring->treeid(part);
             VERBOSE("how odd key/ver not found %s %016llx %s", _name.c_str(), res->version(), res->key().c_str());
@@ -106,43 +123,129 @@ Database::get(ACPY2MapDatum *res){
     res->set_version( dr->ver );
     res->set_shard(   dr->shard );
     res->set_expire(  dr->expire );
-    res->set_value(   dr->value, val.size() - sizeof(DBRecord) );
+
+    if( dr->type == DBTYP_BLOB ){
+        if( !record_value(val, res->mutable_value()) ){
+            // the blob may have just been moved. try again
+            _get('d', res->key(), &val);
+            if( !record_value(val, res->mutable_value()) ){
+                PROBLEM("cannot read blob %s %s", _name.c_str(), res->key().c_str());
+                return 0;
+            }
+        }
+    }else{
+        res->set_value( dr->value, val.size() - sizeof(DBRecord) );
+    }
 
     // RSN - process types
 
     return 1;
 }
 
+// fetch only the record header
+// backends that can read without copying the value should override this
+int
+Database::_get_meta(char sub, const string& key, DBRecord *res){
+    string val;
+
+    _get(sub, key, &val);
+    if( val.size() < sizeof(DBRecord) ) return 0;
+
+    memcpy(res, val.data(), sizeof(DBRecord));
+    return 1;
+}
+
 int64_t
 Database::have_ver(const string& key){
+    DBRecord hdr;
 
-    string old;
-    _get('d', key, &old);
-    if( old.empty() ) return 0;
-
-    DBRecord *pr = (DBRecord*) old.data();
-    return pr->ver;
+    if( ! _get_meta('d', key, &hdr) ) return 0;
+    return hdr.ver;
 }
 
 // 0 => want it
 int
 Database::want_it(const string& key, int64_t ver){
+    DBRecord hdr;
 
-    string old;
-    _get('d', key, &old);
-    if( old.empty() ) return DBPUTST_WANT;		// == 0, don't have
+    if( ! _get_meta('d', key, &hdr) ) return DBPUTST_WANT;	// == 0, don't have
 
-    DBRecord *pr = (DBRecord*) old.data();
-
-    if( ver < pr->ver ) return DBPUTST_OLD;		// our copy is newer
-    if( ver > pr->ver ) return DBPUTST_WANT;		// our copy is stale, we want it
+    if( ver < hdr.ver ) return DBPUTST_OLD;		// our copy is newer
+    if( ver > hdr.ver ) return DBPUTST_WANT;		// our copy is stale, we want it
     return DBPUTST_HAVE;
 }
 
-// 0 => stored ok
-// * => did not want
+// the value of an on disk record, from the blob store if needed
 int
-Database::put(ACPY2MapDatum *req, int *opart){
+Database::record_value(const string& rec, string *res){
+
+    res->clear();
+    if( rec.size() < sizeof(DBRecord) ) return 0;
+    DBRecord *dr = (DBRecord*) rec.data();
+    int dsize = rec.size() - sizeof(DBRecord);
+
+    if( dr->type != DBTYP_BLOB ){
+        res->assign( (char*)dr->value, dsize );
+        return 1;
+    }
+
+    if( dsize < sizeof(BlobPtr) ) return 0;
+    if( !_blob ){
+        PROBLEM("blob record, but no blob store %s", _name.c_str());
+        return 0;
+    }
+    return _blob->read( (BlobPtr*)dr->value, res );
+}
+
+// does the database still refer to this blob?
+int
+Database::blob_live(const string& key, int64_t ver, const BlobPtr *p){
+    string rec;
+
+    _get('d', key, &rec);
+    if( rec.size() < sizeof(DBRecord) + sizeof(BlobPtr) ) return 0;
+
+    DBRecord *dr = (DBRecord*) rec.data();
+    BlobPtr  *bp = (BlobPtr*) dr->value;
+
+    if( dr->type != DBTYP_BLOB ) return 0;
+    if( dr->ver  != ver )        return 0;
+    return bp->fileno == p->fileno && bp->off == p->off;
+}
+
+// copy a live blob to the current blob file, and update the record
+// 0 => failed
+int
+Database::blob_move(const string& key, int shard, int64_t ver, const BlobPtr *p, const string& val){
+    int lockno = shard % NDBLOCK;
+    int ok = 1;
+
+    datalock[ lockno ].lock();
+
+    if( blob_live(key, ver, p) ){
+        string rec;
+        BlobPtr np;
+
+        _get('d', key, &rec);
+        DBRecord *dr = (DBRecord*) rec.data();
+
+        if( _blob->write(key, shard, ver, dr->expire, val.size(), (const uchar*)val.data(), &np) && _blob->sync() ){
+            memcpy( dr->value, &np, sizeof(np) );
+            ok = _put('d', key, rec.size(), (const uchar*)rec.data());
+        }else{
+            ok = 0;
+        }
+    }
+
+    datalock[ lockno ].unlock();
+    return ok;
+}
+
+// checks before saving
+// fills in missing fields, determines expire time, partition, tree
+// DBPUTST_DONE => ok to save
+int
+Database::put_check(ACPY2MapDatum *req, int64_t *pexp, int *opart, int *ptree){
 
     // expired?
     int64_t now = lr_usec();
@@ -153,97 +256,261 @@ Database::put(ACPY2MapDatum *req, int *opart){
         DEBUG("already expired");
         return DBPUTST_OLD;
     }
+    *pexp = exp;
+
+    // the merkle leaf cannot hold it
+    if( req->key().size() > MERKLE_MAXKEYLEN ){
+        VERBOSE("key too long (%d bytes)", (int)req->key().size());
+        return DBPUTST_BAD;
+    }
 
     // fill in missing
     if( !req->has_version() ) req->set_version( hr_usec() );
-    if( !req->has_shard() )   req->set_shard(   shard_hash( req->key() ) );
+    if( !req->has_shard() )   req->set_shard(   shard_hash( req->key(), _shardhash ) );
 
     // determine partition from shard
     int part = _ring->partno( req->shard() );
     if( opart ) *opart = part;
-    int treeid = _ring->treeid(part);
-    int lockno = req->shard() % NDBLOCK;
+    *ptree = _ring->treeid(part);
 
-    hrtime_t t0 = hr_usec();
-    DEBUG("shard %x part %d tree %x lock %d; %s", req->shard(), part, treeid, lockno, req->key().c_str());
+    DEBUG("shard %x part %d tree %x; %s", req->shard(), part, *ptree, req->key().c_str());
     // is this partition on this server?
     if( !_ring->is_local(part) ){
         DEBUG("not local");
         return DBPUTST_NOTME;
     }
-    // get current ver
-    string old;
-    DBRecord *pr = 0;
 
-    datalock[ lockno ].lock();
-    hrtime_t t1 = hr_usec();
+    return DBPUTST_DONE;
+}
+
+// called periodically by maintenance scans
+// sleep as needed to keep the scan to _scan_rate rows/sec,
+// and within the maintenance disk budget
+void
+Database::scan_pace(int64_t t0, int64_t nrows, int64_t nbytes){
+
+    throttle(THROT_MAINTENANCE, THROT_DISK, nbytes);
+
+    if( _scan_rate <= 0 ) return;
+
+    int64_t want = t0 + nrows * 1000000LL / _scan_rate;
+    int64_t now  = hr_usec();
+    if( want <= now ) return;
+
+    int64_t d = want - now;
+    if( d >= 1000000 ) sleep( d / 1000000 );
+    usleep( d % 1000000 );
+}
 
-    _get('d', req->key(), &old);
-    hrtime_t t2 = hr_usec();
+// 0 => stored ok
+// * => did not want
+// a single put is a set of one
+int
+Database::put(ACPY2MapDatum *req, int *opart){
+    int rc;
+    int part = -1;
+
+    put_set(1, &req, &rc, &part);
 
-    pr = (DBRecord*) old.data();
+    if( opart ) *opart = part;
+    return rc;
+}
+
+// merkle leaf changes made by put_set, so they can be backed out
+struct MerkUndo {
+    int		idx;		// request
+    bool	added;
+    int		shard;
+    int64_t	ver;
+};
+
+// sort, and remove duplicates. returns the new count
+static int
+lock_order(int *l, int n){
+    std::sort(l, l + n);
+    return std::unique(l, l + n) - l;
+}
+
+// save a set of records with one backend write
+// the merkle leaves are updated in the leaf cache, and written later by
+// the flush thread. if the write fails, the leaf changes are backed out
+// result[i] is the DBPUTST_* for req[i]
+// small sets (a single put) are done entirely on the stack
+void
+Database::put_set(int n, ACPY2MapDatum **req, int *result, int *opart){
+    int64_t  sexp[PUTSET_STACK];
+    int      stree[PUTSET_STACK], sdl[PUTSET_STACK], sml[2 * PUTSET_STACK];
+    string   sold[PUTSET_STACK];
+    MerkUndo sundo[2 * PUTSET_STACK];
+    bool     big    = n > PUTSET_STACK;
+    int64_t *exp    = big ? new int64_t[n]      : sexp;
+    int     *treeid = big ? new int[n]          : stree;
+    string  *old    = big ? new string[n]       : sold;
+    int     *dlocks = big ? new int[n]          : sdl;		// each request: 1 data lock
+    int     *mlocks = big ? new int[2 * n]      : sml;		// 2 leaves (old + new)
+    MerkUndo *undo  = big ? new MerkUndo[2 * n] : sundo;	// 2 leaf changes
+    int ndl = 0, nml = 0, nundo = 0;
+
+    for(int i=0; i<n; i++){
+        result[i] = put_check(req[i], exp + i, opart + i, treeid + i);
+        if( result[i] == DBPUTST_DONE ) dlocks[ndl++] = req[i]->shard() % NDBLOCK;
+    }
+
+    // NB: always lock in ascending order - data locks, then merkle leaf locks
+    ndl = lock_order(dlocks, ndl);
+    for(int i=0; i<ndl; i++){
+        datalock[ dlocks[i] ].lock();
+    }
+
+    // get current versions, and determine which merkle leaves we will touch
+    for(int i=0; i<n; i++){
+        if( result[i] != DBPUTST_DONE ) continue;
+
+        // the value is only needed to run a program
+        if( req[i]->program_size() ){
+            _get('d', req[i]->key(), old + i);
+        }else{
+            DBRecord hdr;
+            if( _get_meta('d', req[i]->key(), &hdr) ) old[i].assign( (char*)&hdr, sizeof(hdr) );
+        }
+
+        if( old[i].size() >= sizeof(DBRecord) ){
+            DBRecord *pr = (DBRecord*) old[i].data();
+            mlocks[nml++] = _merk->leaf_lock_number(treeid[i], pr->ver);
+        }
+        mlocks[nml++] = _merk->leaf_lock_number(treeid[i], req[i]->version());
+    }
+
+    nml = lock_order(mlocks, nml);
+    for(int i=0; i<nml; i++){
+        _merk->leaf_lock( mlocks[i] );
+    }
+
+    DBBatch *b = _batch_begin();
+    string cur;
+    int nblob = 0;
+
+    for(int i=0; i<n; i++){
+        if( result[i] != DBPUTST_DONE ) continue;
+        ACPY2MapDatum *r = req[i];
+
+        // an earlier record in this set may have replaced it
+        string *pold = old + i;
+        int bg = b->get('d', r->key(), &cur);
+        if( bg == 1 )  pold = &cur;
+        if( bg == -1 ) pold->clear();
+
+        DBRecord *pr = (DBRecord*) pold->data();
+        bool hasold  = pold->size() >= sizeof(DBRecord);
 
-    if( old.size() ){
         // check versions
-        if( pr->ver >= req->version() ){
+        if( hasold && pr->ver >= r->version() ){
             DEBUG("outdated version");
-            datalock[ lockno ].unlock();
-            return DBPUTST_HAVE;
+            result[i] = DBPUTST_HAVE;
+            continue;
+        }
+
+        // run update program?
+        if( r->program_size() && (pold->size() || ! r->has_value()) ){
+
+            if( pold->size() > sizeof(DBRecord) && !record_value(*pold, r->mutable_value()) ){
+                result[i] = DBPUTST_BAD;
+                continue;
+            }
+            if( !run_program( r ) ){
+                result[i] = DBPUTST_BAD;
+                continue;
+            }
+        }
+        r->clear_program();
+
+        // build record to insert
+        // large values go to the blob store, the record points to them
+        int dsize = r->value().size();
+        int type  = dsize ? DBTYP_DATA : DBTYP_DELETED;
+        const uchar *dp = (const uchar*) r->value().data();
+        BlobPtr bp;
+
+        if( _blob && _blob_min && dsize >= _blob_min
+            && _blob->write(r->key(), r->shard(), r->version(), exp[i], dsize, dp, &bp) ){
+            nblob ++;
+            type  = DBTYP_BLOB;
+            dsize = sizeof(bp);
+            dp    = (const uchar*) &bp;
         }
 
-        DEBUG("remove old merk");
-        _merk->del( req->key(), treeid, pr->shard, pr->ver );
+        int rsize = sizeof(DBRecord) + dsize;
+        DBRecord *nr = (DBRecord*) malloc( rsize );
+        nr->ver    = r->version();
+        nr->expire = exp[i];
+        nr->shard  = r->shard();
+        nr->type   = type;
+        memcpy(nr->value, dp, dsize);
+
+        b->put('d', r->key(), rsize, (uchar*)nr);
+        free(nr);
+
+        MerkUndo u;
+        u.idx = i;
+        if( hasold ){
+            u.added = 0;
+            u.shard = pr->shard;
+            u.ver   = pr->ver;
+            if( _merk->del( r->key(), treeid[i], pr->shard, pr->ver, b ) ) undo[nundo++] = u;
+        }
+        u.added = 1;
+        u.shard = r->shard();
+        u.ver   = r->version();
+        if( _merk->add( r->key(), treeid[i], r->shard(), r->version(), b ) ) undo[nundo++] = u;
     }
-    hrtime_t t3 = hr_usec();
 
-    // run update program?
-    //   update + prog | insert + no value
-    if( req->program_size() && (old.size() || ! req->has_value()) ){
+    DEBUG("put set %d -> %d writes", n, b->count);
+
+    // the blobs must be on disk before the records that point at them
+    bool blobok = !nblob || _blob->sync();
+    if( !blobok ) delete b;
 
-        int dsize = old.size() - sizeof(DBRecord);
-        if( dsize > 0 ){
-            // get current value
-            req->set_value( pr->value, dsize );
+    if( !blobok || ! _batch_commit(b) ){
+        PROBLEM("database write failed %s", _name.c_str());
+        for(int i=0; i<n; i++){
+            if( result[i] == DBPUTST_DONE ) result[i] = DBPUTST_BAD;
         }
-        // run prog. it should alter req->value
-        if( !run_program( req ) ){
-            // failed
-            datalock[ lockno ].unlock();
-            return DBPUTST_BAD;
+
+        // back out the leaf changes, newest first
+        // the leaves are all still cached (dirty leaves are not evicted under a batch)
+        DBBatch *ub = _batch_begin();
+        for(int j=nundo-1; j>=0; j--){
+            MerkUndo *u = & undo[j];
+            const string& key = req[u->idx]->key();
+            if( u->added )
+                _merk->del( key, treeid[u->idx], u->shard, u->ver, ub );
+            else
+                _merk->add( key, treeid[u->idx], u->shard, u->ver, ub );
         }
+        delete ub;
+    }
+
+    for(int i=nml-1; i>=0; i--){
+        _merk->leaf_unlock( mlocks[i] );
+    }
+    for(int i=ndl-1; i>=0; i--){
+        datalock[ dlocks[i] ].unlock();
     }
-    hrtime_t t4 = hr_usec();
-
-    // only the origin runs the program
-    // remove it, and only propagate the value
-    req->clear_program();
-
-    // build record to insert
-    int dsize = req->value().size();
-    int rsize = sizeof(DBRecord) + dsize;
-    DBRecord *nr = (DBRecord*) malloc( rsize );
-    nr->ver    = req->version();
-    nr->expire = exp;
-    nr->shard  = req->shard();
-    nr->type   = dsize ? DBTYP_DATA : DBTYP_DELETED;
-    memcpy(nr->value, req->value().data(), dsize);
-
-    DEBUG("put '%s' [%d]", req->key().c_str(), rsize);
-    hrtime_t t5 = hr_usec();
-
-    _put('d', req->key(), rsize, (uchar*)nr);
-    hrtime_t t6 = hr_usec();
-
-    _merk->add( req->key(), treeid, req->shard(), req->version() );
-    hrtime_t t7 = hr_usec();
-    datalock[ lockno ].unlock();
 
     // only add it, if it is not the default expire
-    if( req->has_expire() ) _expr->add( req->key(), exp );
+    for(int i=0; i<n; i++){
+        if( result[i] == DBPUTST_DONE && req[i]->has_expire() )
+            _expr->add( req[i]->key(), exp[i] );
+    }
 
-    // VERBOSE("timing: %d %d %d %d %d %d %d", (int)(t1-t0), (int)(t2-t1), (int)(t3-t2), (int)(t4-t3), (int)(t5-t4), (int)(t6-t5), (int)(t7-t6));
-    free(nr);
-    return DBPUTST_DONE;
+    if( big ){
+        delete [] exp;
+        delete [] treeid;
+        delete [] old;
+        delete [] dlocks;
+        delete [] mlocks;
+        delete [] undo;
+    }
 }
 
 // actually remove, not tombstone
@@ -268,15 +535,29 @@ Database::remove(const string &key, int64_t ver){
         if( pr->expire > unow ) return 0;
     }
 
-    // RSN - determine partition from shard
-    int treeid = 0;
+    int treeid = _ring->treeid( _ring->partno(pr->shard) );
+    int ln     = _merk->leaf_lock_number( treeid, pr->ver );
 
-    // delete: data, then merkle
+    // delete the data, the leaf is written later by the flush thread
     DEBUG("del '%s'", key.c_str());
-    _del('d', key);
-    _merk->del( key, treeid, pr->shard, ver );
+    _merk->leaf_lock( ln );
+    DBBatch *b = _batch_begin();
+    b->del('d', key);
+    bool chg = _merk->del( key, treeid, pr->shard, pr->ver, b );
+    int ok = _batch_commit( b );
+
+    if( !ok ){
+        PROBLEM("database write failed %s", _name.c_str());
+        // put the leaf back
+        if( chg ){
+            b = _batch_begin();
+            _merk->add( key, treeid, pr->shard, pr->ver, b );
+            delete b;
+        }
+    }
+    _merk->leaf_unlock( ln );
 
-    return 1;
+    return ok;
 }
 
 /*
@@ -300,11 +581,95 @@ Database::del_internal(char sub, const string& key){
     return _del(sub, key);
 }
 
+//################################################################
+
+void
+DBBatch::put(char sub, const string& key, int len, const uchar *data){
+    MKSUBKEY(k, sub, key);
+
+    _pend[k].assign( (const char*)data, len );
+    _gone.erase(k);
+    _put(k, len, data);
+    count ++;
+}
+
+void
+DBBatch::del(char sub, const string& key){
+    MKSUBKEY(k, sub, key);
+
+    _pend.erase(k);
+    _gone.insert(k);
+    _del(k);
+    count ++;
+}
+
+int
+DBBatch::get(char sub, const string& key, string *res){
+    MKSUBKEY(k, sub, key);
+
+    std::map<string,string>::iterator it = _pend.find(k);
+    if( it != _pend.end() ){
+        res->assign( it->second );
+        return 1;
+    }
+    if( _gone.find(k) != _gone.end() ){
+        res->clear();
+        return -1;
+    }
+    return 0;
+}
+
+//################################################################
+
 void
 Database::upgrade(void){
     _merk->upgrade();
 }
 
+void
+Database::check_merkle(void){
+    _merk->check_format();
+}
+
+class DBFirstLR : public LambdaRange {
+public:
+    bool	found;
+
+    DBFirstLR() { found = 0; }
+    virtual bool call(const DBSlice& key, const DBSlice& val) {
+        found = 1;
+        return 0;
+    }
+};
+
+// the shard hash decides where every key lives. it cannot change under existing data
+// databases from before this was recorded used md5
+void
+Database::check_shardhash(void){
+    string have;
+    const char *want = hash_name(_shardhash);
+
+    _get('p', SHARDHASHKEY, &have);
+
+    if( have.empty() ){
+        DBFirstLR ff;
+        _range('d', "", "\xFF\xFF", &ff);
+        if( ff.found ) have = hash_name(HASH_MD5);
+    }
+
+    if( !have.empty() && have != want ){
+        FATAL("database '%s' uses shard_hash %s, config says %s", _name.c_str(), have.c_str(), want);
+    }
+
+    _put('p', SHARDHASHKEY, strlen(want), (const uchar*)want);
+}
+
+// the peer sent its nodes under a subtree. reply with the differences
+int
+Database::diff_merkle(ACPY2DiffRequest *req, ACPY2CheckReply *res){
+    return _merk->diff(req, res);
+}
+
 int
 Database::get_merkle(int level, int treeid, int64_t ver, int maxresult, ACPY2CheckReply *res){
 
@@ -15,6 +15,7 @@
 #include "lock.h"
 #include "network.h"
 #include "hrtime.h"
+#include "thread.h"
 #include "dbwire.h"
 #include "merkle.h"
 #include "expire.h"
@@ -22,14 +23,20 @@
 #include "database.h"
 #include "clientio.h"
 #include "stats.h"
+#include "throttle.h"
 
 #include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <deque>
 using std::deque;
+#include <map>
+using std::map;
+#include <vector>
+using std::vector;
 #include <algorithm>
 
 #include "y2db_getset.pb.h"
@@ -41,39 +48,271 @@ using std::deque;
 extern RP_Server * find_server(const char *id);
 
 
-class Distribute : public ClientIO {
+// replication is coalesced per peer: each (put, group) becomes a DistJob,
+// which is queued on the outbox of the server it is to be sent to.
+// an outbox is flushed as a single PUTSET once it has enough in it,
+// or once its oldest entry has waited long enough.
+// each job keeps its own hop/maxseen state, and moves on to the next
+// server (or is dropped) based on its own result code
+// repartition jobs (!andmore) must be confirmed - we have already deleted
+// our copy - so they are never dropped for being late, or for the peer
+// being down or backed up
+
+#define OUTBOX_MAXRECS	256
+#define OUTBOX_MAXSIZE	262144
+#define OUTBOX_DELAY	10000		// usec
+#define OUTBOX_INFLIGHT	2		// batches underway per peer
+#define OUTBOX_NOBATCH	300		// seconds before trying putset again
+#define OUTBOX_MAXPEND	4096		// jobs waiting per peer
+#define OUTBOX_DOWN	5		// seconds to pass over an unreachable peer
+
+class DistJob {
 public:
-    ACPY2DistReply    result;
-    Ring             *ring;
+    ACPY2DistRequest  req;
     deque<RP_Server*>*servers;
     const char       *info;
+    int		      size;
     int		      retries;
-    int               count;
     int		      maxseen;
     int 	      hops;
     bool	      andmore;
 
-    Distribute(Ring *, const ACPY2DistRequest *, deque<RP_Server*>*, const char *, int, bool);
-    virtual ~Distribute();
+    DistJob(const ACPY2DistRequest *, deque<RP_Server*>*, const char *, int, bool);
+    ~DistJob();
+};
+
+class DistOutbox {
+public:
+    Mutex	      lock;
+    NetAddr	      addr;
+    deque<DistJob*>   pending;
+    int		      pendsize;
+    hrtime_t	      oldest;
+    int		      inflight;
+    lrtime_t	      nobatch;		// peer does not do putset (until)
+    lrtime_t	      down;		// peer is unreachable (until)
+
+    DistOutbox(const NetAddr& a) : addr(a) { pendsize = 0; oldest = 0; inflight = 0; nobatch = 0; down = 0; }
+};
+
+class OutboxIO : public ClientIO {
+public:
+    ACPY2PutSetReply  result;
+    ACPY2DistReply    dresult;
+    DistOutbox       *outbox;
+    vector<DistJob*>  jobs;
+    bool	      batched;
+
+    OutboxIO(DistOutbox *, const google::protobuf::Message *, vector<DistJob*> *, bool);
+    virtual ~OutboxIO();
     virtual void on_error(void);
     virtual void on_success(void);
-    void another(void);
-
 };
 
-Distribute::Distribute(Ring *r, const ACPY2DistRequest *req, deque<RP_Server*>* dq, const char *in, int ms, bool am)
-    : ClientIO(dq->front()->bestaddr, PHMT_Y2_DIST, req) {
+static Mutex outbox_lock;
+static map<uint64_t, DistOutbox*> outboxes;
+static bool outbox_running = 0;
+
+static void dist_send(DistJob *, RP_Server *);
+static void dist_another(DistJob *);
+static void dist_skip(DistJob *, DistOutbox *);
+static void outbox_flush(DistOutbox *, bool);
+static void *outbox_flusher(void *);
 
-    dq->pop_front();
+
+DistJob::DistJob(const ACPY2DistRequest *r, deque<RP_Server*>* dq, const char *in, int ms, bool am){
+
+    req.CopyFrom( *r );
     servers = dq;
-    _res    = &result;
-    andmore = am;
+    info    = in;
+    size    = req.ByteSize();
     retries = 0;
     maxseen = ms;
-    info    = in;
-    hops    = req->hop();
+    hops    = req.hop();
+    andmore = am;
+}
+
+DistJob::~DistJob(){
+    DEBUG("done");
+    delete servers;
+}
+
+//################################################################
+
+static DistOutbox *
+outbox_get(const NetAddr *a){
+
+    uint64_t key = ((uint64_t)a->ipv4 << 16) | a->port;
+
+    outbox_lock.lock();
+    if( !outbox_running ){
+        outbox_running = 1;
+        start_thread( outbox_flusher, 0, 0 );
+    }
+
+    DistOutbox *ob = outboxes[key];
+    if( !ob ){
+        ob = new DistOutbox( *a );
+        outboxes[key] = ob;
+    }
+    outbox_lock.unlock();
+
+    return ob;
+}
+
+// add job to the outbox. returns 0 if the peer is down or too far behind
+static bool
+outbox_queue(DistOutbox *ob, DistJob *j, bool force){
+
+    ob->lock.lock();
+    if( !force && (ob->down >= lr_now() || ob->pending.size() >= OUTBOX_MAXPEND) ){
+        ob->lock.unlock();
+        return 0;
+    }
+    if( ob->pending.empty() ) ob->oldest = hr_now();
+    ob->pending.push_back( j );
+    ob->pendsize += j->size;
+    ob->lock.unlock();
+
+    return 1;
+}
+
+// queue job for server. flush if the outbox is full
+static void
+dist_send(DistJob *j, RP_Server *s){
+
+    DEBUG("sending to %s %s", j->info, s->bestaddr.name.c_str());
+
+    DistOutbox *ob = outbox_get( &s->bestaddr );
+
+    if( !outbox_queue(ob, j, 0) ){
+        DEBUG("skipping %s", ob->addr.name.c_str());
+        INCSTAT( distrib_errs );
+        dist_skip(j, ob);
+        return;
+    }
+
+    outbox_flush( ob, 0 );
+}
+
+// the peer is down or backed up. pass it along to the next one
+// if there are no more, wait in line (repartition) or leave it for AE
+static void
+dist_skip(DistJob *j, DistOutbox *ob){
+
+    if( !j->servers->empty() ){
+        dist_another(j);
+        return;
+    }
+
+    if( !j->andmore ){
+        DEBUG("holding %s for %s", j->req.data().key().c_str(), ob->addr.name.c_str());
+        outbox_queue(ob, j, 1);
+        return;
+    }
+
+    VERBOSE("could not send %s to %s, leaving it for anti-entropy", j->req.data().key().c_str(), ob->addr.name.c_str());
+    INCSTAT( distrib_drop );
+    delete j;
+}
+
+// send the next batch, if it is time
+// NB: must not be called with the outbox locked - sending may fail immediately, and call us back
+static void
+outbox_flush(DistOutbox *ob, bool timed){
+    vector<DistJob*> jobs;
+    bool batched;
+
+    ob->lock.lock();
+
+    if( ob->pending.empty() || ob->inflight >= OUTBOX_INFLIGHT || ob->down >= lr_now() ){
+        ob->lock.unlock();
+        return;
+    }
+    if( ob->pending.size() < OUTBOX_MAXRECS && ob->pendsize < OUTBOX_MAXSIZE
+        && !(timed && hr_now() - ob->oldest >= OUTBOX_DELAY * 1000LL) ){
+        ob->lock.unlock();
+        return;
+    }
 
-    DEBUG("sending to %s %s", info, _addr.name.c_str());
+    batched = ob->nobatch < lr_now();
+    int size = 0;
+    int64_t now = lr_usec();
+
+    while( !ob->pending.empty() ){
+        DistJob *j = ob->pending.front();
+        if( !jobs.empty() && (!batched || jobs.size() >= OUTBOX_MAXRECS || size + j->size > OUTBOX_MAXSIZE) )
+            break;
+        ob->pending.pop_front();
+        ob->pendsize -= j->size;
+
+        if( j->andmore && j->req.has_expire() && j->req.expire() < now ){
+            // waited too long. AE will get it there
+            DEBUG("expired %s", j->req.data().key().c_str());
+            INCSTAT( distrib_drop );
+            delete j;
+            continue;
+        }
+
+        size += j->size;
+        jobs.push_back( j );
+    }
+    if( !ob->pending.empty() ) ob->oldest = hr_now();
+    if( jobs.empty() ){
+        ob->lock.unlock();
+        return;
+    }
+    ob->inflight ++;
+    ob->lock.unlock();
+
+    INCSTAT( distrib_batch );
+
+    if( batched ){
+        ACPY2PutSet req;
+        req.set_traffic( THROT_REPLICATION );
+        for(int i=0; i<jobs.size(); i++)
+            req.add_data()->CopyFrom( jobs[i]->req );
+        DEBUG("sending %d to %s", (int)jobs.size(), ob->addr.name.c_str());
+        new OutboxIO(ob, &req, &jobs, 1);
+    }else{
+        new OutboxIO(ob, &jobs[0]->req, &jobs, 0);
+    }
+}
+
+// send anything that has been waiting too long
+static void *
+outbox_flusher(void *notused){
+    vector<DistOutbox*> all;
+
+    while(1){
+        usleep( OUTBOX_DELAY );
+
+        outbox_lock.lock();
+        for(map<uint64_t, DistOutbox*>::iterator it=outboxes.begin(); it != outboxes.end(); it++){
+            all.push_back( it->second );
+        }
+        outbox_lock.unlock();
+
+        for(int i=0; i<all.size(); i++){
+            outbox_flush( all[i], 1 );
+        }
+        all.clear();
+    }
+
+    return 0;
+}
+
+//################################################################
+
+OutboxIO::OutboxIO(DistOutbox *ob, const google::protobuf::Message *req, vector<DistJob*> *j, bool b)
+    : ClientIO(ob->addr, b ? PHMT_Y2_PUTSET : PHMT_Y2_DIST, req) {
+
+    outbox  = ob;
+    batched = b;
+    _res    = b ? (google::protobuf::Message*)&result : (google::protobuf::Message*)&dresult;
+    jobs.swap( *j );
+
+    throttle_note( THROT_REPLICATION, THROT_NET, _wbuf.size() );
 
     _lock.lock();
     set_timeout(TIMEOUT);
@@ -81,71 +320,140 @@ Distribute::Distribute(Ring *r, const ACPY2DistRequest *req, deque<RP_Server*>*
     _lock.unlock();
 }
 
-Distribute::~Distribute(){
-    DEBUG("done");
-    delete servers;
+OutboxIO::~OutboxIO(){
+    // anything left over was not sent
+    for(int i=0; i<jobs.size(); i++)
+        delete jobs[i];
 }
 
-//################################################################
+static void
+dist_error(DistJob *j, const NetAddr *addr){
 
-void
-Distribute::on_error(void){
+    if( ++j->retries > MAXTRY ){
+        dist_another(j);
+        return;
+    }
 
-    DEBUG("error");
-    INCSTAT( distrib_errs );
-    if( ++retries > MAXTRY )
-        another();
-    else
-        start();
-}
+    // resend to the same server
+    DistOutbox *ob = outbox_get( addr );
 
-void
-Distribute::on_success(void){
+    if( !outbox_queue(ob, j, 0) )
+        dist_skip(j, ob);
+}
 
-    // check reply
-    int rc = result.result_code();
+static void
+dist_result(DistJob *j, int rc){
 
-    if( andmore ){
+    if( j->andmore ){
         // normal data distribution
         // keep sending it until it is well distributed (others already saw it)
         if( rc == DBPUTST_DONE )
-            another();
-        else if( --maxseen > 0 ){
+            dist_another(j);
+        else if( --j->maxseen > 0 ){
             INCSTAT( distrib_seen );
             // another, but skip ahead
-            for(int i=0; i<=hops; i++){
-                if( servers->size() > 1 ) servers->pop_front();
+            for(int i=0; i<=j->hops; i++){
+                if( j->servers->size() > 1 ) j->servers->pop_front();
             }
-            another();
+            dist_another(j);
         }else
-            discard();
+            delete j;
     }else{
         // repartition data migration
         // keep sending until someone confirms they have a copy
         if( rc == DBPUTST_DONE || rc == DBPUTST_HAVE )
-            discard();
+            delete j;
         else
-            another();
+            dist_another(j);
     }
 }
 
-void
-Distribute::another(void){
+static void
+dist_another(DistJob *j){
 
     // send to next server on list
 
-    retries = 0;
+    j->retries = 0;
 
-    if( servers->empty() ){
-        discard();
+    if( j->servers->empty() ){
+        delete j;
         return;
     }
 
-    RP_Server *s = servers->front();
-    servers->pop_front();
+    RP_Server *s = j->servers->front();
+    j->servers->pop_front();
 
-    DEBUG("sending next to %s", s->bestaddr.name.c_str());
-    retry( s->bestaddr );
+    dist_send(j, s);
+}
+
+static void
+outbox_done(DistOutbox *ob){
+
+    ob->lock.lock();
+    ob->inflight --;
+    ob->lock.unlock();
+
+    // keep things moving
+    outbox_flush( ob, 1 );
+}
+
+void
+OutboxIO::on_error(void){
+
+    DEBUG("error");
+    INCSTAT( distrib_errs );
+
+    if( batched && error_reply() && !error_code() ){
+        // older peer, send one at a time
+        VERBOSE("%s does not accept batches", _addr.name.c_str());
+        outbox->lock.lock();
+        outbox->nobatch = lr_now() + OUTBOX_NOBATCH;
+        outbox->lock.unlock();
+    }
+
+    if( error_reply() ){
+        // it is there, try again
+        for(int i=0; i<jobs.size(); i++)
+            dist_error( jobs[i], &_addr );
+    }else{
+        // could not connect, or timed out
+        // everything waiting on this peer moves on to the next server now
+        deque<DistJob*> waiting;
+
+        VERBOSE("%s is not responding, passing it over", _addr.name.c_str());
+        outbox->lock.lock();
+        outbox->down = lr_now() + OUTBOX_DOWN;
+        waiting.swap( outbox->pending );
+        outbox->pendsize = 0;
+        outbox->lock.unlock();
+
+        for(int i=0; i<jobs.size(); i++)
+            dist_skip( jobs[i], outbox );
+        for(int i=0; i<waiting.size(); i++)
+            dist_skip( waiting[i], outbox );
+    }
+    jobs.clear();
+
+    outbox_done( outbox );
+    discard();
+}
+
+void
+OutboxIO::on_success(void){
+
+    // check replies
+    for(int i=0; i<jobs.size(); i++){
+        if( !batched )
+            dist_result( jobs[i], dresult.result_code() );
+        else if( i < result.result_code_size() )
+            dist_result( jobs[i], result.result_code(i) );
+        else
+            dist_error( jobs[i], &_addr );
+    }
+    jobs.clear();
+
+    outbox_done( outbox );
+    discard();
 }
 
 //################################################################
@@ -163,10 +471,11 @@ Ring::distrib(int part, ACPY2DistRequest *req){
 
     if( req->has_sender() && req->hop() > MAXHOP )
         return 0;
-    if( req->has_expire() && req->expire() < hr_usec() )
+    if( req->has_expire() && req->expire() < lr_usec() )
         return 0;
 
     INCSTAT( distrib );
+    throttle_note( THROT_REPLICATION, THROT_NET, req->ByteSize() );
 
     // determine distribution strategy
     /*
@@ -316,12 +625,15 @@ Ring::distrib(int part, ACPY2DistRequest *req){
 
     _lock.r_unlock();
 
+    int sent = 0;
+
     // NB: ~distribute() will free the deques when finished
     if( faraway ){
         if( faraway->empty() )
             delete faraway;
         else{
-            new Distribute(this, req, faraway, "faraway", 2, andmore);
+            dist_another( new DistJob(req, faraway, "faraway", 2, andmore) );
+            sent ++;
         }
     }
 
@@ -334,7 +646,8 @@ Ring::distrib(int part, ACPY2DistRequest *req){
             else
                 std::random_shuffle( midway->begin(), midway->end() );
 
-            new Distribute(this, req, midway, "midway", maxsee, andmore);
+            dist_another( new DistJob(req, midway, "midway", maxsee, andmore) );
+            sent ++;
         }
     }
 
@@ -346,9 +659,10 @@ Ring::distrib(int part, ACPY2DistRequest *req){
         else
             std::random_shuffle( nearby->begin(), nearby->end() );
 
-        new Distribute(this, req, nearby, "nearby", maxsee, andmore);
+        dist_another( new DistJob(req, nearby, "nearby", maxsee, andmore) );
+        sent ++;
     }
 
-
+    return sent;
 }
 
@@ -30,8 +30,6 @@
 
 #include <algorithm>
 
-#include "y2db_check.pb.h"
-
 
 #define TBUCK 	0xFFFFFFF	// ~5 minutes
 
@@ -55,9 +53,8 @@ expire_maint(void *x){
 
 //################################################################
 
-Expire::Expire(Database* be){
+Expire::Expire(Database* be) : _pool(EXPIRE_POOL) {
     _be = be;
-    _pq = new ExpireQueue;
 
     start_thread( expire_maint, (void*)this, 0 );
     // QQQ - do expires in seperate thread?
@@ -69,19 +66,19 @@ Expire::add(const string& key, int64_t exp){
     exp += TBUCK;
     exp &= ~ TBUCK;
 
-    // queue record
-    ExpireNote *no = new ExpireNote(key, exp);
-    _lock.lock();
-    _pq->push(no);
-    _lock.unlock();
+    // queue record. no locks
+    ExpireNote *no = _pool.get();
+    no->key = key;
+    no->exp = exp;
+    _q.push(no);
 }
 
 void
-Expire::flush_put(const string& eky, deque<string> *dv){
+Expire::flush_put(const string& eky, deque<string> *dv, DBBatch *b){
 
     // remove dupes
     std::sort(   dv->begin(), dv->end() );
-    std::unique( dv->begin(), dv->end() );
+    dv->erase( std::unique( dv->begin(), dv->end() ), dv->end() );
 
     // serialize. \0 delimited
     string val;
@@ -89,7 +86,7 @@ Expire::flush_put(const string& eky, deque<string> *dv){
         if( !val.empty() ) val.append(1,'\0');
         val.append( dv->at(i) );
     }
-    _be->_put('x', eky, val);
+    b->put('x', eky, val);
     DEBUG("flush node %s [%d]", eky.c_str(), dv->size());
 
     dv->clear();
@@ -98,10 +95,12 @@ Expire::flush_put(const string& eky, deque<string> *dv){
 void
 Expire::flush(void){
 
-    _lock.lock();
-    ExpireQueue *q = _pq;
-    _pq = new ExpireQueue;
-    _lock.unlock();
+    ExpireNote *l = _q.take();
+    if( !l ) return;
+
+    vector<ExpireNote*> q;
+    for( ; l; l = l->_qnext ) q.push_back(l);
+    std::sort( q.begin(), q.end(), ExpireNote::comparator() );
 
     char buf[32];
     string eky;
@@ -110,14 +109,16 @@ Expire::flush(void){
     int64_t exp = 0;
     int n = 0;
 
-    while( !q->empty() ){
-        ExpireNote *no = q->top();
-        q->pop();
+    // all of the nodes go down in one write
+    DBBatch *b = _be->_batch_begin();
+
+    for(int i=0; i<q.size(); i++){
+        ExpireNote *no = q[i];
 
         if( no->exp != exp ){
             if( exp ){
                 // save previous
-                flush_put(eky, &vq);
+                flush_put(eky, &vq, b);
             }
             // get
             exp = no->exp;
@@ -128,16 +129,16 @@ Expire::flush(void){
         }
         // add to current
         vq.push_back( no->key );
-        delete no;
+        _pool.put(no);
         n ++;
     }
 
     // save
-    if( val.size() ){
-        flush_put(eky, &vq);
+    if( !vq.empty() ){
+        flush_put(eky, &vq, b);
     }
 
-    delete q;
+    if( ! _be->_batch_commit(b) ) PROBLEM("expire flush failed %d", n);
 
     if( n )
         DEBUG("flushed %d", n);
@@ -145,84 +146,41 @@ Expire::flush(void){
 
 void
 Expire::expire(void){
-    expire_edge();
     expire_spec();
 }
 
 //################################################################
 
-class ExpireELR : public LambdaRange {
-    Database *be;
-public:
-    ExpireELR(Database *b) {be = b;}
-    virtual bool call(const string&, const string&);
-};
-
-bool
-ExpireELR::call(const string& key, const string& val){
-
-    // parse merkle-tree leaf node
-    ACPY2MerkleLeaf l;
-    l.ParsePartialFromString(val);
-
-    // delete all keys in node
-    for(int i=0; i<l.rec_size(); i++){
-        ACPY2MerkleLeafRec *rec = l.mutable_rec(i);
-        be->remove(rec->key(), rec->version());
-    }
-
-    return 1;
-}
-
-void
-Expire::expire_edge(void){
-    char buf[32];
-    string start, end;
-
-    // get merkle leaves < expire_time
-    // 'm', 10/<part>/<time>
-
-    if( ! _be->_expire ) return;
-    int npart = _be->_ring->num_parts();
-    int64_t texp = hr_usec() - _be->_expire;
-
-    for(int i=0; i<npart; i++){
-        int pn = _be->_ring->treeid(i);
-        snprintf(buf, sizeof(buf), "10/%04X/", pn);
-        start = buf;
-        snprintf(buf, sizeof(buf), "10/%04X/%012llX", pn, texp>>16);
-        end   = buf;
-        ExpireELR ef(_be);
-
-        DEBUG("expire edge %s - %s", start.c_str(), end.c_str());
-        _be->_range('m', start, end, &ef);
-    }
-}
-
-//################################################################
-
 class ExpireSLR : public LambdaRange {
     Database *be;
 public:
     ExpireSLR(Database *b) {be = b;}
-    virtual bool call(const string&, const string&);
+    virtual bool call(const DBSlice&, const DBSlice&);
 };
 
 bool
-ExpireSLR::call(const string& key, const string& val){
+ExpireSLR::call(const DBSlice& key, const DBSlice& val){
+    string ekey = key.str();
+
+    DEBUG("expiring node %s [%d]", ekey.c_str(), val.size);
+
+    // walk the \0 delimited list in place
+    const char *p   = val.data;
+    const char *end = val.data + val.size;
+    string dkey;
 
-    DEBUG("expiring node %s [%d]", key.c_str(), val.size());
-    // parse expire node
-    deque<string> l;
-    split(val, '\0', &l);
+    while( p < end ){
+        const char *e = (const char*)memchr(p, 0, end - p);
+        if( !e ) e = end;
 
-    for(int i=0; i<l.size(); i++){
-        DEBUG("%s", l[i].c_str());
-        be->remove( key, 0 );
+        dkey.assign(p, e - p);
+        DEBUG("%s", dkey.c_str());
+        if( !dkey.empty() ) be->remove( dkey, 0 );
+        p = e + 1;
     }
 
     // remove the node
-    be->del_internal('x', key);
+    be->del_internal('x', ekey);
     return 1;
 }
 
@@ -239,5 +197,5 @@ Expire::expire_spec(void){
 
     // get expire nodes < now
     DEBUG("expire spec 0 - %s", end.c_str());
-    _be->_range('x', start, end, &ef);
+    _be->_range('x', start, end, &ef, RANGE_MAINT);
 }
@@ -0,0 +1,210 @@
+/*
+  Copyright (c) 2015
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2015-Mar-18 10:42 (EDT)
+  Function: fast non-cryptographic hashes
+
+*/
+
+#define CURRENT_SUBSYSTEM	'y'
+
+#include "defs.h"
+#include "diag.h"
+#include "misc.h"
+#include "crypto.h"
+#include "hash.h"
+
+#include <string.h>
+
+// MurmurHash3, by Austin Appleby (public domain)
+// blocks are read little-endian, so results are the same everywhere
+
+static struct {
+    const char *name;
+    int		alg;
+} hashname[] = {
+    { "md5",		HASH_MD5     },
+    { "murmur3",	HASH_MURMUR3 },
+};
+
+int
+hash_alg(const string& name){
+
+    for(int i=0; i<ELEMENTSIN(hashname); i++){
+        if( name == hashname[i].name ) return hashname[i].alg;
+    }
+    return -1;
+}
+
+const char *
+hash_name(int alg){
+
+    for(int i=0; i<ELEMENTSIN(hashname); i++){
+        if( alg == hashname[i].alg ) return hashname[i].name;
+    }
+    return "unknown";
+}
+
+// 128 bit hash, truncated to outlen
+void
+hash_bin(int alg, const uchar *in, int inlen, char *out, int outlen){
+    uchar h[16];
+
+    switch(alg){
+    case HASH_MURMUR3:
+        murmur3_128(in, inlen, 0, h);
+        memcpy(out, h, MIN(outlen, 16));
+        break;
+    default:
+        md5_bin(in, inlen, out, outlen);
+        break;
+    }
+}
+
+//################################################################
+
+static inline uint32_t
+rotl32(uint32_t x, int r){
+    return (x << r) | (x >> (32 - r));
+}
+
+static inline uint64_t
+rotl64(uint64_t x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint32_t
+get32le(const uchar *p){
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t
+get64le(const uchar *p){
+    return get32le(p) | ((uint64_t)get32le(p + 4) << 32);
+}
+
+static inline void
+put64le(uchar *p, uint64_t v){
+    for(int i=0; i<8; i++){
+        p[i] = v & 0xFF;
+        v >>= 8;
+    }
+}
+
+static inline uint32_t
+fmix32(uint32_t h){
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static inline uint64_t
+fmix64(uint64_t k){
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdLL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53LL;
+    k ^= k >> 33;
+    return k;
+}
+
+// x86_32 variant
+uint32_t
+murmur3_32(const uchar *data, int len, uint32_t seed){
+    const uint32_t c1 = 0xcc9e2d51;
+    const uint32_t c2 = 0x1b873593;
+    int nblocks = len / 4;
+    uint32_t h1 = seed;
+
+    for(int i=0; i<nblocks; i++){
+        uint32_t k1 = get32le(data + i * 4);
+
+        k1 *= c1;
+        k1  = rotl32(k1, 15);
+        k1 *= c2;
+
+        h1 ^= k1;
+        h1  = rotl32(h1, 13);
+        h1  = h1 * 5 + 0xe6546b64;
+    }
+
+    const uchar *tail = data + nblocks * 4;
+    uint32_t k1 = 0;
+
+    switch(len & 3){
+    case 3: k1 ^= tail[2] << 16;
+    case 2: k1 ^= tail[1] << 8;
+    case 1: k1 ^= tail[0];
+        k1 *= c1;
+        k1  = rotl32(k1, 15);
+        k1 *= c2;
+        h1 ^= k1;
+    }
+
+    h1 ^= len;
+    return fmix32(h1);
+}
+
+// x64_128 variant
+void
+murmur3_128(const uchar *data, int len, uint32_t seed, uchar *out){
+    const uint64_t c1 = 0x87c37b91114253d5LL;
+    const uint64_t c2 = 0x4cf5ad432745937fLL;
+    int nblocks = len / 16;
+    uint64_t h1 = seed;
+    uint64_t h2 = seed;
+
+    for(int i=0; i<nblocks; i++){
+        uint64_t k1 = get64le(data + i * 16);
+        uint64_t k2 = get64le(data + i * 16 + 8);
+
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1  = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2  = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    const uchar *tail = data + nblocks * 16;
+    uint64_t k1 = 0;
+    uint64_t k2 = 0;
+
+    switch(len & 15){
+    case 15: k2 ^= ((uint64_t)tail[14]) << 48;
+    case 14: k2 ^= ((uint64_t)tail[13]) << 40;
+    case 13: k2 ^= ((uint64_t)tail[12]) << 32;
+    case 12: k2 ^= ((uint64_t)tail[11]) << 24;
+    case 11: k2 ^= ((uint64_t)tail[10]) << 16;
+    case 10: k2 ^= ((uint64_t)tail[ 9]) << 8;
+    case  9: k2 ^= ((uint64_t)tail[ 8]);
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        // fall thru
+    case  8: k1 ^= ((uint64_t)tail[ 7]) << 56;
+    case  7: k1 ^= ((uint64_t)tail[ 6]) << 48;
+    case  6: k1 ^= ((uint64_t)tail[ 5]) << 40;
+    case  5: k1 ^= ((uint64_t)tail[ 4]) << 32;
+    case  4: k1 ^= ((uint64_t)tail[ 3]) << 24;
+    case  3: k1 ^= ((uint64_t)tail[ 2]) << 16;
+    case  2: k1 ^= ((uint64_t)tail[ 1]) << 8;
+    case  1: k1 ^= ((uint64_t)tail[ 0]);
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= len;
+    h2 ^= len;
+
+    h1 += h2;
+    h2 += h1;
+
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+
+    h1 += h2;
+    h2 += h1;
+
+    put64le(out,     h1);
+    put64le(out + 8, h2);
+}
@@ -12,6 +12,7 @@
 #include "config.h"
 #include "misc.h"
 #include "network.h"
+#include "netutil.h"
 #include "hrtime.h"
 #include "peers.h"
 
@@ -62,9 +63,6 @@ y2_status(struct NTD *ntd){
     }
 
     // serialize + reply
-    write_reply(ntd, &res, 0, TIMEOUT);
-
-    // nothing else to send
-    return 0;
+    return serialize_reply(ntd, &res, 0);
 }
 
@@ -14,6 +14,9 @@
 #include "diag.h"
 #include "runmode.h"
 
+#include <errno.h>
+#include <time.h>
+
 static void
 lock_report(hrtime_t t0, hrtime_t t1, hrtime_t t2){
 
@@ -156,3 +159,42 @@ RWLock::w_trylock(void){
     return pthread_rwlock_trywrlock( &_rwlock );
 }
 
+
+//################################################################
+
+CondVar::CondVar(){
+    pthread_cond_init( &_cond, 0 );
+}
+
+CondVar::~CondVar(){
+    pthread_cond_destroy( &_cond );
+}
+
+void
+CondVar::wait(Mutex *m){
+    pthread_cond_wait( &_cond, &m->_mutex );
+}
+
+int
+CondVar::timedwait(Mutex *m, int msec){
+    struct timespec ts;
+
+    // NB: absolute wall clock time, not hrtime
+    clock_gettime( CLOCK_REALTIME, &ts );
+    long long t = ts.tv_nsec + msec * ONE_MSEC_HR;
+    ts.tv_sec  += t / ONE_SECOND_HR;
+    ts.tv_nsec  = t % ONE_SECOND_HR;
+
+    int e = pthread_cond_timedwait( &_cond, &m->_mutex, &ts );
+    return e == ETIMEDOUT;
+}
+
+void
+CondVar::signal(void){
+    pthread_cond_signal( &_cond );
+}
+
+void
+CondVar::broadcast(void){
+    pthread_cond_broadcast( &_cond );
+}
@@ -23,6 +23,9 @@
 #include "runmode.h"
 #include "stats.h"
 #include "dbwire.h"
+#include "hash.h"
+#include "bulk.h"
+#include "throttle.h"
 
 #include <ctype.h>
 #include <stdlib.h>
@@ -37,6 +40,8 @@
 
 #define F16		0xFFFFFFFFFFFFFFFFLL
 #define LEAFCACHE
+#define LEAFFLUSHGROUP	16	// leaf cache slots per flush write
+#define MAXFLUSHBATCH	1000	// node updates per flush write
 //#define MERKFIX
 
 void hex_encode(const unsigned char *in, int inlen, char *out, int outlen);
@@ -60,6 +65,15 @@ merkle_flusher(void *x){
     }
 }
 
+// flush workers, shared by all of the trees in a database
+static void*
+merkle_flush_worker(void *x){
+    Merkle *m = (Merkle*)x;
+
+    m->flush_worker();
+    return 0;
+}
+
 //################################################################
 
 
@@ -77,14 +91,36 @@ merkle_level_version(int l, uint64_t ver){
     return ver & mask;
 }
 
-static inline void
+// <level:8><treeid:16><ver&mask:48>, big endian
+// sorts the same as the older text keys <level>/<treeid>/<ver&mask>
+void
 merkle_key(int l, int treeid, uint64_t ver, string *k){
+    uint64_t mn = merkle_number(merkle_level_version(l, ver));
+    char buf[MERKLE_KEYLEN];
+
+    buf[0] = l;
+    buf[1] = treeid >> 8;
+    buf[2] = treeid;
+    for(int i=0; i<6; i++){
+        buf[3 + i] = mn >> ((5 - i) << 3);
+    }
+
+    k->assign(buf, MERKLE_KEYLEN);
+}
+
+// printable form, for diagnostics
+static string
+merkle_keystr(const string& k){
     char buf[32];
 
-    // expire expects to see "10/tree/ver..."
-    // <level>/<treeid>/<ver&mask> => 10/1234/000123456789
-    snprintf(buf, sizeof(buf), "%02X/%04X/%012llX", l, treeid, merkle_number(merkle_level_version(l, ver)));
-    k->assign(buf);
+    if( k.size() != MERKLE_KEYLEN ) return k;
+
+    const uchar *p = (const uchar*) k.data();
+    uint64_t mn = 0;
+    for(int i=3; i<MERKLE_KEYLEN; i++) mn = (mn << 8) | p[i];
+
+    snprintf(buf, sizeof(buf), "%02X/%04X/%012llX", p[0], (p[1] << 8) | p[2], mn);
+    return buf;
 }
 
 static inline int
@@ -105,188 +141,248 @@ merkle_next_version(int l, uint64_t ver, int slot){
 
 //################################################################
 
-Merkle::Merkle(Database* be){
+Merkle::Merkle(Database* be, DBConf *cf) : _mpool(MERKLE_POOL) {
     _be  = be;
-    _mnm = new MerkleChangeQ;
+    _wbusy   = 0;
+    _nworker = cf->merkle_threads;
+    _hashalg = hash_alg( cf->merkle_hash );
+    if( _hashalg < 0 ){
+        PROBLEM("unknown merkle_hash '%s', using md5", cf->merkle_hash.c_str());
+        _hashalg = HASH_MD5;
+    }
+    _hashxor = cf->merkle_xor;
+    _ncache.set_max( cf->merkle_cache * 1024LL * 1024 );
+
+    for(int i=0; i<MERKLE_NLOCK; i++){
+        _cache[i]._max = cf->merkle_leaves * 1024LL * 1024 / MERKLE_NLOCK;
+    }
 
     start_thread( merkle_flusher, (void*)this, 0 );
-    // RSN - configurable - run more threads
+
+    // with one, the flush thread does the work itself
+    if( _nworker > 1 ){
+        for(int i=0; i<_nworker; i++){
+            start_thread( merkle_flush_worker, (void*)this, 0 );
+        }
+    }
 }
 
 //################################################################
 
-static bool
-leafrec_compare(const ACPY2MerkleLeafRec &a, const ACPY2MerkleLeafRec &b){
+// leaves are normally updated one at a time, under the leaf lock
+// batched updates hold the leaf locks (ascending order) until the batch is written
+// updated leaves stay in the leaf cache, and are written by the flush thread
 
-    if( a.version() < b.version() ) return 1;
-    if( a.version() > b.version() ) return 0;
-    if( a.key()     < b.key()     ) return 1;
-    return 0;
+int
+Merkle::leaf_lock_number(int treeid, int64_t ver){
+    return merkle_lock_number(MERKLE_HEIGHT, treeid, ver);
 }
 
-static bool
-leafrec_equal(const ACPY2MerkleLeafRec &a, const ACPY2MerkleLeafRec &b){
+void
+Merkle::leaf_lock(int ln){
+    _nlock[ln].lock();
+}
 
-    if( a.version() != b.version() ) return 0;
-    if( a.key()     != b.key()     ) return 0;
-    return 1;
+void
+Merkle::leaf_unlock(int ln){
+    _nlock[ln].unlock();
 }
 
+// read/write node, via the batch if we have one
+void
+Merkle::node_read(const string& mkey, string *val, DBBatch *b){
+
+    if( b && b->get('m', mkey, val) ) return;
+    _be->_get('m', mkey, val);
+}
+
+void
+Merkle::node_write(const string& mkey, const string *val, DBBatch *b){
+
+    if( val->empty() ){
+        if( b )
+            b->del('m', mkey);
+        else
+            _be->_del('m', mkey);
+    }else{
+        if( b )
+            b->put('m', mkey, *val);
+        else
+            _be->_put('m', mkey, *val);
+    }
+}
+
+// read a node, via the cache for the upper levels
+void
+Merkle::node_get(int level, const string& mkey, string *val){
 
+    if( level > MERKLE_CACHELEVEL ){
+        _be->_get('m', mkey, val);
+        return;
+    }
+
+    if( _ncache.get(mkey, val) ) return;
+
+    uint32_t g = _ncache.gen(mkey);
+    val->clear();
+    _be->_get('m', mkey, val);
+    _ncache.fill(mkey, *val, g);
+}
+
+// write the batch, then make the node cache match
+void
+Merkle::node_commit(DBBatch *b, MerkleNodePend *pend){
+
+    if( ! _be->_batch_commit(b) ) PROBLEM("merkle flush failed");
+
+    for(int i=0; i<pend->size(); i++){
+        _ncache.update( (*pend)[i].first, (*pend)[i].second );
+    }
+    pend->clear();
+}
 
 // add entry to merkle tree
 // add/update leaf entry now, queue higher level updates
 void
 Merkle::add(const string& key, int treeid, int shard, int64_t ver){
+    int ln = merkle_lock_number(MERKLE_HEIGHT, treeid, ver);
+
+    _nlock[ln].lock();
+    DEBUG("lock %d", ln);
+
+    add(key, treeid, shard, ver, (DBBatch*)0);
+
+    if( ! _nlock[ln].trylock() ) FATAL("lock %d not locked", ln);
+    DEBUG("unlock %d", ln);
+    _nlock[ln].unlock();
+}
+
+// leaf lock is already held
+// 1 => the leaf changed
+bool
+Merkle::add(const string& key, int treeid, int shard, int64_t ver, DBBatch *b){
     string mkey;
     merkle_key(MERKLE_HEIGHT, treeid, ver, &mkey);
     int ln = merkle_lock_number(MERKLE_HEIGHT, treeid, ver);
 
-    ACPY2MerkleLeaf l;
-
-    DEBUG("leaf %d %016llX => %s lock %d; %s", treeid, ver, mkey.c_str(), ln, key.c_str());
+    string *val;
 
-    // get leaf node, append, write
-    _nlock[ln].lock();
-    DEBUG("lock %d %s", ln, mkey.c_str());
+    DEBUG("leaf %d %016llX => %s lock %d; %s", treeid, ver, merkle_keystr(mkey).c_str(), ln, key.c_str());
 
+    // get leaf node, insert, write
 #ifdef LEAFCACHE
-    string *val = leafcache_get(ln, mkey);
-    l.ParsePartialFromString( *val );
-    DEBUG("sz %d nr %d", val->size(), l.rec_size());
+    val = leafcache_get(ln, mkey, b);
 #else
-    string val;
-    _be->_get('m', mkey, &val);
-    l.ParsePartialFromString(val);
+    string sval;
+    val = &sval;
+    node_read(mkey, val, b);
 #endif
 
-    // check not already in
-    int i;
-    bool found=0;
-    for(i=0; i<l.rec_size(); i++){
-        ACPY2MerkleLeafRec *rec = l.mutable_rec(i);
-        if( rec->version() == ver && rec->key() == key ){
-            found = 1;
-            break;
-        }else{
-            if( rec->key() == key )
-                DEBUG("!= %s %s; %016llX %016llx", key.c_str(), rec->key().c_str(), ver, rec->version());
-        }
+    MerkleLeaf l(val->data(), val->size());
+    int count = l.count();
+    DEBUG("sz %d nr %d", val->size(), count);
 
-        // XXX
-        if( merkle_level_version(MERKLE_HEIGHT, ver) != merkle_level_version(MERKLE_HEIGHT, rec->version()) )
-            FATAL("merkle key misplaced node %s; ver %016llX lock %d", mkey.c_str(), rec->version(), ln);
-    }
+    // XXX
+    if( count && merkle_level_version(MERKLE_HEIGHT, ver) != merkle_level_version(MERKLE_HEIGHT, l.version(0)) )
+        FATAL("merkle key misplaced node %s; ver %016llX lock %d", merkle_keystr(mkey).c_str(), l.version(0), ln);
 
-    if( !found ){
-        ACPY2MerkleLeafRec *rec = l.add_rec();
-        rec->set_key(     key );
-        rec->set_version( ver );
-        rec->set_shard(   shard );
-        // keep them in sorted order
-        if( l.rec_size() > 1 ){
-            google::protobuf::RepeatedPtrField<ACPY2MerkleLeafRec> *lc = l.mutable_rec();
-            std::sort( lc->begin(), lc->end(), leafrec_compare );
-        }
-        DEBUG("grow %d", l.rec_size());
-    }else{
+    // check not already in
+    bool found;
+    int pos = l.find(key, ver, &found);
+    uchar delta[MERKLE_HASHLEN];
+    memset(delta, 0, MERKLE_HASHLEN);
+
+    if( found ){
+        // nothing changed, nothing to write
         DEBUG("found");
+        return 0;
     }
 
+    if( !count ) val->clear();	// in case it was corrupt
+    if( !MerkleLeaf::insert(val, pos, key, ver, shard) ) return 0;
+    count ++;
+    if( _hashxor ) MerkleLeaf::rechash(_hashalg, key.data(), key.size(), ver, shard, delta);
+    DEBUG("grow %d", count);
+
 #ifdef LEAFCACHE
-    l.SerializeToString( val );
-    DEBUG("sz %d nr %d", val->size(), l.rec_size());
-    leafcache_set(ln, treeid, ver, l.rec_size() );
+    leafcache_set(ln, treeid, ver, count, delta );
 #else
-    l.SerializeToString( &val );
-    _be->_put('m', mkey, val);
+    node_write(mkey, val, b);
     // queue higher nodes
-    q_leafnext( treeid, ver, l.rec_size(), &val );
+    q_leafnext( treeid, ver, count, val, 0 );
 #endif
-
-    if( ! _nlock[ln].trylock() ) FATAL("lock %d not locked", ln);
-    DEBUG("unlock %d", ln);
-    _nlock[ln].unlock();
-
+    return 1;
 }
 
 // remove entry from merkle tree
 // update leaf entry now, queue higher level updates
 void
 Merkle::del(const string& key, int treeid, int shard, int64_t ver){
+    int ln = merkle_lock_number(MERKLE_HEIGHT, treeid, ver);
+
+    _nlock[ln].lock();
+    del(key, treeid, shard, ver, (DBBatch*)0);
+    _nlock[ln].unlock();
+}
+
+// leaf lock is already held
+// 1 => the leaf changed
+bool
+Merkle::del(const string& key, int treeid, int shard, int64_t ver, DBBatch *b){
     string mkey;
     merkle_key(MERKLE_HEIGHT, treeid, ver, &mkey);
     int ln = merkle_lock_number(MERKLE_HEIGHT, treeid, ver);
 
     string *val;
-    ACPY2MerkleLeaf l;
-    int keep = 0;
 
-    DEBUG("leaf %d %016llX => %s lock %d; %s", treeid, ver, mkey.c_str(), ln, key.c_str());
+    DEBUG("leaf %d %016llX => %s lock %d; %s", treeid, ver, merkle_keystr(mkey).c_str(), ln, key.c_str());
 
     // get leaf node, del, write
-    _nlock[ln].lock();
-
 #ifdef LEAFCACHE
-    val = leafcache_get(ln, mkey);
+    val = leafcache_get(ln, mkey, b);
 
 #else
     string sval;
     val = &sval;
 
-    _be->_get('m', mkey, val);
+    node_read(mkey, val, b);
 #endif
 
-    l.ParsePartialFromString(*val);
-
-    DEBUG("nr %d", l.rec_size());
-    // DEBUG("l=%d, %s", val.size(), l.ShortDebugString().c_str());
+    MerkleLeaf l(val->data(), val->size());
+    int count = l.count();
 
-    // move deleted elems to front
-    for(int i=0; i<l.rec_size(); i++){
-        ACPY2MerkleLeafRec *rec = l.mutable_rec(i);
+    DEBUG("nr %d", count);
 
-        // XXX
-        if( merkle_level_version(MERKLE_HEIGHT, ver) != merkle_level_version(MERKLE_HEIGHT, rec->version()) )
-            FATAL("merkle key misplaced node %s; ver %016llX", mkey.c_str(), rec->version());
-
-
-        if( rec->version() == ver && rec->key() == key ){
-            // delete elem
-        }else{
-            if( keep < i ){
-                l.mutable_rec()->SwapElements(i, keep);
-            }
-            ++keep;
-        }
-    }
-    if( l.rec_size() == keep ) VERBOSE("not found! %s %016llX", key.c_str(), ver);
-
-    l.mutable_rec()->DeleteSubrange(keep, l.rec_size() - keep);
-
-    DEBUG("nr %d", l.rec_size());
-    // DEBUG("l=%d, %s", val.size(), l.ShortDebugString().c_str());
-
-    if( l.rec_size() ){
-        l.SerializeToString( val );
+    // XXX
+    if( count && merkle_level_version(MERKLE_HEIGHT, ver) != merkle_level_version(MERKLE_HEIGHT, l.version(0)) )
+        FATAL("merkle key misplaced node %s; ver %016llX", merkle_keystr(mkey).c_str(), l.version(0));
+
+    bool found;
+    int pos = l.find(key, ver, &found);
+    uchar delta[MERKLE_HASHLEN];
+    memset(delta, 0, MERKLE_HASHLEN);
+
+    if( found ){
+        if( _hashxor ) MerkleLeaf::rechash(_hashalg, key.data(), key.size(), ver, l.shard(pos), delta);
+        MerkleLeaf::remove(val, pos);
+        count --;
     }else{
-        val->clear();
+        VERBOSE("not found! %s %016llX", key.c_str(), ver);
+        // nothing changed, unless it needs cleaning
+        if( count || val->empty() ) return 0;
     }
 
+    if( !count ) val->clear();
+    DEBUG("nr %d", count);
+
 #ifdef LEAFCACHE
-    leafcache_set(ln, treeid, ver, l.rec_size() );
+    leafcache_set(ln, treeid, ver, count, delta );
 #else
-    if( ! val->empty() ){
-        _be->_put('m', mkey, *val);
-    }else{
-        _be->_del('m', mkey);
-    }
+    node_write(mkey, val, b);
     // queue higher nodes
-    q_leafnext( treeid, ver, l.rec_size(), val );
+    q_leafnext( treeid, ver, count, val, 0 );
 #endif
-
-
-    _nlock[ln].unlock();
+    return found;
 }
 
 
@@ -298,16 +394,13 @@ Merkle::exists(const string& key, int treeid, int shard, int64_t ver){
     int ln = merkle_lock_number(MERKLE_HEIGHT, treeid, ver);
 
     string *val;
-    ACPY2MerkleLeaf l;
-    int keep = 0;
 
-    DEBUG("leaf %016llX => %s", ver, mkey.c_str());
+    DEBUG("leaf %016llX => %s", ver, merkle_keystr(mkey).c_str());
 
-    // get leaf node, del, write
     _nlock[ln].lock();
 
 #ifdef LEAFCACHE
-    val = leafcache_get(ln, mkey);
+    val = leafcache_get(ln, mkey, 0);
 
 #else
     string sval;
@@ -316,25 +409,18 @@ Merkle::exists(const string& key, int treeid, int shard, int64_t ver){
     _be->_get('m', mkey, val);
 #endif
 
-    l.ParsePartialFromString(*val);
-
-    DEBUG("entries %d", l.rec_size());
-
-    bool exists = 0;
-    for(int i=0; i<l.rec_size(); i++){
-        ACPY2MerkleLeafRec *rec = l.mutable_rec(i);
+    MerkleLeaf l(val->data(), val->size());
+    DEBUG("entries %d", l.count());
 
-        if( (rec->version() == ver) && (rec->key() == key) ){
-            exists = 1;
-        }
-    }
+    bool exists;
+    l.find(key, ver, &exists);
 
     _nlock[ln].unlock();
 
     return exists;
 }
 
-// same as del, with checks + cleaning
+// rewrite the leaf, with checks + cleaning
 void
 Merkle::fix(int treeid, int64_t ver){
 
@@ -344,15 +430,13 @@ Merkle::fix(int treeid, int64_t ver){
     int ln = merkle_lock_number(MERKLE_HEIGHT, treeid, ver);
 
     string *val;
-    ACPY2MerkleLeaf l;
 
-    VERBOSE("leaf fix T%X %016llX => %s",treeid,  ver, mkey.c_str());
+    VERBOSE("leaf fix T%X %016llX => %s",treeid,  ver, merkle_keystr(mkey).c_str());
 
-    // get leaf node, del, write
     _nlock[ln].lock();
 
 # ifdef LEAFCACHE
-    val = leafcache_get(ln, mkey);
+    val = leafcache_get(ln, mkey, 0);
 
 # else
     string sval;
@@ -361,42 +445,27 @@ Merkle::fix(int treeid, int64_t ver){
     _be->_get('m', mkey, val);
 # endif
 
-    l.ParsePartialFromString(*val);
-    int oldsize = l.rec_size();
-
-    if( oldsize > 1 ){
-        // sort
-        google::protobuf::RepeatedPtrField<ACPY2MerkleLeafRec> *lc = l.mutable_rec();
-        std::sort( lc->begin(), lc->end(), leafrec_compare );
+    // rebuild it, dropping dupes + anything misplaced
+    MerkleLeaf l(val->data(), val->size());
+    int oldsize = l.count();
+    string nval;
 
-        // dupes?
-        int keep = 1;
-        for(int i=1; i<l.rec_size(); i++){
-            ACPY2MerkleLeafRec *prev = l.mutable_rec(i-1);
-            ACPY2MerkleLeafRec *rec  = l.mutable_rec(i);
+    for(int i=0; i<oldsize; i++){
+        if( merkle_level_version(MERKLE_HEIGHT, ver) != merkle_level_version(MERKLE_HEIGHT, l.version(i)) )
+            continue;
 
-            if( rec->version() == prev->version() && rec->key() == prev->key() ){
-                // delete elem
-            }else{
-                if( keep < i ){
-                    l.mutable_rec()->SwapElements(i, keep);
-                }
-                ++keep;
-            }
-        }
-        l.mutable_rec()->DeleteSubrange(keep, l.rec_size() - keep);
+        string k = l.keystr(i);
+        MerkleLeaf nl(nval.data(), nval.size());
+        bool found;
+        int pos = nl.find(k, l.version(i), &found);
+        if( !found ) MerkleLeaf::insert(&nval, pos, k, l.version(i), l.shard(i));
     }
 
-    int newsize = l.rec_size();
-
-    if( l.rec_size() ){
-        l.SerializeToString( val );
-    }else{
-        val->clear();
-    }
+    val->swap(nval);
+    int newsize = MerkleLeaf(val->data(), val->size()).count();
 
 # ifdef LEAFCACHE
-    leafcache_set(ln, treeid, ver, l.rec_size(), 1 );
+    leafcache_set(ln, treeid, ver, newsize, 0, 1 );
 # else
     if( ! val->empty() ){
         _be->_put('m', mkey, *val);
@@ -404,7 +473,7 @@ Merkle::fix(int treeid, int64_t ver){
         _be->_del('m', mkey);
     }
     // queue higher nodes
-    q_leafnext( treeid, ver, l.rec_size(), val, 1 );
+    q_leafnext( treeid, ver, newsize, val, 0, 1 );
 # endif
 
     _nlock[ln].unlock();
@@ -413,120 +482,212 @@ Merkle::fix(int treeid, int64_t ver){
 #endif /* MERKFIX */
 }
 
+// leaf lock is held
 string *
-Merkle::leafcache_get(int ln, const string& mkey){
+Merkle::leafcache_get(int ln, const string& mkey, DBBatch *b){
 
     MerkleLeafCache *c = & _cache[ln];
+    merkle_safe_to_stop = 0;
 
-    DEBUG("get lock %d %s [%s]", ln, mkey.c_str(), c->_mkey.c_str());
     // do we already have it?
-    if( c->_mkey == mkey )
-        return & c->_data;
+    std::map<string,MerkleLeafCache::Ent>::iterator it = c->_ents.find(mkey);
+    if( it != c->_ents.end() ){
+        DEBUG("get lock %d %s cached", ln, merkle_keystr(mkey).c_str());
+        c->_lru.splice( c->_lru.begin(), c->_lru, it->second._lru );
+        return & it->second._data;
+    }
 
-    // is there something else here? flush it
-    if( ! c->_mkey.empty() )
-        leafcache_flush(ln);
+    // make room
+    // with a batch, only clean leaves go. a dirty leaf may hold changes from
+    // the batch, which is not yet written (and may fail). it stays until flushed
+    std::list<string>::iterator li = c->_lru.end();
+    while( c->_size >= c->_max && li != c->_lru.begin() ){
+        -- li;
+        it = c->_ents.find( *li );
+        if( b && it->second._dirty ) continue;
+        leafcache_write(c, it->first, & it->second, 0);
+        c->_size -= it->second._size;
+        li = c->_lru.erase(li);
+        c->_ents.erase(it);
+    }
 
     // fetch
-    c->_mkey  = mkey;
-    c->_fixme = 0;
-    c->_dirty = 0;
-    c->_data.clear();
-    _be->_get('m', mkey, & c->_data);
-    DEBUG("get lock %d fetch %s", ln, mkey.c_str());
-
-    merkle_safe_to_stop = 0;
-    return & c->_data;
+    MerkleLeafCache::Ent *e = & c->_ents[mkey];
+    e->_treeid = 0;
+    e->_ver    = 0;
+    e->_count  = 0;
+    e->_fixme  = 0;
+    e->_dirty  = 0;
+    e->_hvalid = 0;
+    node_read(mkey, & e->_data, b);
+    DEBUG("get lock %d fetch %s", ln, merkle_keystr(mkey).c_str());
+
+    e->_size   = sizeof(*e) + mkey.size() + e->_data.size();
+    c->_size  += e->_size;
+    c->_lru.push_front(mkey);
+    e->_lru    = c->_lru.begin();
+
+    return & e->_data;
 }
 
+// delta is the xor of the hashes of the records added and removed. 0 => unknown
 void
-Merkle::leafcache_set(int ln, int treeid, int64_t ver, int count, bool fixme){
+Merkle::leafcache_set(int ln, int treeid, int64_t ver, int count, const uchar *delta, bool fixme){
 
     MerkleLeafCache *c = & _cache[ln];
+    string mkey;
+    merkle_key(MERKLE_HEIGHT, treeid, ver, &mkey);
 
     DEBUG("set lock %d c %d", ln, count);
-    c->_treeid = treeid;
-    c->_count  = count;
-    c->_ver    = ver;
-    c->_dirty  = 1;
-
-    if( fixme ) c->_fixme = 1;
 
+    std::map<string,MerkleLeafCache::Ent>::iterator it = c->_ents.find(mkey);
     // XXX
-    string mkey;
-    merkle_key(MERKLE_HEIGHT, treeid, ver, &mkey);
+    if( it == c->_ents.end() ){
+        FATAL("leaf cache botched; set key %s not cached", merkle_keystr(mkey).c_str());
+    }
 
-    if( mkey != c->_mkey ){
-        FATAL("leaf cache botched; ckey %s, set key %s", c->_mkey.c_str(), mkey.c_str());
+    MerkleLeafCache::Ent *e = & it->second;
+    if( !e->_dirty ) c->_ndirty ++;
+
+    e->_treeid = treeid;
+    e->_count  = count;
+    e->_ver    = ver;
+    e->_dirty  = 1;
+    if( fixme ) e->_fixme = 1;
+
+    if( !delta ){
+        e->_hvalid = 0;
+    }else if( e->_hvalid ){
+        for(int j=0; j<MERKLE_HASHLEN; j++) e->_hash[j] ^= delta[j];
     }
+
+    // the leaf may have grown or shrunk
+    int size   = sizeof(*e) + mkey.size() + e->_data.size();
+    c->_size  += size - e->_size;
+    e->_size   = size;
 }
 
+// write out a dirty leaf, and queue the higher nodes
 void
-Merkle::leafcache_flush(int ln){
+Merkle::leafcache_write(MerkleLeafCache *c, const string& mkey, MerkleLeafCache::Ent *e, DBBatch *b){
 
-    MerkleLeafCache *c = & _cache[ln];
+    if( !e->_dirty ) return;
 
-    if( c->_mkey.empty() ) return;
-    if( !c->_dirty )       return;
+    DEBUG("flush %s c %d sz %d", merkle_keystr(mkey).c_str(), e->_count, e->_data.size());
 
-    DEBUG("flush lock %d %s c %d sz %d", ln, c->_mkey.c_str(), c->_count, c->_data.size());
+    node_write(mkey, & e->_data, b);
+    leafcache_written(c, e);
+}
 
-    if( c->_data.empty() )
-        _be->_del('m', c->_mkey);
-    else
-        _be->_put('m', c->_mkey, c->_data);
+// the leaf is on disk. mark it clean, and queue the higher nodes
+void
+Merkle::leafcache_written(MerkleLeafCache *c, MerkleLeafCache::Ent *e){
 
-    // add leaf
-    q_leafnext( c->_treeid, c->_ver, c->_count, & c->_data, c->_fixme );
+    // the hash is kept up to date, once we have it
+    if( _hashxor && !e->_hvalid ){
+        MerkleLeaf(e->_data.data(), e->_data.size()).xhash( _hashalg, e->_hash );
+        e->_hvalid = 1;
+    }
 
+    q_leafnext( e->_treeid, e->_ver, e->_count, & e->_data, _hashxor ? e->_hash : 0, e->_fixme );
 
-    // XXX
-    string mkey;
-    merkle_key(MERKLE_HEIGHT, c->_treeid, c->_ver, &mkey);
+    e->_fixme = 0;
+    e->_dirty = 0;
+    c->_ndirty --;
+}
+
+// add all of the dirty leaves to the batch. they stay cached, and dirty
+// until the batch is committed
+void
+Merkle::leafcache_flush(int ln, DBBatch *b){
+
+    MerkleLeafCache *c = & _cache[ln];
 
-    if( mkey != c->_mkey ){
-        FATAL("leaf cache flush botched; ckey %s, set key %s", c->_mkey.c_str(), mkey.c_str());
+    if( !c->_ndirty ) return;
+
+    DEBUG("flush lock %d, %d dirty", ln, c->_ndirty);
+
+    for(std::map<string,MerkleLeafCache::Ent>::iterator it=c->_ents.begin(); it != c->_ents.end(); it++){
+        if( it->second._dirty ) node_write(it->first, & it->second._data, b);
     }
+}
+
+// the batch was committed. the dirty leaves are now clean
+void
+Merkle::leafcache_flushed(int ln){
+
+    MerkleLeafCache *c = & _cache[ln];
+
+    if( !c->_ndirty ) return;
 
-    c->_fixme = 0;
-    c->_dirty = 0;
-    c->_data.clear();
-    c->_mkey.clear();
+    for(std::map<string,MerkleLeafCache::Ent>::iterator it=c->_ents.begin(); it != c->_ents.end(); it++){
+        if( it->second._dirty ) leafcache_written(c, & it->second);
+    }
 }
 
-bool
-Merkle::leafcache_maybe_flush(int ln){
-    // if we can get the lock, flush it
-#if 0
-    if( runmode.is_stopping() )
-        _nlock[ln].lock();
-    else
-        if( _nlock[ln].trylock() ) return 0;
+// flush a group of leaf cache shards with one write
+// the locks are held until the write is done, so nothing
+// can read a leaf from disk that has not yet been written
+void
+Merkle::leafcache_flush_group(int lo, int hi){
 
-#else
-    _nlock[ln].lock();
-#endif
+    if( hi > MERKLE_NLOCK ) hi = MERKLE_NLOCK;
 
-    leafcache_flush(ln);
-    _nlock[ln].unlock();
-    return 1;
+    DBBatch *b = _be->_batch_begin();
+
+    for(int i=lo; i<hi; i++){
+        _nlock[i].lock();
+        leafcache_flush(i, b);
+    }
+
+    if( _be->_batch_commit(b) ){
+        for(int i=lo; i<hi; i++)
+            leafcache_flushed(i);
+    }else{
+        // leave them dirty, and try again next time
+        PROBLEM("merkle leaf flush failed");
+    }
+
+    for(int i=hi-1; i>=lo; i--){
+        _nlock[i].unlock();
+    }
+}
+
+// drop everything, without writing it
+void
+Merkle::leafcache_clear(void){
+
+    for(int i=0; i<MERKLE_NLOCK; i++){
+        MerkleLeafCache *c = & _cache[i];
+
+        _nlock[i].lock();
+        c->_ents.clear();
+        c->_lru.clear();
+        c->_size   = 0;
+        c->_ndirty = 0;
+        _nlock[i].unlock();
+    }
 }
 
 
 void
-Merkle::q_leafnext(int treeid, uint64_t ver, int keycount, const string *rec, bool fix){
+Merkle::q_leafnext(int treeid, uint64_t ver, int keycount, const string *rec, const uchar *hash, bool fix){
 
     merkle_safe_to_stop = 0;
 
-    MerkleChange * no = new MerkleChange;
+    MerkleChange * no = _mpool.get();
 
     if( !keycount && rec->size() || keycount && !rec->size() )
         PROBLEM("leafnext confusion count %d, size %d", keycount, rec->size());
 
-    if( rec->size() )
-        md5_bin( (uchar*) rec->data(), rec->size(), (char*) no->_hash, MERKLE_HASHLEN );
-    else
+    if( !rec->size() )
         memset(no->_hash, 0, MERKLE_HASHLEN);
+    else if( hash )
+        memcpy(no->_hash, hash, MERKLE_HASHLEN);
+    else if( _hashxor )
+        MerkleLeaf(rec->data(), rec->size()).xhash( _hashalg, no->_hash );
+    else
+        MerkleLeaf(rec->data(), rec->size()).hash( _hashalg, no->_hash );
 
     no->_level    = MERKLE_HEIGHT;
     no->_ver	  = merkle_level_version(MERKLE_HEIGHT, ver);
@@ -539,11 +700,13 @@ Merkle::q_leafnext(int treeid, uint64_t ver, int keycount, const string *rec, bo
     hex_encode( no->_hash, MERKLE_HASHLEN, buf, sizeof(buf));
     DEBUG("qln %d_%012llX %d, %d [%s]", no->_level, no->_ver, keycount, rec->size(), buf);
 
+    q_change(no);
+}
 
-    _lock.lock();
-    _mnm->push_back(no);
-    _lock.unlock();
-
+// queue a change for the flush thread. no locks
+void
+Merkle::q_change(MerkleChange *no){
+    _mnm.push(no);
 }
 
 static bool
@@ -552,47 +715,62 @@ sort_node_compare(const MerkleNode &a, const MerkleNode &b){
     return 0;
 }
 
-#ifdef MERKFIX
+// older nodes have no bitmap, so are a multiple of the entry size
+#define NODE_OLDFMT(v)	((v).size() % sizeof(MerkleNode) == 0)
+
+static inline int
+node_bitmap(const string& val){
+    uint16_t bm;
+
+    if( val.size() < sizeof(bm) ) return 0;
+    memcpy(&bm, val.data() + val.size() - sizeof(bm), sizeof(bm));
+    return bm;
+}
+
+static inline void
+node_set_bitmap(string *val, uint16_t bm){
+    memcpy(&(*val)[ val->size() - sizeof(bm) ], &bm, sizeof(bm));
+}
+
+// position of the entry for slot (if present)
+static inline int
+node_index(int bm, int slot){
+    return __builtin_popcount( bm & ((1 << slot) - 1) );
+}
+
+// convert an older node: sort, drop dupes + empties, add the bitmap
 static bool
-clean_fix_merkle_node(string *val){
+node_convert(string *val){
+
+    if( val->empty() || !NODE_OLDFMT(*val) ) return 0;
 
     MerkleNode *mn = (MerkleNode*) val->data();
     int nn = val->size() / sizeof(MerkleNode);
+    int keep = 0;
+    uint16_t bm = 0;
 
-    bool changed  = 0;
-    bool unsorted = 0;
-    int i, j;
-
-    for(i=0; i<nn; i++){
-        if( !mn[i].children || !mn[i].keycount ){
-            // remove empty
-            memmove( mn+i, mn+i+1, sizeof(MerkleNode) );
-            val->resize( (nn-1) * sizeof(MerkleNode) );
-            nn --;
-            i --;
-            changed = 1;
-            continue;
-        }
+    std::stable_sort( mn, mn + nn, sort_node_compare );
 
-        for(j=i+1; j<nn; j++){
-            if( mn[i].slot > mn[j].slot ) unsorted = 1;
-            if( mn[i].slot == mn[j].slot ){
-                // remove dupe
-                memmove( mn+j, mn+j+1, sizeof(MerkleNode) );
-                val->resize( (nn-1) * sizeof(MerkleNode) );
-                nn --;
-                changed = 1;
-            }
-        }
+    for(int i=0; i<nn; i++){
+        if( !mn[i].children || !mn[i].keycount ) continue;
+        if( bm & (1 << mn[i].slot) )             continue;
+
+        bm |= 1 << mn[i].slot;
+        if( keep != i ) mn[keep] = mn[i];
+        keep ++;
     }
-    if( unsorted ){
-        std::sort( mn, mn + nn, sort_node_compare );
-        changed = 1;
+
+    val->resize( keep * sizeof(MerkleNode) );
+    if( keep ){
+        val->append( sizeof(bm), 0 );
+        node_set_bitmap( val, bm );
     }
 
-    return changed;
+    DEBUG("converted node %d -> %d", nn, keep);
+    return 1;
 }
 
+#ifdef MERKFIX
 static int
 fix_which_slot(string *val){
     MerkleNode *mn = (MerkleNode*) val->data();
@@ -620,8 +798,9 @@ Merkle::clear_node(int treeid, int level, int64_t ver){
     string mkey;
     merkle_key(level, treeid, ver, &mkey);
     _be->_del('m', mkey);
+    if( level <= MERKLE_CACHELEVEL ) _ncache.update(mkey, "");
 
-    MerkleChange * no = new MerkleChange;
+    MerkleChange * no = _mpool.get();
     memset(no->_hash, 0, MERKLE_HASHLEN);
 
     no->_level    = level;
@@ -631,9 +810,7 @@ Merkle::clear_node(int treeid, int level, int64_t ver){
     no->_keycount = 0;
     no->_fixme    = 1;
 
-    _lock.lock();
-    _mnm->push_back(no);
-    _lock.unlock();
+    q_change(no);
 }
 
 // returns locknumber
@@ -645,7 +822,7 @@ Merkle::get_node_and_lock(int treeid, int level, int64_t ver, string *val){
     int ln = merkle_lock_number(level, treeid, ver);
 
     _nlock[ln].lock();
-    _be->_get('m', mkey, val);
+    node_get(level, mkey, val);
 
     return ln;
 }
@@ -729,76 +906,50 @@ Merkle::fix(int treeid, int level, int64_t ver){
 static bool
 update_node(MerkleChange *no, string *val){
 
-    bool changed = 0;
+    bool changed = node_convert( val );
 
     // which slot?
     int slot = merkle_slot(no->_level, no->_ver);
-
-    MerkleNode *mn = (MerkleNode*) val->data();
-    int nn = val->size() / sizeof(MerkleNode);
-    int i=0, j;
+    int bm   = node_bitmap( *val );
+    int nn   = val->size() / sizeof(MerkleNode);
+    int i    = node_index(bm, slot);
+    bool found = bm & (1 << slot);
 
     DEBUG(" val sz %d %d", val->size(), nn);
 
-    if( nn > 16 ) no->_fixme = 1;
-
-    if( !no->_fixme ){
-        // search
-        for(i=0; i<nn; i++){
-            if( mn[i].slot == slot ) break;
-        }
-
-        // quick check for dupe
-        for(j=i+1; j<nn; j++){
-            if( mn[j].slot == slot ) no->_fixme = 1;
-        }
-    }
-
-    if( no->_fixme ){
-#ifdef MERKFIX
-        // check for dupes, unsorted
-        changed = clean_fix_merkle_node( val );
-#endif
-        nn = val->size() / sizeof(MerkleNode);
-
-        // re-search
-        for(i=0; i<nn; i++){
-            if( mn[i].slot == slot ) break;
-        }
-    }
-
-
     if( no->_children ){
-        bool resort = 0;
-        // not found? append
-        if( i == nn ){
-            val->resize( (i+1) * sizeof(MerkleNode) );
-            mn = (MerkleNode*) val->data();
+        if( !found ){
+            // insert
+            if( val->empty() ) val->assign( sizeof(uint16_t), 0 );
+            val->insert( i * sizeof(MerkleNode), sizeof(MerkleNode), 0 );
+            bm |= 1 << slot;
+            node_set_bitmap( val, bm );
             nn ++;
             changed = 1;
-            resort  = 1;
             DEBUG(" add: sz %d %d", val->size(), nn);
-        }else{
-            if( memcmp(no->_hash, mn[i].hash, MERKLE_HASHLEN) ) changed = 1;
-            if( no->_keycount != mn[i].keycount ) changed = 1;
-            if( no->_children != mn[i].children ) changed = 1;
         }
 
-        // update
-        mn[i].slot     = slot;
-        mn[i].children = no->_children;
-        mn[i].keycount = no->_keycount;
-        memcpy(mn[i].hash, no->_hash, MERKLE_HASHLEN);
+        MerkleNode *mn = (MerkleNode*) val->data() + i;
 
-        if( resort )
-            std::sort( mn, mn + nn, sort_node_compare );
+        if( memcmp(no->_hash, mn->hash, MERKLE_HASHLEN) ) changed = 1;
+        if( no->_keycount != mn->keycount ) changed = 1;
+        if( no->_children != mn->children ) changed = 1;
+
+        // update
+        mn->slot     = slot;
+        mn->children = no->_children;
+        mn->keycount = no->_keycount;
+        memcpy(mn->hash, no->_hash, MERKLE_HASHLEN);
 
     }else{
         // remove empty entry
-        if( i != nn ){
-            if( i != nn - 1 )
-                memmove( mn+i, mn+i+1, (nn-1) * sizeof(MerkleNode) );
-            val->resize( (nn-1) * sizeof(MerkleNode) );
+        if( found ){
+            val->erase( i * sizeof(MerkleNode), sizeof(MerkleNode) );
+            bm &= ~(1 << slot);
+            if( bm )
+                node_set_bitmap( val, bm );
+            else
+                val->clear();
             changed = 1;
             nn -= 1;
             DEBUG(" del: val sz %d %d", val->size(), nn);
@@ -848,7 +999,7 @@ aggr_nodes(int level, int treeid, uint64_t ver, const string *val, MerkleChange
 // add result back to list
 // list should already be properly sorted
 bool
-Merkle::apply_updates(MerkleChangeQ *l){
+Merkle::apply_updates(MerkleChangeQ *l, DBBatch *b, MerkleNodePend *pend){
 
     if( l->empty() ) return 0;
     MerkleChange *no = l->front();
@@ -856,19 +1007,19 @@ Merkle::apply_updates(MerkleChangeQ *l){
 
     int level = no->_level - 1;
     if( level < MERKLE_HEIGHT - MERKLE_BUILD ){
-        delete no;
+        _mpool.put(no);
         return 0;
     }
 
     string mkey;
     merkle_key(level, no->_treeid, no->_ver, &mkey);
     int ln = merkle_lock_number(level, no->_treeid, no->_ver);
-    DEBUG("node %s", mkey.c_str());
+    DEBUG("node %s", merkle_keystr(mkey).c_str());
 
     string val;
     // get
     _nlock[ln].lock();
-    _be->_get('m', mkey, &val);
+    if( !b->get('m', mkey, &val) ) node_get(level, mkey, &val);
     bool changed = update_node(no, &val);
     bool fixme   = no->_fixme;
 
@@ -889,29 +1040,27 @@ Merkle::apply_updates(MerkleChangeQ *l){
         // update
         string mk;
         merkle_key(level, nx->_treeid, nx->_ver, &mk);
-        DEBUG("+node %s", mk.c_str());
-        if( mk != mkey ) FATAL("apply_updates botch %s != %s", mkey.c_str(), mk.c_str());
+        DEBUG("+node %s", merkle_keystr(mk).c_str());
+        if( mk != mkey ) FATAL("apply_updates botch %s != %s", merkle_keystr(mkey).c_str(), merkle_keystr(mk).c_str());
 
         bool c = update_node(nx, &val);
         if(c) changed = 1;
         if( nx->_fixme ) fixme = 1;
-        delete nx;
+        _mpool.put(nx);
     }
 
     if( changed ){
-        DEBUG("node %s changed sz %d", mkey.c_str(), val.size());
+        DEBUG("node %s changed sz %d", merkle_keystr(mkey).c_str(), val.size());
         // insert
-        if( val.empty() )
-            _be->_del('m', mkey);
-        else
-            _be->_put('m', mkey, val);
+        node_write(mkey, &val, b);
+        if( level <= MERKLE_CACHELEVEL ) pend->push_back( std::make_pair(mkey, val) );
     }
 
     if( ! _nlock[ln].trylock() ) FATAL("lock %d not locked", ln);
     _nlock[ln].unlock();
 
     if( !changed && !fixme ){
-        delete no;
+        _mpool.put(no);
         return 0;
     }
 
@@ -936,94 +1085,171 @@ sort_compare_note(const MerkleChange *a, const MerkleChange *b){
 void
 Merkle::flush(void){
 
+    // the flush thread, and upgrades, both flush. one at a time
+    _flock.lock();
+    _flush();
+    _flock.unlock();
+}
+
+void
+Merkle::_flush(void){
+
     // flush leaf cache
     bool leavesflushed = 1;
 
 #ifdef LEAFCACHE
-    for(int i=0; i<MERKLE_NLOCK; i++){
-        bool r = leafcache_maybe_flush(i);
-        if( !r ) leavesflushed = 0;
+    for(int i=0; i<MERKLE_NLOCK; i+=LEAFFLUSHGROUP){
+        leafcache_flush_group(i, i + LEAFFLUSHGROUP);
     }
 #endif
 
-    _lock.lock();
-    MerkleChangeQ *mnm = _mnm;
-    if( mnm->empty() ){
+    MerkleChange *l = _mnm.take();
+    if( !l ){
         if( leavesflushed ) merkle_safe_to_stop = 1;
-        _lock.unlock();
         return;
     }
-    // swap, so other threads don't block
-    _mnm = new MerkleChangeQ;
-    _lock.unlock();
+
+    // sort out by tree
+    MerkleChangeQMap *mnm = new MerkleChangeQMap;
+    while( l ){
+        MerkleChange *n = l->_qnext;
+        MerkleChangeQ *&q = (*mnm)[ l->_treeid ];
+        if( !q ) q = new MerkleChangeQ;
+        q->push_back(l);
+        l = n;
+    }
+
+    DEBUG("flushing %d trees", mnm->size());
+
+    if( _nworker <= 1 ){
+        for(MerkleChangeQMap::iterator it=mnm->begin(); it != mnm->end(); it++){
+            flush_tree( it->second );
+        }
+        delete mnm;
+        return;
+    }
+
+    // hand the trees to the workers, and wait for them
+    _wlock.lock();
+    for(MerkleChangeQMap::iterator it=mnm->begin(); it != mnm->end(); it++){
+        _work.push_back( it->second );
+    }
+    _wcond.broadcast();
+
+    while( !_work.empty() || _wbusy ){
+        _wdone.wait( &_wlock );
+    }
+    _wlock.unlock();
+
+    delete mnm;
+}
+
+void
+Merkle::flush_worker(void){
+
+    _wlock.lock();
+    while(1){
+        if( _work.empty() ){
+            _wcond.wait( &_wlock );
+            continue;
+        }
+
+        MerkleChangeQ *q = _work.front();
+        _work.pop_front();
+        _wbusy ++;
+        _wlock.unlock();
+
+        flush_tree(q);
+
+        _wlock.lock();
+        _wbusy --;
+        if( _work.empty() && !_wbusy ) _wdone.broadcast();
+    }
+}
+
+// apply the changes for one tree, bottom up
+void
+Merkle::flush_tree(MerkleChangeQ *mnm){
+    MerkleNodePend pend;
 
     // sort + process
     std::stable_sort( mnm->begin(), mnm->end(), sort_compare_note );
 
+    // each tree is flushed by one worker at a time, the only writer
+    // of its upper nodes, so we can hold the writes and send them down together
+    DBBatch *b = _be->_batch_begin();
+
     while( !mnm->empty() ){
-        apply_updates( mnm );
+        apply_updates( mnm, b, &pend );
+
+        if( b->count >= MAXFLUSHBATCH ){
+            node_commit(b, &pend);
+            b = _be->_batch_begin();
+        }
     }
 
-    delete mnm;
+    node_commit(b, &pend);
 
+    delete mnm;
 }
 
 //################################################################
 
 int
 Merkle::get_leaf(const string& map, int level, int treeid, int64_t ver, const string& val, ACPY2CheckReply *res){
-    ACPY2MerkleLeaf l;
-    l.ParsePartialFromString(val);
+    MerkleLeaf l(val.data(), val.size());
 
     // copy records from leaf-node into result
-    for(int i=0; i<l.rec_size(); i++){
-        ACPY2MerkleLeafRec *rec = l.mutable_rec(i);
+    for(int i=0; i<l.count(); i++){
+        string  key   = l.keystr(i);
+        int64_t kver  = l.version(i);
+        int     shard = l.shard(i);
 
         // validate
-        int64_t havever = _be->have_ver( rec->key() );
-        if( havever != rec->version() ){
-            VERBOSE("dead leaf %016llX %s", rec->version(), rec->key().c_str());
-            del( rec->key(), treeid, rec->shard(), rec->version() );
+        int64_t havever = _be->have_ver( key );
+        if( havever != kver ){
+            VERBOSE("dead leaf %016llX %s", kver, key.c_str());
+            del( key, treeid, shard, kver );
             continue;
         }
 
         ACPY2CheckValue    *rv  = res->add_check();
 
         rv->set_treeid( treeid );
-        rv->set_shard( rec->shard() );
+        rv->set_shard( shard );
         rv->set_level( MERKLE_HEIGHT + 1 );
-        rv->set_version( rec->version() );
+        rv->set_version( kver );
         rv->set_map( map );
         rv->set_keycount( 1 );
-        rv->set_key( rec->key() );
+        rv->set_key( key );
         rv->set_isvalid( 1 );		// leaf-nodes are always good
 
-        DEBUG(" +L %02X_%016llX", level, rec->version() );
+        DEBUG(" +L %02X_%016llX", level, kver );
     }
 
-    return l.rec_size();
+    return l.count();
 }
 
 int
 Merkle::get_upper(const string& map, int level, int treeid, int64_t ver, const string& val, ACPY2CheckReply *res, bool stable){
-    MerkleNode *mn = (MerkleNode*) val.data();
-    int nn = val.size() / sizeof(MerkleNode);
+    const string *v = &val;
+    string cv;
+
+    if( NODE_OLDFMT(val) ){
+        cv = val;
+        node_convert( &cv );
+        v  = &cv;
+    }
+
+    MerkleNode *mn = (MerkleNode*) v->data();
+    int nn = v->size() / sizeof(MerkleNode);
 
     uint64_t mask = F16 << ((MERKLE_HEIGHT - level + 4) << 2);
     uint64_t nver = ver & mask;
     int slshift = (MERKLE_HEIGHT - level + 3) << 2;
-    int checkmask = 0;
 
+    // entries are unique + in slot order
     for(int i=0; i<nn; i++){
-        // check for corruption
-        if( checkmask & (1 << mn[i].slot) ){
-            // uh oh
-            VERBOSE("dupe entry! %d %02X_%016llX", mn[i].slot, level+1, ver);
-            fix(treeid,level,ver);
-            continue;
-        }
-        checkmask |= (1 << mn[i].slot);
-
         ACPY2CheckValue *rv  = res->add_check();
         rv->set_treeid( treeid );
         rv->set_level( level + 1 );
@@ -1047,10 +1273,11 @@ Merkle::get(int level, int treeid, int64_t ver, ACPY2CheckReply *res){
     treeid &= 0xFFFF;
     string mkey;
     merkle_key(level, treeid, ver, &mkey);
+    res->set_hashalg( hash_scheme() );
 
     string val;
-    _be->_get('m', mkey, &val);
-    DEBUG("mget %s [%d]", mkey.c_str(), val.size());
+    node_get(level, mkey, &val);
+    DEBUG("mget %s [%d]", merkle_keystr(mkey).c_str(), val.size());
     if( val.empty() ) return 0;
 
     if( level == MERKLE_HEIGHT ){
@@ -1062,6 +1289,132 @@ Merkle::get(int level, int treeid, int64_t ver, ACPY2CheckReply *res){
 
 //################################################################
 
+// bulk diff. see also: ae_check
+
+typedef std::map<string, const ACPY2DiffNode*> MerkleDiffMap;	// by node key
+
+static bool
+diff_same(const ACPY2DiffNode *n, const ACPY2CheckValue *c){
+
+    if( n->keycount() != c->keycount() ) return 0;
+    if( n->children() != c->children() ) return 0;
+    return n->hash() == c->hash();
+}
+
+// room left in the reply
+struct MerkleDiffBudget {
+    int		nleft;
+    int		bytes;
+};
+
+// the node differs. compare its children with theirs
+// send keys from the leaves that differ, and the nodes below depth (they compare those)
+// once the reply is full, differing nodes are sent as is, and the peer checks them later
+static void
+diff_walk(Merkle *mk, int level, int treeid, int64_t ver, int depth, const MerkleDiffMap *theirs, MerkleDiffBudget *bud, ACPY2CheckReply *res){
+    ACPY2CheckReply kids;
+
+    mk->get(level, treeid, ver, &kids);
+
+    for(int i=0; i<kids.check_size(); i++){
+        ACPY2CheckValue *c = kids.mutable_check(i);
+        int cl = c->level();
+
+        if( cl <= MERKLE_HEIGHT ){
+            if( !c->isvalid() ) continue;
+
+            if( cl <= depth ){
+                string mkey;
+                merkle_key(cl, treeid, c->version(), &mkey);
+                MerkleDiffMap::const_iterator it = theirs->find(mkey);
+                if( it != theirs->end() && diff_same(it->second, c) ) continue;
+
+                // a leaf expands to all of its keys
+                int need = (cl == MERKLE_HEIGHT) ? c->keycount() : 1;
+                if( need < bud->nleft && bud->bytes > 0 ){
+                    diff_walk(mk, cl, treeid, c->version(), depth, theirs, bud, res);
+                    continue;
+                }
+            }
+        }
+
+        // keys of a leaf are all sent, the parent checked that they fit
+        bud->nleft --;
+        bud->bytes -= c->ByteSize();
+        res->add_check()->Swap(c);
+    }
+}
+
+// the peer sent us its nodes under a subtree
+int
+Merkle::diff(ACPY2DiffRequest *req, ACPY2CheckReply *res){
+    MerkleDiffMap theirs;
+    MerkleDiffBudget bud;
+    int treeid = req->treeid() & 0xFFFF;
+    int depth  = req->depth();
+    int max    = req->maxresult();
+
+    res->set_hashalg( hash_scheme() );
+    if( req->level() < 0 || req->level() > MERKLE_HEIGHT ) return 0;
+
+    if( depth > MERKLE_HEIGHT ) depth = MERKLE_HEIGHT;
+    if( max <= 0 ) max = MERKLE_DIFFNODES;
+    if( max > MERKLE_DIFFMAX ) max = MERKLE_DIFFMAX;
+
+    for(int i=0; i<req->node_size(); i++){
+        const ACPY2DiffNode *n = & req->node(i);
+        string mkey;
+        merkle_key(n->level(), treeid, n->version(), &mkey);
+        theirs[mkey] = n;
+    }
+
+    bud.nleft = max;
+    bud.bytes = MERKLE_DIFFBYTES;
+    diff_walk(this, req->level(), treeid, req->version(), depth, &theirs, &bud, res);
+
+    DEBUG("diff %02X_%016llX depth %d, %d nodes => %d", req->level(), req->version(), depth, req->node_size(), res->check_size());
+    return res->check_size();
+}
+
+// our nodes under a subtree, as many levels as will fit
+void
+Merkle::diff_request(int level, int treeid, int64_t ver, ACPY2DiffRequest *req){
+    ACPY2CheckReply cur, next;
+    int depth = level;
+
+    get(level, treeid, ver, &cur);
+
+    while( depth < MERKLE_HEIGHT ){
+        if( !cur.check_size() ){
+            // nothing below here. they can compare all the way down
+            depth = MERKLE_HEIGHT;
+            break;
+        }
+        if( req->node_size() + cur.check_size() > MERKLE_DIFFNODES ) break;
+
+        next.Clear();
+        for(int i=0; i<cur.check_size(); i++){
+            const ACPY2CheckValue *c = & cur.check(i);
+            ACPY2DiffNode *n = req->add_node();
+
+            n->set_level(    c->level() );
+            n->set_version(  c->version() );
+            n->set_hash(     c->hash() );
+            n->set_keycount( c->keycount() );
+            n->set_children( c->children() );
+
+            if( c->level() < MERKLE_HEIGHT ) get(c->level(), treeid, c->version(), &next);
+        }
+
+        depth ++;
+        cur.Swap(&next);
+    }
+
+    req->set_depth( depth );
+}
+
+//################################################################
+
 
 bool
 Merkle::compare_result(MerkleCache *cache, ACPY2CheckValue *r){
@@ -1077,7 +1430,7 @@ Merkle::compare_result(MerkleCache *cache, ACPY2CheckValue *r){
         string mkey;
         merkle_key(level, r->treeid(), r->version(), &mkey);
         // fetch
-        _be->_get('m', mkey, &cache->data);
+        node_get(level, mkey, &cache->data);
         cache->level  = level;
         cache->treeid = r->treeid();
         cache->ver    = nlv;
@@ -1085,29 +1438,24 @@ Merkle::compare_result(MerkleCache *cache, ACPY2CheckValue *r){
 
     int slot = merkle_slot(r->level(), r->version());
 
-    MerkleNode *mn = (MerkleNode*) cache->data.data();
-    int nn = cache->data.size() / sizeof(MerkleNode);
+    node_convert( &cache->data );
+    int bm = node_bitmap( cache->data );
 
-    // find requested slot + compare
-    for(int i=0; i<nn; i++){
-        if( slot == mn[i].slot ){
-            const unsigned char *rh = (unsigned char *)r->hash().data();
-            int res = memcmp(rh, mn[i].hash, MERKLE_HASHLEN);
-            if( mn[i].keycount != r->keycount() ) res = 1;
-            if( mn[i].children != r->children() ) res = 1;
-
-            //DEBUG("hash %02X/%04X/%012llX %02X%02X %s %02X%02X",
-            //      level, r->treeid(), r->version(),
-            //      mn[i].hash[0], mn[i].hash[1],
-            //      (res? "!=" : "=="),
-            //      rh[0], rh[1]);
-            return !res;
-        }
+    if( !(bm & (1 << slot)) ){
+        // slot not found
+        // DEBUG("slot %d not found", slot);
+        return 0;
     }
 
-    // slot not found
-    // DEBUG("slot %d not found", slot);
-    return 0;
+    // find requested slot + compare
+    MerkleNode *mn = (MerkleNode*) cache->data.data() + node_index(bm, slot);
+
+    const unsigned char *rh = (unsigned char *)r->hash().data();
+    int res = memcmp(rh, mn->hash, MERKLE_HASHLEN);
+    if( mn->keycount != r->keycount() ) res = 1;
+    if( mn->children != r->children() ) res = 1;
+
+    return !res;
 }
 
 //################################################################
@@ -1120,12 +1468,12 @@ public:
     uint64_t	count;
 public:
     MerkDeleteLR(Database *b, Ring *r, Merkle *m) { be = b; ring = r; merk = m; count = 0; }
-    virtual bool call(const string &, const string &);
+    virtual bool call(const DBSlice&, const DBSlice&);
 };
 
 bool
-MerkDeleteLR::call(const string &key, const string &val) {
-    be->_del('m', key);
+MerkDeleteLR::call(const DBSlice& key, const DBSlice& val) {
+    be->_del('m', key.str());
     count ++;
     return 1;
 }
@@ -1140,19 +1488,21 @@ public:
     uint64_t	count;
 public:
     MerkUpgradeLR(Database *b, Ring *r, Merkle *m) { be = b; ring = r; merk = m; count = 0; }
-    virtual bool call(const string&, const string&);
+    virtual bool call(const DBSlice&, const DBSlice&);
 };
 
 bool
-MerkUpgradeLR::call(const string& key, const string& val){
+MerkUpgradeLR::call(const DBSlice& key, const DBSlice& val){
     // val is DBRecord
-    DBRecord *dr = (DBRecord*) val.data();
+    if( val.size < (int)sizeof(DBRecord) ) return 1;
+    const DBRecord *dr = (const DBRecord*) val.data;
 
     int part   = ring->partno( dr->shard );
     int treeid = ring->treeid(part);
 
-    merk->add( key, treeid, dr->shard, dr->ver );
-    DEBUG("add key %s", key.c_str());
+    string k = key.str();
+    merk->add( k, treeid, dr->shard, dr->ver );
+    DEBUG("add key %s", k.c_str());
     count ++;
 
     if( count % 10000 == 0 ){
@@ -1163,32 +1513,187 @@ MerkUpgradeLR::call(const string& key, const string& val){
     return 1;
 }
 
-// XXX - does not work? range seems to lose things
+class MerkFirstLR : public LambdaRange {
+public:
+    bool	found;
+
+    MerkFirstLR() { found = 0; }
+    virtual bool call(const DBSlice& key, const DBSlice& val) {
+        if( key.str() == MERKLE_FORMATKEY ) return 1;
+        found = 1;
+        return 0;
+    }
+};
+
+// delete the tree, and rebuild it from the data
+// only done offline (startup, upgrade), so go as fast as we can
 void
-Merkle::upgrade(void){
+Merkle::rebuild(void){
     string start, end = "\xFF\xFF";
 
-    VERBOSE("upgrading merkle tree");
-
     // delete current merkle tree
     MerkDeleteLR delf(_be, _be->_ring, _be->_merk);
-    _be->_range('m', start, end, &delf);
+    _be->_range('m', start, end, &delf, RANGE_MAINT | RANGE_UNPACED);
+    _ncache.clear();
+    leafcache_clear();
     VERBOSE("removed %lld nodes", delf.count);
 
     // fetch all keys and rebuild
     VERBOSE("rebuilding merkle tree");
     MerkUpgradeLR upgf(_be, _be->_ring, _be->_merk);
-    _be->_range('d', start, end, &upgf);
-    runmode.shutdown();
-    _be->_merk->flush();
+    _be->_range('d', start, end, &upgf, RANGE_MAINT | RANGE_UNPACED);
     VERBOSE("added %lld keys", upgf.count);
+}
+
+// XXX - does not work? range seems to lose things
+void
+Merkle::upgrade(void){
+
+    VERBOSE("upgrading merkle tree");
+    rebuild();
+    runmode.shutdown();
+    flush();
+    string fmt;
+    format(&fmt);
+    _be->_put('m', MERKLE_FORMATKEY, fmt);
     VERBOSE("upgrade complete");
 }
 
+// the format marker. the hash is included, unless md5 over the whole leaf
+void
+Merkle::format(string *fmt){
+
+    fmt->assign( MERKLE_FORMAT );
+    if( _hashalg != HASH_MD5 ){
+        fmt->append( "/" );
+        fmt->append( hash_name(_hashalg) );
+    }
+    if( _hashxor ) fmt->append( "/xor" );
+}
+
+// older versions used text keys, and protobuf leaves. convert the tree, once.
+// the tree is also rebuilt if the hash was changed
+void
+Merkle::check_format(void){
+    string fmt, want;
+
+    format(&want);
+    _be->_get('m', MERKLE_FORMATKEY, &fmt);
+    if( fmt == want ) return;
+
+    // any older tree (text keys, protobuf leaves, other hash) is rebuilt
+    MerkFirstLR ff;
+    _be->_range('m', "", "\xFF\xFF", &ff);
+
+    if( ff.found ){
+        VERBOSE("converting merkle tree to format %s", want.c_str());
+        rebuild();
+        flush();
+        VERBOSE("merkle tree converted");
+    }
+
+    _be->_put('m', MERKLE_FORMATKEY, want);
+}
+
 
 //################################################################
 
 #define MAXITER 10240
+#define REPART_TIMEOUT	15	// secs, bulk handoff to the new servers
+#define REPART_EXPIRE	10	// secs, the old way
+
+// hand moved keys to their new home, streamed down one connection
+// we delete our copy once they say they have it
+class RepartPut : public BulkXfer {
+    Database		*_be;
+    int			_treeid;
+    ACPY2PutSet		*_cur;
+    int			_cursize;
+    ACPY2PutSetReply	_reply;
+    int			*_kept;
+
+    virtual void on_reply(google::protobuf::Message *, google::protobuf::Message *);
+public:
+    RepartPut(Database *, int, const NetAddr *, int *);
+    virtual ~RepartPut();
+    void add(ACPY2DistRequest *);
+    void flush(void);
+};
+
+RepartPut::RepartPut(Database *b, int treeid, const NetAddr *a, int *kept)
+    : BulkXfer(a, PHMT_Y2_PUTSET, REPART_TIMEOUT) {
+
+    _be      = b;
+    _treeid  = treeid;
+    _cur     = 0;
+    _cursize = 0;
+    _res     = &_reply;
+    _kept    = kept;
+}
+
+RepartPut::~RepartPut(){
+    flush();
+}
+
+void
+RepartPut::add(ACPY2DistRequest *put){
+
+    if( !_cur ){
+        _cur = new ACPY2PutSet;
+        _cur->set_traffic( THROT_MAINTENANCE );
+    }
+
+    ACPY2DistRequest *d = _cur->add_data();
+    d->Swap(put);
+    _cursize += d->data().key().size() + d->data().value().size() + 64;
+
+    if( _cur->data_size() >= BULK_CHUNKRECS || _cursize >= BULK_CHUNKSIZE ){
+        send(_cur);
+        _cur     = 0;
+        _cursize = 0;
+    }
+}
+
+void
+RepartPut::flush(void){
+
+    if( _cur ){
+        send(_cur);
+        _cur     = 0;
+        _cursize = 0;
+    }
+
+    finish();
+}
+
+void
+RepartPut::on_reply(google::protobuf::Message *req, google::protobuf::Message *res){
+    ACPY2PutSet      *q = (ACPY2PutSet*) req;
+    ACPY2PutSetReply *r = (ACPY2PutSetReply*) res;
+
+    for(int i=0; i<q->data_size(); i++){
+        ACPY2DistRequest *d = q->mutable_data(i);
+        int rc = (r && i < r->result_code_size()) ? r->result_code(i) : -1;
+
+        if( rc != DBPUTST_DONE && rc != DBPUTST_HAVE ){
+            // not confirmed. send it the old way
+            // the original expire may have passed while it waited
+            DEBUG("bulk put failed %s", d->data().key().c_str());
+            d->set_hop( 10 );
+            d->clear_sender();
+            d->set_expire( lr_usec() + REPART_EXPIRE * 1000000LL );
+
+            if( !_be->distrib(_treeid, d) ){
+                // nowhere to send it. keep it for the next pass
+                (*_kept) ++;
+                continue;
+            }
+        }
+
+        _be->remove( d->data().key(), d->data().version() );
+        INCSTAT( repart_rmed );
+    }
+}
 
 class MerkRepartLR : public LambdaRange {
 public:
@@ -1196,52 +1701,73 @@ public:
     Ring	*ring;
     Merkle	*merk;
     int		count;
+    int		kept;
     int		treeid;
     int64_t	lastver;
+    std::map<RP_Server*, RepartPut*> xfer;	// by new home
 public:
-    MerkRepartLR(Database *b, Ring *r, Merkle *m) { be = b; ring = r; merk = m; count=0; }
-    virtual bool call(const string&, const string&);
+    MerkRepartLR(Database *b, Ring *r, Merkle *m) { be = b; ring = r; merk = m; count=0; kept=0; }
+    virtual bool call(const DBSlice&, const DBSlice&);
+    void finish(void);
 };
 
 bool
-MerkRepartLR::call(const string& key, const string& val){
+MerkRepartLR::call(const DBSlice& key, const DBSlice& val){
     // val is leaf node {key,version,shard}
     // iterate keys
 
-    ACPY2MerkleLeaf l;
-    l.ParsePartialFromString(val);
+    MerkleLeaf l(val.data, val.size);
 
     // copy records from leaf-node into result
-    for(int i=0; i<l.rec_size(); i++){
-        ACPY2MerkleLeafRec *rec = l.mutable_rec(i);
-        lastver = rec->version();
+    for(int i=0; i<l.count(); i++){
+        string  key   = l.keystr(i);
+        int64_t ver   = l.version(i);
+        int     shard = l.shard(i);
+        lastver = ver;
         count ++;
 
-        int newpart   = ring->partno( rec->shard() );
+        int newpart   = ring->partno( shard );
         int newtree   = ring->treeid( newpart );
         bool newlocal = ring->is_local( newpart );
 
         if( !newlocal ){
-            // RSN - async distrib, delete only after confirmation
-            // distrib + delete
-
             // get the data + build a distrib request
             ACPY2DistRequest put;
             put.set_hop( 10 );	// prevent wide redistribution
-            put.set_expire( lr_usec() + 10000000 );
+            put.set_expire( lr_usec() + REPART_EXPIRE * 1000000LL );
             ACPY2MapDatum *dat = put.mutable_data();
             dat->set_map( be->_name );
-            dat->set_key( rec->key() );
-            dat->set_shard( rec->shard() );
-            be->get( dat );
-
-            be->distrib(treeid, &put);
-            be->remove( rec->key(), rec->version() );
+            dat->set_key( key );
+            dat->set_shard( shard );
+            bool have = be->get( dat );
             count += 9;
-            INCSTAT( repart_rmed );
+
+            int size = key.size() + dat->value().size();
+            throttle(THROT_MAINTENANCE, THROT_DISK, size);
+            throttle(THROT_MAINTENANCE, THROT_NET,  size);
+
+            RP_Server *s = have ? ring->random_peer( newpart ) : 0;
+
+            if( s ){
+                // stream it to one of the new servers. delete once they confirm
+                RepartPut *x = xfer[s];
+                if( !x ) x = xfer[s] = new RepartPut(be, treeid, & s->bestaddr, &kept);
+
+                // as if via distrib, so they do not redistribute it. AE will
+                put.set_hop( put.hop() + 1 );
+                put.set_sender( myserver_id );
+                x->add( &put );
+            }else{
+                // distrib + delete
+                if( be->distrib(treeid, &put) ){
+                    be->remove( key, ver );
+                    INCSTAT( repart_rmed );
+                }else
+                    kept ++;
+            }
         }else if( newtree != treeid ){
-            merk->add( rec->key(), newtree, rec->shard(), rec->version() );
-            merk->del( rec->key(), treeid,  rec->shard(), rec->version() );
+            merk->add( key, newtree, shard, ver );
+            merk->del( key, treeid,  shard, ver );
             INCSTAT( repart_changed );
         }
     }
@@ -1250,6 +1776,16 @@ MerkRepartLR::call(const string& key, const string& val){
     return 1;
 }
 
+// wait for everything we sent to be confirmed
+void
+MerkRepartLR::finish(void){
+
+    for(std::map<RP_Server*, RepartPut*>::iterator it=xfer.begin(); it != xfer.end(); it++){
+        delete it->second;
+    }
+    xfer.clear();
+}
+
 bool
 Merkle::repartition(int treeid, int64_t *ver){
 
@@ -1269,10 +1805,125 @@ Merkle::repartition(int treeid, int64_t *ver){
 
     string start, end;
     merkle_key(MERKLE_HEIGHT, treeid, *ver, &start);
-    merkle_key(MERKLE_HEIGHT, treeid+1, 0,  &end);
+    merkle_key(MERKLE_HEIGHT, treeid, F16,  &end);	// last leaf of this tree
 
-    bool ret = _be->_range('m', start, end, &ef);
+    bool ret = _be->_range('m', start, end, &ef, RANGE_MAINT);
+    ef.finish();
 
     *ver = ef.lastver;
+
+    if( ret && ef.kept ){
+        // some could not be handed off. go around again
+        VERBOSE("repartition %x: %d keys not moved, retrying", treeid, ef.kept);
+        *ver = 0;
+        return 0;
+    }
+
     return ret;
 }
+
+//################################################################
+
+MerkleNodeCache::MerkleNodeCache(){
+    _size = 0;
+    _max  = 0;
+    memset(_gen, 0, sizeof(_gen));
+}
+
+int
+MerkleNodeCache::genno(const string& k){
+    uint32_t h = 0;
+
+    for(int i=0; i<k.size(); i++) h = h * 31 + (uchar)k[i];
+    return h % MERKLE_NCGEN;
+}
+
+uint32_t
+MerkleNodeCache::gen(const string& k){
+    int n = genno(k);
+
+    _lock.lock();
+    uint32_t g = _gen[n];
+    _lock.unlock();
+    return g;
+}
+
+void
+MerkleNodeCache::remove(std::map<string,Ent>::iterator it){
+    _size -= it->first.size() * 2 + it->second.data.size() + 64;
+    _lru.erase( it->second.lru );
+    _ents.erase( it );
+}
+
+bool
+MerkleNodeCache::get(const string& k, string *val){
+
+    if( !_max ) return 0;
+
+    _lock.lock();
+    std::map<string,Ent>::iterator it = _ents.find(k);
+    if( it == _ents.end() ){
+        _lock.unlock();
+        return 0;
+    }
+
+    // move to front
+    _lru.splice( _lru.begin(), _lru, it->second.lru );
+    val->assign( it->second.data );
+    _lock.unlock();
+
+    return 1;
+}
+
+// add a value read from disk, if nothing was written since gen g
+void
+MerkleNodeCache::fill(const string& k, const string& val, uint32_t g){
+
+    if( !_max ) return;
+
+    _lock.lock();
+    if( _gen[ genno(k) ] != g ){
+        _lock.unlock();
+        return;
+    }
+
+    std::map<string,Ent>::iterator it = _ents.find(k);
+    if( it != _ents.end() ) remove(it);
+
+    _lru.push_front(k);
+    Ent& e = _ents[k];
+    e.data = val;
+    e.lru  = _lru.begin();
+    _size += k.size() * 2 + val.size() + 64;
+
+    // trim
+    while( _size > _max && !_lru.empty() ){
+        remove( _ents.find( _lru.back() ) );
+    }
+
+    _lock.unlock();
+}
+
+// the node was written
+void
+MerkleNodeCache::update(const string& k, const string& val){
+
+    if( !_max ) return;
+
+    _lock.lock();
+    uint32_t g = ++ _gen[ genno(k) ];
+    _lock.unlock();
+
+    fill(k, val, g);
+}
+
+void
+MerkleNodeCache::clear(void){
+
+    _lock.lock();
+    _ents.clear();
+    _lru.clear();
+    _size = 0;
+    for(int i=0; i<MERKLE_NCGEN; i++) _gen[i] ++;
+    _lock.unlock();
+}
@@ -0,0 +1,272 @@
+/*
+  Copyright (c) 2014
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2014-Nov-19 12:31 (EST)
+  Function: merkle tree leaf nodes
+
+*/
+
+#define CURRENT_SUBSYSTEM	'M'
+
+#include "defs.h"
+#include "diag.h"
+#include "misc.h"
+#include "hash.h"
+#include "merkle.h"
+
+#include <string.h>
+
+// leaf nodes are a table of offsets, sorted by (version, key), then the records.
+// records are appended, and found with a binary search on the table.
+
+#define LEAFHDRLEN(n)	(4 + 4 * (n))
+
+static inline uint32_t
+get32(const char *p){
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline void
+put32(char *p, uint32_t v){
+    memcpy(p, &v, 4);
+}
+
+MerkleLeaf::MerkleLeaf(const char *data, int len){
+    _data  = data;
+    _count = 0;
+
+    if( len < LEAFHDRLEN(1) ) return;
+
+    int n = get32(data);
+    if( n <= 0 || LEAFHDRLEN(n) > len ){
+        PROBLEM("corrupt merkle leaf: count %d, len %d", n, len);
+        return;
+    }
+
+    // verify the records are all there
+    int rlen = len - LEAFHDRLEN(n);
+    for(int i=0; i<n; i++){
+        uint32_t off = get32(data + LEAFHDRLEN(i));
+        uint16_t kl;
+
+        if( off + MERKLE_LEAFRECLEN > rlen ){
+            PROBLEM("corrupt merkle leaf: rec %d off %d, len %d", i, off, len);
+            return;
+        }
+        memcpy(&kl, data + LEAFHDRLEN(n) + off + 12, 2);
+        if( off + MERKLE_LEAFRECLEN + kl > rlen ){
+            PROBLEM("corrupt merkle leaf: rec %d off %d, len %d", i, off, len);
+            return;
+        }
+    }
+
+    _count = n;
+}
+
+const char *
+MerkleLeaf::rec(int i) const {
+    return _data + LEAFHDRLEN(_count) + get32(_data + LEAFHDRLEN(i));
+}
+
+int64_t
+MerkleLeaf::version(int i) const {
+    int64_t v;
+    memcpy(&v, rec(i), 8);
+    return v;
+}
+
+int
+MerkleLeaf::shard(int i) const {
+    int32_t v;
+    memcpy(&v, rec(i) + 8, 4);
+    return v;
+}
+
+const char *
+MerkleLeaf::key(int i, int *len) const {
+    const char *r = rec(i);
+    uint16_t kl;
+
+    memcpy(&kl, r + 12, 2);
+    *len = kl;
+    return r + MERKLE_LEAFRECLEN;
+}
+
+string
+MerkleLeaf::keystr(int i) const {
+    int kl;
+    const char *k = key(i, &kl);
+    return string(k, kl);
+}
+
+// position of (key, version), or where it would be inserted
+int
+MerkleLeaf::find(const string& k, int64_t ver, bool *found) const {
+    int lo = 0, hi = _count;
+    int cmp = 1;
+
+    while( lo < hi ){
+        int mid = (lo + hi) / 2;
+        int64_t v = version(mid);
+
+        if( v < ver )
+            cmp = -1;
+        else if( v > ver )
+            cmp = 1;
+        else{
+            int kl;
+            const char *kp = key(mid, &kl);
+            int ml = kl < k.size() ? kl : k.size();
+            cmp = memcmp(kp, k.data(), ml);
+            if( !cmp ) cmp = kl - (int)k.size();
+        }
+
+        if( cmp < 0 )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *found = 0;
+    if( lo < _count && version(lo) == ver ){
+        int kl;
+        const char *kp = key(lo, &kl);
+        if( kl == k.size() && !memcmp(kp, k.data(), kl) ) *found = 1;
+    }
+
+    return lo;
+}
+
+static void
+put_varint(string *s, uint64_t v){
+
+    while( v >= 0x80 ){
+        s->push_back( (char)(v | 0x80) );
+        v >>= 7;
+    }
+    s->push_back( (char)v );
+}
+
+// protobuf encoding of a record
+static void
+rec_encode(string *r, const char *k, int kl, int64_t ver, int shard){
+
+    r->push_back( 0x08 );
+    put_varint( r, (uint64_t)ver );
+    r->push_back( 0x10 );
+    put_varint( r, (uint32_t)shard );
+    r->push_back( 0x1A );
+    put_varint( r, kl );
+    r->append( k, kl );
+}
+
+// hash the protobuf encoding of the leaf (as used by older versions),
+// so trees compare equal with peers that have not been upgraded
+void
+MerkleLeaf::hash(int alg, uchar *res) const {
+    string buf, r;
+
+    for(int i=0; i<_count; i++){
+        int kl;
+        const char *k = key(i, &kl);
+
+        r.clear();
+        rec_encode( &r, k, kl, version(i), shard(i) );
+
+        buf.push_back( 0x0A );
+        put_varint( &buf, r.size() );
+        buf.append( r );
+    }
+
+    hash_bin( alg, (uchar*) buf.data(), buf.size(), (char*) res, MERKLE_HASHLEN );
+}
+
+// incremental hashing: a leaf hashes to the xor of its record hashes,
+// so adding or removing a record xors in its hash
+void
+MerkleLeaf::rechash(int alg, const char *k, int kl, int64_t ver, int shard, uchar *res){
+    string r;
+
+    rec_encode( &r, k, kl, ver, shard );
+    hash_bin( alg, (uchar*) r.data(), r.size(), (char*) res, MERKLE_HASHLEN );
+}
+
+void
+MerkleLeaf::xhash(int alg, uchar *res) const {
+    uchar rh[MERKLE_HASHLEN];
+
+    memset(res, 0, MERKLE_HASHLEN);
+
+    for(int i=0; i<_count; i++){
+        int kl;
+        const char *k = key(i, &kl);
+
+        rechash( alg, k, kl, version(i), shard(i), rh );
+        for(int j=0; j<MERKLE_HASHLEN; j++) res[j] ^= rh[j];
+    }
+}
+
+// 0 => key too long to store
+int
+MerkleLeaf::insert(string *d, int pos, const string& k, int64_t ver, int shard){
+
+    if( k.size() > MERKLE_MAXKEYLEN ){
+        PROBLEM("key too long for merkle leaf (%d bytes)", (int)k.size());
+        return 0;
+    }
+
+    MerkleLeaf l(d->data(), d->size());
+    int n = l.count();
+    char rh[MERKLE_LEAFRECLEN];
+    uint16_t kl = k.size();
+    int32_t  sh = shard;
+
+    memcpy(rh,      &ver, 8);
+    memcpy(rh + 8,  &sh,  4);
+    memcpy(rh + 12, &kl,  2);
+
+    if( !n ) d->clear();
+
+    // the new record goes at the end
+    uint32_t off = n ? d->size() - LEAFHDRLEN(n) : 0;
+    char ob[4];
+    put32(ob, off);
+
+    if( !n ) d->append(LEAFHDRLEN(0), 0);
+    d->append(rh, MERKLE_LEAFRECLEN);
+    d->append(k);
+    d->insert(LEAFHDRLEN(pos), ob, 4);
+    put32(&(*d)[0], n + 1);
+    return 1;
+}
+
+void
+MerkleLeaf::remove(string *d, int pos){
+    MerkleLeaf l(d->data(), d->size());
+    int n = l.count();
+
+    if( pos < 0 || pos >= n ) return;
+    if( n == 1 ){
+        d->clear();
+        return;
+    }
+
+    int kl;
+    l.key(pos, &kl);
+    uint32_t off = get32(d->data() + LEAFHDRLEN(pos));
+    uint32_t len = MERKLE_LEAFRECLEN + kl;
+
+    d->erase(LEAFHDRLEN(n) + off, len);
+
+    // fix the offsets of the records that moved
+    for(int i=0; i<n; i++){
+        uint32_t o = get32(d->data() + LEAFHDRLEN(i));
+        if( o > off ) put32(&(*d)[LEAFHDRLEN(i)], o - len);
+    }
+
+    d->erase(LEAFHDRLEN(pos), 4);
+    put32(&(*d)[0], n - 1);
+}
+
@@ -15,6 +15,7 @@
 #include "hrtime.h"
 #include "network.h"
 #include "crypto.h"
+#include "hash.h"
 #include "lock.h"
 
 #include <sys/types.h>
@@ -107,8 +108,12 @@ split(const string &src, char delim, deque<string> *dst){
 }
 
 uint
-shard_hash(const string& key){
+shard_hash(const string& key, int alg){
     uint h;
+
+    if( alg == HASH_MURMUR3 )
+        return murmur3_32( (uchar*)key.data(), key.size(), 0 );
+
     md5_bin( (uchar*)key.data(), key.size(), (char*)&h, sizeof(h) );
     return ntohl(h);
 }
@@ -18,6 +18,7 @@
 #include "network.h"
 #include "netutil.h"
 #include "crypto.h"
+#include "connpool.h"
 
 #include "y2db_getset.pb.h"
 #include "y2db_check.pb.h"
@@ -231,7 +232,7 @@ tcp_connect(NetAddr *na, int to){
 
 // serialize request into ntd
 int
-serialize_request(NTD *ntd, int reqno, bool enc, google::protobuf::Message *g, int contlen){
+serialize_request(NTD *ntd, int reqno, bool enc, google::protobuf::Message *g, int contlen, int flags){
 
     int gsz = g->ByteSize();
 
@@ -250,6 +251,7 @@ serialize_request(NTD *ntd, int reqno, bool enc, google::protobuf::Message *g, i
     }else{
         pho->flags          = PHFLAG_WANTREPLY;
     }
+    pho->flags |= flags;
 
     pho->version        = PHVERSION;
     pho->type           = reqno;
@@ -289,6 +291,7 @@ serialize_reply(NTD *ntd, google::protobuf::Message *g, int contlen){
     }else{
         pho->flags          = PHFLAG_ISREPLY;
     }
+    pho->flags |= phi->flags & PHFLAG_KEEPALIVE;
 
     pho->data_length    = gsz;
     pho->content_length = contlen;
@@ -393,47 +396,217 @@ read_proto(NTD *ntd, int reqp, int to){
 
 int
 make_request(NetAddr *addr, int reqno, int to, google::protobuf::Message *g, google::protobuf::Message *res){
+
+    // borrows a connection from the pool, and returns it when done
+    PConn pc(addr, to);
+
+    int r = pc.request(reqno, g, res);
+    if( r ) DEBUG("recv %s", res->ShortDebugString().c_str());
+
+    return r;
+}
+
+int
+make_request(const char *addr, int reqno, int to, google::protobuf::Message *g, google::protobuf::Message *res){
+    NetAddr na;
+
+    if( !parse_net_addr(addr, &na) ) return 0;
+    return make_request(&na, reqno, to, g, res);
+}
+
+/****************************************************************/
+
+PConn::PConn(const NetAddr *a, int to){
+    _addr      = *a;
+    _timeout   = to;
+    _fd        = -1;
+    _keepalive = 0;
+    _reused    = 0;
+    _error     = 0;
+    _errcode   = 0;
+}
+
+PConn::~PConn(){
+    release();
+}
+
+void
+PConn::clear(void){
+
+    for(std::map<uint32_t,NTD*>::iterator it=_replies.begin(); it != _replies.end(); it++){
+        delete it->second;
+    }
+    _replies.clear();
+    _inflight.clear();
+}
+
+// the connection is gone. nothing more will arrive for what is still in flight
+// replies already received can still be collected
+void
+PConn::dropped(void){
+
+    if( _fd != -1 ) ::close(_fd);
+    _fd = -1;
+    _reused = 0;
+    _inflight.clear();
+}
+
+void
+PConn::close(void){
+
+    if( _fd != -1 ) ::close(_fd);
+    _fd = -1;
+    _reused = 0;
+    clear();
+}
+
+// done for now. hand an idle connection back to the pool
+void
+PConn::release(void){
+
+    if( _fd != -1 && _keepalive && _inflight.empty() && _replies.empty() ){
+        connpool_put(&_addr, _fd);
+        _fd = -1;
+    }
+    close();
+}
+
+bool
+PConn::connect(void){
+
+    if( _fd != -1 && _inflight.empty() ){
+        // idle - is it still there?
+        struct pollfd pf[1];
+        pf[0].fd      = _fd;
+        pf[0].events  = POLLIN;
+        pf[0].revents = 0;
+
+        if( poll(pf, 1, 0) ){
+            // eof or junk. either way, start over
+            DEBUG("persistent connection closed by peer");
+            close();
+        }
+    }
+
+    if( _fd != -1 ){
+        _reused = 1;
+        return 1;
+    }
+
+    _fd = connpool_get(&_addr);
+    if( _fd != -1 ){
+        // pooled connections have already agreed to keepalive
+        _reused    = 1;
+        _keepalive = 1;
+        return 1;
+    }
+
+    _fd = tcp_connect(&_addr, _timeout);
+    _reused = 0;
+    return _fd != -1;
+}
+
+// send a request, do not wait for the reply
+int
+PConn::send(int reqno, google::protobuf::Message *g, uint32_t *msgid){
     NTD ntd;
-    protocol_header *pho = (protocol_header*) ntd.gpbuf_out;
-    int s = 0;
 
-    int fd = tcp_connect(addr, to);
-    if( fd < 0 ) return 0;
+    if( !connect() ) return 0;
 
-    ntd.fd = fd;
+    ntd.fd = _fd;
+    int wsz = serialize_request(&ntd, reqno, !_addr.same_dc, g, 0, PHFLAG_KEEPALIVE);
 
-    // connect + send request
-    s = write_request(&ntd, reqno, !addr->same_dc, g, 0, to);
-    if( s < 1 ){
-        close(fd);
+    *msgid = ntohl( ((protocol_header*)ntd.gpbuf_out)->msgidno );
+
+    int i = write_to(_fd, ntd.gpbuf_out, wsz, _timeout);
+    if( i != wsz ){
+        DEBUG("write request failed");
+        close();
         return 0;
     }
 
-    // read reply
-    s = read_proto(&ntd, 0, to);
-    close(fd);
+    _inflight.insert( *msgid );
+    return 1;
+}
 
-    if( s < 1 ){
-        return 0;
+// wait for the reply to a specific request
+int
+PConn::recv(uint32_t msgid, google::protobuf::Message *res){
+    NTD *ntd = 0;
+
+    _error   = 0;
+    _errcode = 0;
+    std::map<uint32_t,NTD*>::iterator it = _replies.find(msgid);
+    if( it != _replies.end() ){
+        ntd = it->second;
+        _replies.erase(it);
     }
 
-    protocol_header *phi = (protocol_header*) ntd.gpbuf_in;
+    while( !ntd ){
+        // never sent, or lost when the connection dropped
+        if( _fd == -1 || !_inflight.count(msgid) ) return 0;
 
-    if( phi->flags & PHFLAG_ISERROR ){
-        return 0;
+        NTD *n = new NTD;
+        n->fd = _fd;
+
+        if( ! read_proto(n, 0, _timeout) ){
+            // everything still in flight fails
+            delete n;
+            dropped();
+            return 0;
+        }
+
+        protocol_header *phi = (protocol_header*) n->gpbuf_in;
+        _inflight.erase( phi->msgidno );
+
+        // peer agrees to keep the connection open?
+        _keepalive = phi->flags & PHFLAG_KEEPALIVE;
+
+        if( phi->msgidno == msgid ){
+            ntd = n;
+        }else{
+            _replies[ phi->msgidno ] = n;
+        }
+
+        if( !_keepalive ){
+            // peer is going to close. anything else in flight is lost
+            dropped();
+        }
     }
 
-    DEBUG("recvd %d", phi->data_length);
-    res->ParsePartialFromArray( ntd.in_data(), phi->data_length );
-    DEBUG("recv l=%d, %s", phi->data_length, res->ShortDebugString().c_str());
+    protocol_header *phi = (protocol_header*) ntd->gpbuf_in;
+    int r = 0;
 
-    return 1;
+    if( !(phi->flags & PHFLAG_ISERROR) ){
+        res->ParsePartialFromArray( ntd->in_data(), phi->data_length );
+        r = 1;
+    }else{
+        // reply_error says why. an unknown request type gets no reason
+        _error = 1;
+        if( phi->data_length ){
+            ACPStdReply e;
+            e.ParsePartialFromArray( ntd->in_data(), phi->data_length );
+            _errcode = e.status_code();
+        }
+    }
+
+    delete ntd;
+    return r;
 }
 
+// send + wait
 int
-make_request(const char *addr, int reqno, int to, google::protobuf::Message *g, google::protobuf::Message *res){
-    NetAddr na;
+PConn::request(int reqno, google::protobuf::Message *g, google::protobuf::Message *res){
+    uint32_t msgid;
 
-    if( !parse_net_addr(addr, &na) ) return 0;
-    return make_request(&na, reqno, to, g, res);
+    for(int tries=0; tries<2; tries++){
+        if( !send(reqno, g, &msgid) ) return 0;
+        bool reused = _reused;
+        if( recv(msgid, res) ) return 1;
+
+        // the peer may have dropped an idle connection just as we reused it. try again.
+        if( !reused || _fd != -1 ) return 0;
+    }
+
+    return 0;
 }
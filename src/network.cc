@@ -44,10 +44,22 @@
 #include <sys/loadavg.h>
 #include <sys/sendfile.h>
 
+// the event driven server needs epoll. elsewhere, fall back to threads
+#if defined(__linux__) || defined(__linux)
+#  define HAVE_EPOLL
+#  include <sys/epoll.h>
+#endif
+
+#include <set>
+using std::set;
+
 
 #define READ_TIMEOUT	30
 #define WRITE_TIMEOUT	30
+#define KEEPALIVE_TIMEOUT	60
+#define KEEPALIVE_THREADED_TIMEOUT	2	// seconds. an idle connection ties up a whole thread
 #define LISTEN		128
+#define LISTEN_EPOLL	4096
 #define ALPHA           0.75
 
 
@@ -66,7 +78,9 @@ extern int  y2_status(NTD*);
 extern int  y2_ringcf(NTD*);
 extern int  api_get(NTD*);
 extern int  api_put(NTD*);
+extern int  api_putset(NTD*);
 extern int  api_check(NTD*);
+extern int  api_diff(NTD*);
 
 extern int  report_ring_txt(NTD *);
 extern int  report_ring_json(NTD *);
@@ -99,6 +113,8 @@ static struct {
     { api_put },
     { api_check },
     { y2_ringcf },
+    { api_putset },		// 37
+    { api_diff },
 
     // ...
 };
@@ -131,10 +147,12 @@ public:
     pthread_t pid;
     jmp_buf   jmp_abort;
     bool      doingio;
+    bool      worker;		// handles requests, counts toward busyness
     int64_t   nreq, ntcp, nudp, nread, nwrite;
 
     ThreadData(){
         busy = 0; util = 0; timeout = 0; pid = 0; time_update = 0; doingio = 0;
+        worker = 1;
         nreq = ntcp = nudp = nread = nwrite = 0;
     }
 
@@ -227,7 +245,7 @@ sigother(int sig){
 // quick+dirty. not fully RFC compliant
 // just enough to export some data to argus
 static void
-network_http(NTD *ntd){
+http_response(NTD *ntd, string *res){
 
     // parse url
     char *url = ntd->gpbuf_in + 4;
@@ -249,9 +267,7 @@ network_http(NTD *ntd){
     }
 
     if( !fnc ){
-#       define RESPONSE "HTTP/1.0 404 Not Found\r\nServer: AC/FurryBlueDB\r\n\r\n"
-        write_to(ntd->fd, RESPONSE, sizeof(RESPONSE)-1, WRITE_TIMEOUT);
-#       undef  RESPONSE
+        res->assign( "HTTP/1.0 404 Not Found\r\nServer: AC/FurryBlueDB\r\n\r\n" );
         return;
     }
 
@@ -259,11 +275,17 @@ network_http(NTD *ntd){
     int rl = fnc(ntd);
 
     // respond
-#   define RESPONSE "HTTP/1.0 200 OK\r\nServer: AC/FurryBlueDB\r\nContent-Type: text/plain\r\n\r\n"
-    write_to(ntd->fd, RESPONSE, sizeof(RESPONSE)-1, WRITE_TIMEOUT);
-#   undef  RESPONSE
+    res->assign( "HTTP/1.0 200 OK\r\nServer: AC/FurryBlueDB\r\nContent-Type: text/plain\r\n\r\n" );
+    res->append( ntd->gpbuf_out, rl );
+}
 
-    write_to(ntd->fd, ntd->gpbuf_out, rl, WRITE_TIMEOUT);
+// threaded server: the thread owns the socket, and can wait for it
+static void
+network_http(NTD *ntd){
+    string res;
+
+    http_response(ntd, &res);
+    write_to(ntd->fd, res.data(), res.size(), WRITE_TIMEOUT);
 }
 
 
@@ -290,10 +312,28 @@ network_process(int idx, NTD *ntd){
 
     if( fnc == api_get ) thread_data[idx].nread  ++;
     if( fnc == api_put ) thread_data[idx].nwrite ++;
+    if( fnc == api_putset ) thread_data[idx].nwrite ++;
 
     return fnc(ntd);
 }
 
+static int
+decrypt_request(NTD *ntd){
+    protocol_header *ph = (protocol_header*) ntd->gpbuf_in;
+
+    if( !(ph->flags & PHFLAG_DATA_ENCR) ) return 1;
+
+    int l = acp_decrypt( ntd->gpbuf_in + sizeof(protocol_header), ph->data_length,
+                         ntd->gpbuf_in + sizeof(protocol_header), ntd->in_size - sizeof(protocol_header));
+
+    ph->data_length = l;
+    if( !l ){
+        DEBUG("decrypt failed");
+        return 0;
+    }
+    return 1;
+}
+
 // well, almost any, ours or http
 int
 read_any_proto(NTD *ntd, int reqp, int to){
@@ -301,8 +341,9 @@ read_any_proto(NTD *ntd, int reqp, int to){
     int len  = 0;
 
     // read header
+    // NB - do not read past the header, the client may have sent more requests
     // int i = read_to(ntd->fd, ntd->gpbuf_in, ntd->in_size, READ_TIMEOUT);
-    int i = read(ntd->fd, ntd->gpbuf_in, ntd->in_size);
+    int i = read(ntd->fd, ntd->gpbuf_in, sizeof(protocol_header));
     if( i > 0 ) len = i;
 
     if( reqp && i > 4 && !strncmp( ntd->gpbuf_in, "GET ", 4) ){
@@ -334,6 +375,13 @@ read_any_proto(NTD *ntd, int reqp, int to){
         return 0;
     }
 
+    while( len && len < sizeof(protocol_header) ){
+        i = read(ntd->fd, ntd->gpbuf_in + len, sizeof(protocol_header) - len);
+        if( i < 0 && errno == EINTR ) continue;
+        if( i < 1 ) break;
+        len += i;
+    }
+
     if( len < sizeof(protocol_header) ){
 	DEBUG("read header failed");
 	return 0;
@@ -375,17 +423,7 @@ read_any_proto(NTD *ntd, int reqp, int to){
 
         ntd->have_data = 1;
 
-        if( ph->flags & PHFLAG_DATA_ENCR ){
-            // decrypt
-            int l = acp_decrypt( ntd->gpbuf_in + sizeof(protocol_header), ph->data_length,
-                                 ntd->gpbuf_in + sizeof(protocol_header), ntd->in_size - sizeof(protocol_header));
-
-            ph->data_length = l;
-            if( !l ){
-                DEBUG("decrypt failed");
-                return 0;
-            }
-        }
+        if( !decrypt_request(ntd) ) return 0;
     }
 
     return 1;
@@ -403,14 +441,20 @@ network_tcp_read_req(int idx, int fd){
     socklen_t sal = sizeof(ntd.peer);
     getpeername(fd, (sockaddr*)&ntd.peer, &sal);
 
-    td->doingio = 1;
-    td->timeout = lr_now() + READ_TIMEOUT;
+    while(1){
+        td->doingio = 1;
+        td->timeout = lr_now() + READ_TIMEOUT;
+
+        ntd.have_data = 0;
+        int r = read_any_proto(&ntd, 1, READ_TIMEOUT);
+        td->doingio = 0;
+        td->timeout = 0;
+
+        if( !r ) break;
 
-    int r = read_any_proto(&ntd, 1, READ_TIMEOUT);
-    td->doingio = 0;
-    td->timeout = 0;
+        // does the client want to send more?
+        bool keep = ((protocol_header*)ntd.gpbuf_in)->flags & PHFLAG_KEEPALIVE;
 
-    if( r ){
         int rl = network_process(idx, &ntd);
         if( rl ){
             td->doingio = 1;
@@ -420,10 +464,30 @@ network_tcp_read_req(int idx, int fd){
             td->doingio = 0;
             td->timeout = 0;
 
-            if( i != rl )
+            if( i != rl ){
                 DEBUG("write response failed %d", errno);
+                break;
+            }
         }
+
+        if( !keep ) break;
+        if( runmode.mode() == RUN_MODE_EXITING ) break;
+
+        // wait for the next request
+        struct pollfd pf[1];
+        pf[0].fd      = fd;
+        pf[0].events  = POLLIN;
+        pf[0].revents = 0;
+
+        td->busy = 0;
+        int p = poll( pf, 1, KEEPALIVE_THREADED_TIMEOUT * 1000 );
+        td->busy = 1;
+        if( p < 1 ) break;
+
+        td->nreq ++;
+        td->ntcp ++;
     }
+
     close(fd);
     return 0;
 }
@@ -473,6 +537,7 @@ network_tcp4(void *x){
             VERBOSE("aborted processing request");
             td->doingio = 0;
             td->timeout = 0;
+            close(nfd);
             // ...
         }
 
@@ -540,8 +605,575 @@ network_udp4(void *x){
     td->fd = 0;
 }
 
+/****************************************************************/
+#ifdef HAVE_EPOLL
+// event driven server
+// a few reactor threads own all of the sockets (epoll),
+// complete requests are handed to a pool of worker threads,
+// which dispatch through request_handler[]
+
+#define MAXEVENTS	256
+#define MAXACCEPT	64
+#define MAXREQ		(64 * 1024 * 1024)
+#define RBUFSIZE	65536
+#define MAXPENDING	64		// requests in flight per connection
+
+class Reactor;
+
+class NetConn {
+public:
+    Reactor		*owner;
+    int			fd;
+    int			refs;		// reactor + workers using this
+    int			pending;	// requests handed to workers, not yet answered
+    bool		listener;
+    bool		dead;
+    bool		hungup;		// peer went away while workers were busy
+    bool		reading;	// still accepting requests
+    time_t		timeout;
+    int			wpos;
+    string		rbuf;
+    string		wbuf;
+    struct sockaddr_in	peer;
+    Mutex		lock;
+
+    NetConn(int f, bool l){
+        owner = 0; fd = f; listener = l; refs = 1; pending = 0;
+        dead = 0; hungup = 0; reading = 1; timeout = 0; wpos = 0;
+    }
+};
+
+// the request is copied out of the connection. each worker has its own NTD
+class NetJob {
+public:
+    NetConn	*conn;
+    bool	http;
+    string	req;
+};
+
+class Reactor {
+public:
+    int			epfd;
+    int			idx;		// thread_data index
+    int			num;
+    NetConn		*listen[2];
+    set<NetConn*>	conns;
+    int			wakefd[2];	// workers poke the reactor
+    Mutex		wlock;
+    deque<NetConn*>	wake;		// connections needing attention
+
+    Reactor(){ epfd = 0; idx = 0; num = 0; listen[0] = listen[1] = 0; wakefd[0] = wakefd[1] = -1; }
+};
+
+static Reactor   *reactor  = 0;
+static Mutex      jobq_lock;
+static CondVar    jobq_cond;
+static deque<NetJob> jobq;
+
+
+static void
+conn_release(NetConn *c){
+
+    c->lock.lock();
+    int r = -- c->refs;
+    c->lock.unlock();
+
+    if( !r ) delete c;
+}
+
+// called only by the owning reactor
+static void
+conn_close(Reactor *r, NetConn *c){
+
+    c->lock.lock();
+    c->dead = 1;
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->fd, 0);
+    close(c->fd);
+    c->lock.unlock();
+
+    r->conns.erase(c);
+    conn_release(c);
+}
+
+// with lock held
+static bool
+conn_can_read(NetConn *c){
+    return c->reading && c->pending < MAXPENDING;
+}
+
+// with lock held
+static void
+conn_events(Reactor *r, NetConn *c){
+    struct epoll_event ev;
+
+    ev.events   = 0;
+    ev.data.ptr = c;
+    if( conn_can_read(c) ) ev.events |= EPOLLIN;
+    if( c->wbuf.size() > c->wpos ) ev.events |= EPOLLOUT;
+
+    epoll_ctl(r->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+// with lock held
+// hand the connection back to the reactor thread
+static void
+reactor_wake(Reactor *r, NetConn *c){
+
+    c->refs ++;
+    r->wlock.lock();
+    r->wake.push_back(c);
+    r->wlock.unlock();
+
+    // if the pipe is full, the reactor is already on its way
+    write(r->wakefd[1], "", 1);
+}
+
+// with lock held
+static int
+conn_flush(NetConn *c){
+
+    while( c->wpos < c->wbuf.size() ){
+        int w = write(c->fd, c->wbuf.data() + c->wpos, c->wbuf.size() - c->wpos);
+        if( w == -1 ){
+            if( errno == EINTR ) continue;
+            if( errno == EAGAIN ) return 0;
+            DEBUG("write response failed %d", errno);
+            return -1;
+        }
+        c->wpos += w;
+        c->timeout = lr_now() + WRITE_TIMEOUT;
+    }
+
+    c->wbuf.clear();
+    c->wpos = 0;
+    return 1;
+}
+
+// called by a worker with a finished response
+static void
+conn_reply(Reactor *r, NetConn *c, const char *buf, int len){
+
+    c->lock.lock();
+    c->pending --;
+
+    if( !c->dead && !c->hungup ){
+        if( c->reading ) c->timeout = lr_now() + KEEPALIVE_TIMEOUT;
+        if( len ){
+            c->wbuf.append(buf, len);
+            conn_flush(c);
+        }
+        conn_events(r, c);
+
+        // a full pipeline may have left requests buffered. or we are all done.
+        // either way, the reactor needs to look at it
+        if( (c->reading && c->pending == MAXPENDING - 1 && !c->rbuf.empty())
+            || (!c->reading && !c->pending && c->wbuf.empty()) )
+            reactor_wake(r, c);
+
+    }else if( !c->dead && !c->pending ){
+        // hung up
+        reactor_wake(r, c);
+    }
+    c->lock.unlock();
+}
+
+static void
+reactor_accept(Reactor *r, NetConn *l){
+    struct sockaddr_in sa;
+    struct epoll_event ev;
+
+    for(int i=0; i<MAXACCEPT; i++){
+        socklen_t sl = sizeof(sa);
+        int nfd = accept(l->fd, (sockaddr *)&sa, &sl);
+
+        if( nfd == -1 ){
+            if( errno != EAGAIN && errno != EINTR ) DEBUG("accept failed");
+            return;
+        }
+
+	if( !config->check_acl( (sockaddr*)&sa ) ){
+	    VERBOSE("network connection refused from %s", inet_ntoa(sa.sin_addr) );
+	    close(nfd);
+	    continue;
+	}
+
+	DEBUG("new connection from %s", inet_ntoa(sa.sin_addr) );
+
+        init_tcp(nfd);
+        set_nbio(nfd);
+
+        NetConn *c = new NetConn(nfd, 0);
+        c->owner   = r;
+        c->peer    = sa;
+        c->timeout = lr_now() + READ_TIMEOUT;
+
+        ev.events   = EPOLLIN;
+        ev.data.ptr = c;
+        if( epoll_ctl(r->epfd, EPOLL_CTL_ADD, nfd, &ev) ){
+            PROBLEM("epoll add failed: %s", strerror(errno));
+            close(nfd);
+            delete c;
+            continue;
+        }
+        r->conns.insert(c);
+    }
+}
+
+static void
+reactor_dispatch(Reactor *r, NetConn *c, int len, bool http){
+
+    string req( c->rbuf, 0, len );
+    c->rbuf.erase(0, len);
+
+    // one request per connection, unless the client asks for more
+    bool keep = 0;
+
+    if( !http ){
+        protocol_header ph;
+        memcpy(&ph, req.data(), sizeof(ph));
+        cvt_header_from_network( &ph );
+        keep = ph.flags & PHFLAG_KEEPALIVE;
+    }
+
+    // pipelined requests run concurrently, replies may go out in any order
+    if( !keep ) c->reading = 0;
+    c->pending ++;
+    c->refs ++;
+
+    jobq_lock.lock();
+    jobq.push_back( NetJob() );
+    NetJob *j = & jobq.back();
+    j->conn   = c;
+    j->http   = http;
+    j->req.swap( req );
+    jobq_cond.signal();
+    jobq_lock.unlock();
+}
+
+// with lock held
+// look for a complete request
+static bool
+reactor_parse(Reactor *r, NetConn *c){
+
+    if( c->rbuf.size() < 4 ) return 0;
+
+    if( !c->rbuf.compare(0, 4, "GET ") ){
+        // do we have entire http req?
+        size_t e = c->rbuf.find("\r\n\r\n");
+        if( e == string::npos ) e = c->rbuf.find("\n\n");
+        if( e == string::npos ){
+            if( c->rbuf.size() > RBUFSIZE ) c->reading = 0;
+            return 0;
+        }
+        DEBUG("http request");
+        reactor_dispatch(r, c, c->rbuf.size(), 1);
+        return 1;
+    }
+
+    if( c->rbuf.size() < sizeof(protocol_header) ) return 0;
+
+    protocol_header ph;
+    memcpy(&ph, c->rbuf.data(), sizeof(ph));
+    cvt_header_from_network( &ph );
+
+    // validate
+    if( ph.version != PHVERSION || ph.data_length < 0 || ph.data_length > MAXREQ ){
+	VERBOSE("invalid request recvd. unknown version(%d)", ph.version);
+        c->reading = 0;
+        c->rbuf.clear();
+        return 0;
+    }
+
+    int len = sizeof(protocol_header) + ph.data_length;
+    if( c->rbuf.size() < len ) return 0;
+
+    reactor_dispatch(r, c, len, 0);
+    return 1;
+}
+
+static void
+reactor_read(Reactor *r, NetConn *c){
+    char buf[RBUFSIZE];
+
+    c->lock.lock();
+    while( conn_can_read(c) ){
+        int i = read(c->fd, buf, sizeof(buf));
+
+        if( i == -1 && errno == EINTR ) continue;
+        if( i == -1 && errno == EAGAIN ) break;
+        if( i < 1 ){
+            // eof or error
+            c->reading = 0;
+            break;
+        }
+
+        c->rbuf.append(buf, i);
+        c->timeout = lr_now() + READ_TIMEOUT;
+
+        while( conn_can_read(c) && reactor_parse(r, c) ) ;
+    }
+
+    bool done = !c->reading && !c->pending && (c->wpos >= c->wbuf.size());
+    if( !done ) conn_events(r, c);
+    c->lock.unlock();
+
+    if( done ) conn_close(r, c);
+}
+
+static void
+reactor_write(Reactor *r, NetConn *c){
+
+    c->lock.lock();
+    int f = conn_flush(c);
+    // pick up requests already buffered
+    while( f != -1 && conn_can_read(c) && reactor_parse(r, c) ) ;
+    bool done = (f == -1) || (f == 1 && !c->reading && !c->pending);
+    if( !done ) conn_events(r, c);
+    c->lock.unlock();
+
+    if( done ) conn_close(r, c);
+}
+
+// connections handed back by workers
+static void
+reactor_wakeup(Reactor *r){
+    char buf[256];
+    deque<NetConn*> wake;
+
+    while( read(r->wakefd[0], buf, sizeof(buf)) > 0 ) ;
+
+    r->wlock.lock();
+    wake.swap( r->wake );
+    r->wlock.unlock();
+
+    for(int i=0; i<wake.size(); i++){
+        NetConn *c = wake[i];
+        c->lock.lock();
+        bool dead = c->dead;
+        c->lock.unlock();
+
+        if( !dead ) reactor_write(r, c);
+        conn_release(c);
+    }
+}
+
+static void
+reactor_timeouts(Reactor *r){
+    time_t now = lr_now();
+    deque<NetConn*> old;
+
+    for(set<NetConn*>::iterator it=r->conns.begin(); it != r->conns.end(); it++){
+        NetConn *c = *it;
+        // do not abandon a request being worked on
+        c->lock.lock();
+        bool busy = c->pending;
+        c->lock.unlock();
+        if( busy ) continue;
+        if( c->hungup || (c->timeout && c->timeout < now) ) old.push_back(c);
+    }
+
+    for(int i=0; i<old.size(); i++){
+        DEBUG("connection timed out");
+        conn_close(r, old[i]);
+    }
+}
+
+#ifndef EPOLLEXCLUSIVE
+#  define EPOLLEXCLUSIVE	(1U << 28)
+#endif
+
+// only one reactor is woken per new connection
+// older kernels do not do exclusive, so only the first reactor accepts
+static void
+reactor_listen(Reactor *r, int n, int fd){
+    struct epoll_event ev;
+
+    if( !fd ) return;
+    NetConn *l  = new NetConn(fd, 1);
+    ev.data.ptr = l;
+    ev.events   = EPOLLIN | EPOLLEXCLUSIVE;
+
+    if( epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) ){
+        ev.events = EPOLLIN;
+        if( r->num || epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) ){
+            delete l;
+            return;
+        }
+    }
+    r->listen[n] = l;
+}
+
+static void *
+network_reactor(void *x){
+    Reactor *r = (Reactor*)x;
+    ThreadData *td = thread_data + r->idx;
+    struct epoll_event ev[MAXEVENTS];
+    time_t lastto = lr_now();
+    hrtime_t t0=0, t1=0, t2=hr_now();
+
+    reactor_listen(r, 0, tcp4s_fd);
+    reactor_listen(r, 1, tcp4c_fd);
+
+    ev[0].events   = EPOLLIN;
+    ev[0].data.ptr = 0;
+    epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakefd[0], ev);
+
+    while(1){
+	if( runmode.mode() == RUN_MODE_EXITING ) break;
+
+        t0 = t2;
+        td->busy = 0;
+        int n = epoll_wait(r->epfd, ev, MAXEVENTS, 1000);
+        t1 = hr_now();
+        td->busy = 1;
+
+        for(int i=0; i<n; i++){
+            NetConn *c = (NetConn*) ev[i].data.ptr;
+
+            if( !c ){
+                reactor_wakeup(r);
+                continue;
+            }
+            if( c->listener ){
+                reactor_accept(r, c);
+                continue;
+            }
+
+            if( ev[i].events & EPOLLIN ){
+                reactor_read(r, c);
+                continue;
+            }
+            if( ev[i].events & (EPOLLERR | EPOLLHUP) ){
+                c->lock.lock();
+                c->reading = 0;
+                c->wbuf.clear();
+                c->wpos    = 0;
+                bool done  = !c->pending;
+                if( !done ){
+                    // a worker still has it, stop listening, finish up after it replies
+                    c->hungup = 1;
+                    epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->fd, 0);
+                }
+                c->lock.unlock();
+                if( done ) conn_close(r, c);
+                continue;
+            }
+            if( ev[i].events & EPOLLOUT ){
+                reactor_write(r, c);
+            }
+        }
+
+        time_t now = lr_now();
+        if( now != lastto ){
+            reactor_timeouts(r);
+            lastto = now;
+        }
+
+	t2 = hr_now();
+        float b = (t2 == t0) ? 0 : ((float)(t2 - t1)) / ((float)(t2 - t0));
+        td->util = (td->util + b) / 2;
+        td->time_update = now;
+    }
+
+    // shut down
+    while( !r->conns.empty() ){
+        conn_close(r, *(r->conns.begin()));
+    }
+    // the listening sockets are closed by network_manage
+    delete r->listen[0];
+    delete r->listen[1];
+    close(r->epfd);
+
+    // everything is closed now, so nothing else will be handed back
+    deque<NetConn*> wake;
+    r->wlock.lock();
+    wake.swap( r->wake );
+    r->wlock.unlock();
+    for(int i=0; i<wake.size(); i++) conn_release( wake[i] );
+    close(r->wakefd[0]);
+    close(r->wakefd[1]);
+    td->fd = 0;
+    return 0;
+}
+
+static void *
+network_worker(void *x){
+    int idx = (int)(intptr_t)x;
+    ThreadData *td = thread_data + idx;
+    hrtime_t t0=0, t1=0, t2=hr_now();
+    NTD ntd;
+    NetJob j;
+    string res;
+
+    while(1){
+        t0 = t2;
+        td->busy = 0;
+
+        jobq_lock.lock();
+        while( jobq.empty() && runmode.mode() != RUN_MODE_EXITING ){
+            jobq_cond.timedwait( &jobq_lock, 1000 );
+        }
+        if( jobq.empty() ){
+            jobq_lock.unlock();
+            break;
+        }
+        j.conn = jobq.front().conn;
+        j.http = jobq.front().http;
+        j.req.swap( jobq.front().req );
+        jobq.pop_front();
+        jobq_lock.unlock();
+
+        t1 = hr_now();
+        td->busy = 1;
+        td->nreq ++;
+        td->ntcp ++;
+
+        NetConn *c = j.conn;
+        int len    = j.req.size();
+
+        ntd.in_resize( len + 1 );
+        memcpy(ntd.gpbuf_in, j.req.data(), len);
+        ntd.gpbuf_in[len] = 0;
+        ntd.fd        = c->fd;
+        ntd.is_tcp    = 1;
+        ntd.peer      = c->peer;
+        ntd.have_data = 0;
+
+        if( j.http ){
+            // the reactor writes it, same as any other reply
+            http_response(&ntd, &res);
+            conn_reply(c->owner, c, res.data(), res.size());
+        }else{
+            protocol_header *ph = (protocol_header*) ntd.gpbuf_in;
+            cvt_header_from_network( ph );
+            if( ph->data_length ) ntd.have_data = 1;
+
+            int rl = decrypt_request(&ntd) ? network_process(idx, &ntd) : 0;
+            conn_reply(c->owner, c, ntd.gpbuf_out, rl);
+        }
+        conn_release(c);
+
+	t2 = hr_now();
+        time_t lt2 = lr_now();
+        float b = (t2 == t0) ? 0 : ((float)(t2 - t1)) / ((float)(t2 - t0));
+
+        if( td->time_update > lt2 - 2 ){
+            td->util = (td->util + b) / 2;
+        }else{
+            td->util = b;
+        }
+        td->time_update = lt2;
+    }
+
+    td->fd = 0;
+    return 0;
+}
+
+#endif /* HAVE_EPOLL */
+/****************************************************************/
+
 static int
-open_tcp(int port){
+open_tcp(int port, int backlog){
     struct sockaddr_in sa;
 
     int s = socket(PF_INET, SOCK_STREAM, 0);
@@ -560,7 +1192,7 @@ open_tcp(int port){
     if( i == -1 ){
 	FATAL("cannot bind to tcp4 port");
     }
-    listen(s, LISTEN);
+    listen(s, backlog);
 
     return s;
 }
@@ -600,9 +1232,22 @@ network_init(void){
 
     // open sockets
     //  *s* => server-to-server; *c* => client-to-server
-    if( config->tcp_threads ){
-        tcp4s_fd = open_tcp(myport);
-        tcp4c_fd = open_tcp(myport + 1);
+    bool epollmode = (config->tcp_mode == "epoll");
+#ifndef HAVE_EPOLL
+    if( epollmode ){
+        PROBLEM("tcp_mode epoll is not supported here, using threads");
+        epollmode = 0;
+    }
+#endif
+
+    if( epollmode ){
+        tcp4s_fd = open_tcp(myport, LISTEN_EPOLL);
+        tcp4c_fd = open_tcp(myport + 1, LISTEN_EPOLL);
+        set_nbio(tcp4s_fd);
+        set_nbio(tcp4c_fd);
+    }else if( config->tcp_threads ){
+        tcp4s_fd = open_tcp(myport, LISTEN);
+        tcp4c_fd = open_tcp(myport + 1, LISTEN);
     }
     if( config->udp_threads ){
         udp4s_fd = open_udp(myport);
@@ -629,16 +1274,52 @@ network_init(void){
     int i;
     int tidx=0;
 
-    nthread = 2 * config->tcp_threads + 2 * config->udp_threads;
-    thread_data = new ThreadData[ nthread ];
+#ifdef HAVE_EPOLL
+    if( epollmode ){
+        int nr = config->tcp_reactors ? config->tcp_reactors : 1;
+        int nw = config->tcp_workers  ? config->tcp_workers  : 1;
+
+        nthread = nr + nw + 2 * config->udp_threads;
+        thread_data = new ThreadData[ nthread ];
+        reactor = new Reactor[ nr ];
+
+        VERBOSE("network using epoll: %d reactors, %d workers", nr, nw);
+
+        for(i=0; i<nr; i++){
+            reactor[i].epfd = epoll_create(MAXEVENTS);
+            reactor[i].idx  = tidx;
+            reactor[i].num  = i;
+            if( reactor[i].epfd == -1 ) FATAL("cannot create epoll: %s", strerror(errno));
+            if( pipe(reactor[i].wakefd) ) FATAL("cannot create pipe: %s", strerror(errno));
+            set_nbio( reactor[i].wakefd[0] );
+            set_nbio( reactor[i].wakefd[1] );
+
+            thread_data[tidx].fd  = reactor[i].epfd;
+            thread_data[tidx].idx = tidx;
+            thread_data[tidx].worker = 0;
+            thread_data[tidx].pid = start_thread(network_reactor, (void*)(reactor + i), 255);
+            tidx ++;
+        }
+        for(i=0; i<nw; i++){
+            thread_data[tidx].fd  = -1;
+            thread_data[tidx].idx = tidx;
+            thread_data[tidx].pid = start_thread(network_worker, (void*)(intptr_t)tidx, 255);
+            tidx ++;
+        }
+    }else
+#endif
+    {
+        nthread = 2 * config->tcp_threads + 2 * config->udp_threads;
+        thread_data = new ThreadData[ nthread ];
+    }
 
-    for(i=0; i<config->tcp_threads; i++){
+    for(i=0; !epollmode && i<config->tcp_threads; i++){
         thread_data[tidx].fd  = tcp4s_fd;
         thread_data[tidx].idx = tidx;
         thread_data[tidx].pid = start_thread(network_tcp4, (void*)(intptr_t)tidx, 255);
         tidx ++;
     }
-    for(i=0; i<config->tcp_threads; i++){
+    for(i=0; !epollmode && i<config->tcp_threads; i++){
         thread_data[tidx].fd  = tcp4c_fd;
         thread_data[tidx].idx = tidx;
         thread_data[tidx].pid = start_thread(network_tcp4, (void*)(intptr_t)tidx, 255);
@@ -647,12 +1328,14 @@ network_init(void){
     for(i=0; i<config->udp_threads; i++){
         thread_data[tidx].fd  = udp4s_fd;
         thread_data[tidx].idx = tidx;
+        thread_data[tidx].worker = !epollmode;
         thread_data[tidx].pid = start_thread(network_udp4, (void*)(intptr_t)tidx, 255);
         tidx ++;
     }
     for(i=0; i<config->udp_threads; i++){
         thread_data[tidx].fd  = udp4c_fd;
         thread_data[tidx].idx = tidx;
+        thread_data[tidx].worker = !epollmode;
         thread_data[tidx].pid = start_thread(network_udp4, (void*)(intptr_t)tidx, 255);
         tidx ++;
     }
@@ -713,14 +1396,17 @@ network_manage(void){
         // determine stats
         if( nowt != prevt ){
             int64_t nreq=0, nread=0, nwrite=0;
-            int nbusy=0, nutil=0;
+            int nbusy=0, nutil=0, nwork=0;
             float tutil=0;
 
             for(int i=0; i<nthread; i++){
-                nbusy  += thread_data[i].busy;
                 nreq   += thread_data[i].nreq;
                 nread  += thread_data[i].nread;
                 nwrite += thread_data[i].nwrite;
+                // epoll mode: only the workers are busy with requests
+                if( !thread_data[i].worker ) continue;
+                nwork  ++;
+                nbusy  += thread_data[i].busy;
                 if( thread_data[i].time_update > nowt - 5 ){
                     tutil += thread_data[i].util;
                     nutil ++;
@@ -731,7 +1417,7 @@ network_manage(void){
             stats.reads  = nread;
             stats.writes = nwrite;
 
-	    float b = (float)nbusy / nthread;
+	    float b = nwork ? (float)nbusy / nwork : 0;
             float u = nutil ? tutil / nutil : 0;
 	    net_busyness    = ALPHA * net_busyness + (1.0 - ALPHA) * b;
 	    net_utiliz      = ALPHA * net_utiliz   + (1.0 - ALPHA) * u;
@@ -914,7 +1600,7 @@ reply_error(NTD *ntd, int code, const char *msg){
     if( !(phi->flags & PHFLAG_WANTREPLY) ) return 0;
 
     ntd_copy_header_for_reply(ntd);
-    phi->flags   = PHFLAG_ISREPLY | PHFLAG_ISERROR;
+    pho->flags  |= PHFLAG_ISERROR;
 
     g.set_status_code( code );
     g.set_status_message( msg );
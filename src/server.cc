@@ -19,6 +19,7 @@
 #include "store.h"
 #include "stats.h"
 #include "runmode.h"
+#include "throttle.h"
 
 #include <ctype.h>
 #include <stdlib.h>
@@ -56,7 +57,9 @@ api_get(NTD *ntd){
     DEBUG("res l=%d, %s", phi->data_length, req.ShortDebugString().c_str());
 
     // serialize + reply
-    return serialize_reply(ntd, &req, 0);
+    int rl = serialize_reply(ntd, &req, 0);
+    throttle_note( THROT_FOREGROUND, THROT_NET, rl );
+    return rl;
 }
 
 // someone wants to give us data
@@ -70,6 +73,7 @@ api_put(NTD *ntd){
     // parse request
     req.ParsePartialFromArray( ntd->in_data(), phi->data_length );
     DEBUG("l=%d, %s", phi->data_length, req.ShortDebugString().c_str());
+    throttle_note( THROT_FOREGROUND, THROT_NET, phi->data_length );
 
     if( ! req.IsInitialized() ){
         DEBUG("invalid request. missing required fields");
@@ -109,6 +113,62 @@ api_put(NTD *ntd){
     return 0;
 }
 
+// someone wants to give us lots of data
+int
+api_putset(NTD *ntd){
+    protocol_header *phi = (protocol_header*) ntd->gpbuf_in;
+    ACPY2PutSet      req;
+    ACPY2PutSetReply res;
+
+    // parse request
+    req.ParsePartialFromArray( ntd->in_data(), phi->data_length );
+    DEBUG("l=%d, n=%d", phi->data_length, req.data_size());
+    // replication + repartition batches say so
+    throttle_note( throttle_class(req.traffic()), THROT_NET, phi->data_length );
+
+    if( ! req.IsInitialized() ){
+        DEBUG("invalid request. missing required fields");
+        return 0;
+    }
+
+    if( runmode.is_stopping() ){
+        return reply_error(ntd, 500, "shutting down");
+    }
+
+    // process requests
+    // NB: put may alter requests (for a read/modify/write request)
+    int n = req.data_size();
+    int *rc   = new int[n];
+    int *part = new int[n];
+    int64_t conft = 0;
+
+    store_put_set( &req, rc, &conft, part );
+
+    for(int i=0; i<n; i++){
+        ACPY2DistRequest *d = req.mutable_data(i);
+
+        if( rc[i] == DBPUTST_DONE || !d->hop() ){
+            store_distrib( d->data().map().c_str(), part[i], d );
+        }
+    }
+
+    int rl = 0;
+
+    if( phi->flags & PHFLAG_WANTREPLY ){
+        // build reply
+        res.set_status_code( 200 );
+        res.set_status_message( "OK" );
+        for(int i=0; i<n; i++) res.add_result_code( rc[i] );
+        if( conft ) res.set_conf_time( conft );
+
+        // serialize + reply
+        rl = serialize_reply(ntd, &res, 0);
+    }
+
+    delete [] rc;
+    delete [] part;
+    return rl;
+}
 
 int
 api_check(NTD *ntd){
@@ -133,3 +193,27 @@ api_check(NTD *ntd){
     return serialize_reply(ntd, &res, 0);
 }
 
+// compare a subtree of the peer's merkle tree with ours
+int
+api_diff(NTD *ntd){
+    protocol_header *phi = (protocol_header*) ntd->gpbuf_in;
+    ACPY2DiffRequest req;
+    ACPY2CheckReply  res;
+
+    if( !(phi->flags & PHFLAG_WANTREPLY) ) return 0;
+
+    // parse request
+    req.ParsePartialFromArray( ntd->in_data(), phi->data_length );
+    DEBUG("l=%d, n=%d", phi->data_length, req.node_size());
+
+    if( ! req.IsInitialized() ){
+        DEBUG("invalid request. missing required fields");
+        return reply_error(ntd, 400, "invalid request");
+    }
+
+    store_diff_merkle( req.map().c_str(), &req, &res );
+
+    // serialize + reply
+    return serialize_reply(ntd, &res, 0);
+}
+
@@ -84,6 +84,8 @@ store_init(void){
     // so it can't be done in the ctor
     for(int n=0; n<ndb; n++){
         dbs[n].be->configure();
+        dbs[n].be->check_shardhash();
+        dbs[n].be->check_merkle();
     }
 
 
@@ -126,6 +128,57 @@ store_put(const char *db, ACPY2MapDatum *req, int64_t* cft, int *part){
     return be->put(req, part);
 }
 
+// the requests may be for several different databases
+// each database gets its portion in one batch
+void
+store_put_set(ACPY2PutSet *req, int *rc, int64_t* cft, int *part){
+    int n = req->data_size();
+    ACPY2MapDatum **dat = new ACPY2MapDatum*[n];
+    int  *idx  = new int[n];
+    int  *drc  = new int[n];
+    int  *dpt  = new int[n];
+    bool *done = new bool[n];
+
+    for(int i=0; i<n; i++){
+        rc[i]   = DBPUTST_BAD;
+        part[i] = -1;
+        done[i] = 0;
+    }
+
+    for(int i=0; i<n; i++){
+        if( done[i] ) continue;
+        const string& map = req->data(i).data().map();
+        Database *be = find( map.c_str() );
+
+        // gather everything for this database
+        int nd = 0;
+        for(int j=i; j<n; j++){
+            if( done[j] ) continue;
+            if( req->data(j).data().map() != map ) continue;
+            done[j] = 1;
+            if( !be ) continue;
+            idx[nd] = j;
+            dat[nd] = req->mutable_data(j)->mutable_data();
+            nd ++;
+        }
+        if( !be ) continue;
+
+        if( cft ) *cft = be->ring_version();
+        be->put_set(nd, dat, drc, dpt);
+
+        for(int j=0; j<nd; j++){
+            rc[ idx[j] ]   = drc[j];
+            part[ idx[j] ] = dpt[j];
+        }
+    }
+
+    delete [] dat;
+    delete [] idx;
+    delete [] drc;
+    delete [] dpt;
+    delete [] done;
+}
+
 #if 0
 int
 store_remove(const char *db, const string& key, int shard, int64_t ver){
@@ -144,6 +197,14 @@ store_get_merkle(const char *db, int level, int treeid, int64_t ver, int max, AC
     return be->get_merkle(level, treeid, ver, max, res);
 }
 
+int
+store_diff_merkle(const char *db, ACPY2DiffRequest *req, ACPY2CheckReply *res){
+    Database *be = find(db);
+    if(!be) return 0;
+
+    return be->diff_merkle(req, res);
+}
+
 int
 store_get_internal(const char *db, char sub, const string& key, string *res){
     Database *be = find(db);
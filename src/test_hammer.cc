@@ -164,7 +164,7 @@ build_req(ACPY2DistRequest *req){
     int64_t now = hr_usec();
 
     req->set_hop( 0 );
-    req->set_expire( now + 1000000 );
+    req->set_expire( lr_usec() + 10000000 );
     req->set_sender( "localhost" );
     ACPY2MapDatum *d = req->mutable_data();
 
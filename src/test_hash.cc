@@ -0,0 +1,110 @@
+/*
+  Copyright (c) 2015
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2015-Mar-18 14:20 (EDT)
+  Function: known answer tests for the hashes
+
+*/
+
+
+#include "defs.h"
+#include "misc.h"
+#include "diag.h"
+#include "config.h"
+#include "hash.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+Config *config = 0;
+
+// murmur3 x86_32, seed 0, as used for shard_hash murmur3
+// the perl client (AC::FurryBlue::Client::_murmur3_32) must give the same answers
+static struct {
+    const char *data;
+    int         len;
+    uint32_t    hash;
+} murmur32_kat[] = {
+    { "",		0,	0x00000000 },
+    { "a",		1,	0x3C2569B2 },
+    { "ab",		2,	0x9BBFD75F },
+    { "abc",		3,	0xB3DD93FA },
+    { "abcd",		4,	0x43ED676A },
+    { "abcde",		5,	0xE89B9AF6 },
+    { "hello",		5,	0x248BFA47 },
+    { "hello world",	11,	0x5E928F0F },
+    { "The quick brown fox jumps over the lazy dog", 43, 0x2E4FF723 },
+    // high bit set in the tail bytes
+    { "\xFF\xFE\xFD",	3,	0xD2BEF2DC },
+    { "\x80\x81\x82\x83\x84\x85\x86", 7, 0x5769CE95 },
+};
+
+// murmur3 x64_128, seed 0, as used for merkle_hash murmur3. canonical byte order
+static struct {
+    const char *data;
+    int         len;
+    const char *hash;
+} murmur128_kat[] = {
+    { "",		0,	"00000000000000000000000000000000" },
+    { "hello",		5,	"029bbd41b3a7d8cb191dae486a901e5b" },
+    { "hello world",	11,	"0e617feb46603f53b163eb607d4697ab" },
+    { "The quick brown fox jumps over the lazy dog", 43, "6c1b07bc7bbc4be347939ac4a93c437a" },
+};
+
+static void
+hexify(const uchar *in, int len, char *out){
+
+    for(int i=0; i<len; i++) sprintf(out + 2 * i, "%02x", in[i]);
+}
+
+int
+main(int argc, char **argv){
+    int nfail = 0;
+    uchar h[16];
+    char  hex[33];
+
+    if( argc > 1 ) debug_enabled = 1;
+
+    for(int i=0; i<ELEMENTSIN(murmur32_kat); i++){
+        uint32_t r = murmur3_32( (uchar*)murmur32_kat[i].data, murmur32_kat[i].len, 0 );
+
+        DEBUG("murmur3_32 [%d] => %08X", i, r);
+        if( r != murmur32_kat[i].hash ){
+            printf("FAIL murmur3_32 [%d] %08X, expected %08X\n", i, r, murmur32_kat[i].hash);
+            nfail ++;
+        }
+    }
+
+    // a full block, then a 15 byte tail with the high bits set
+    uchar data[31];
+    for(int i=0; i<sizeof(data); i++) data[i] = 0x80 + i;
+    murmur3_128( data, sizeof(data), 0, h );
+    hexify(h, 16, hex);
+    if( strcmp(hex, "596e099a9960d33a89b8afb7c06a42ef") ){
+        printf("FAIL murmur3_128 [binary] %s\n", hex);
+        nfail ++;
+    }
+
+    for(int i=0; i<ELEMENTSIN(murmur128_kat); i++){
+        murmur3_128( (uchar*)murmur128_kat[i].data, murmur128_kat[i].len, 0, h );
+        hexify(h, 16, hex);
+
+        DEBUG("murmur3_128 [%d] => %s", i, hex);
+        if( strcmp(hex, murmur128_kat[i].hash) ){
+            printf("FAIL murmur3_128 [%d] %s, expected %s\n", i, hex, murmur128_kat[i].hash);
+            nfail ++;
+        }
+    }
+
+    // hash_bin truncates
+    hash_bin( HASH_MURMUR3, (uchar*)"hello", 5, (char*)h, 4 );
+    hexify(h, 4, hex);
+    if( strcmp(hex, "029bbd41") ){
+        printf("FAIL hash_bin truncate %s\n", hex);
+        nfail ++;
+    }
+
+    printf("%s\n", nfail ? "FAILED" : "ok");
+    return nfail ? 1 : 0;
+}
@@ -0,0 +1,200 @@
+/*
+  Copyright (c) 2015
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2015-Apr-02 11:07 (EDT)
+  Function: test merkle leaf nodes
+
+*/
+
+
+#include "defs.h"
+#include "misc.h"
+#include "diag.h"
+#include "config.h"
+#include "hash.h"
+#include "merkle.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "y2db_check.pb.h"
+
+#include <map>
+#include <utility>
+using std::map;
+using std::pair;
+
+Config *config = 0;
+
+typedef map<pair<int64_t,string>, int> Recs;	// (version, key) => shard
+
+static int nfail = 0;
+
+static void
+fail(const char *what, int i){
+    printf("FAIL %s [%d]\n", what, i);
+    nfail ++;
+}
+
+// the leaf must hold exactly the expected records, in order
+static void
+check_leaf(const string& d, const Recs& recs){
+    MerkleLeaf l(d.data(), d.size());
+
+    if( l.count() != recs.size() ){
+        fail("count", l.count());
+        return;
+    }
+
+    int i = 0;
+    for(Recs::const_iterator it=recs.begin(); it!=recs.end(); it++, i++){
+        if( l.version(i) != it->first.first )  fail("version", i);
+        if( l.keystr(i)  != it->first.second ) fail("key", i);
+        if( l.shard(i)   != it->second )       fail("shard", i);
+
+        bool found;
+        int pos = l.find(it->first.second, it->first.first, &found);
+        if( !found || pos != i ) fail("find", i);
+
+        // same key, other version
+        l.find(it->first.second, it->first.first + 1, &found);
+        if( found && !recs.count(std::make_pair(it->first.first + 1, it->first.second)) ) fail("find other", i);
+    }
+}
+
+// the hashes must match the protobuf leaf that older peers build
+static void
+check_hash(const string& d, int alg){
+    MerkleLeaf l(d.data(), d.size());
+    ACPY2MerkleLeaf pl;
+    uchar want[MERKLE_HASHLEN], got[MERKLE_HASHLEN], rh[MERKLE_HASHLEN];
+    string buf;
+
+    memset(want, 0, MERKLE_HASHLEN);
+
+    for(int i=0; i<l.count(); i++){
+        ACPY2MerkleLeafRec *r = pl.add_rec();
+        r->set_version( l.version(i) );
+        r->set_shard( l.shard(i) );
+        r->set_key( l.keystr(i) );
+
+        r->SerializeToString( &buf );
+        hash_bin( alg, (uchar*)buf.data(), buf.size(), (char*)rh, MERKLE_HASHLEN );
+        for(int j=0; j<MERKLE_HASHLEN; j++) want[j] ^= rh[j];
+    }
+
+    l.xhash( alg, got );
+    if( memcmp(want, got, MERKLE_HASHLEN) ) fail("xhash", alg);
+
+    pl.SerializeToString( &buf );
+    hash_bin( alg, (uchar*)buf.data(), buf.size(), (char*)want, MERKLE_HASHLEN );
+
+    l.hash( alg, got );
+    if( memcmp(want, got, MERKLE_HASHLEN) ) fail("hash", alg);
+}
+
+static string
+random_key(void){
+    static const char *ab = "abcdefghijklmnopqrstuvwxyz0123456789";
+    string k;
+    int len = random() % 40;
+
+    // sometimes long enough to need a multibyte length
+    if( !(random() % 10) ) len += 200;
+
+    for(int i=0; i<len; i++) k.push_back( ab[ random() % 36 ] );
+    return k;
+}
+
+int
+main(int argc, char **argv){
+    extern char *optarg;
+    extern int optind;
+    int c;
+    int nrec = 1000;
+    string d;
+    Recs recs;
+
+    // -d debug
+    // -n number of records
+    while( (c = getopt(argc, argv, "dn:")) != -1 ){
+        switch(c){
+        case 'd':
+            debug_enabled = 1;
+            break;
+        case 'n':
+            nrec = atoi( optarg );
+            break;
+        }
+    }
+
+    srandom( 1 );
+
+    // insert. few versions, so records share versions and are ordered by key
+    for(int i=0; i<nrec; i++){
+        int64_t ver = 0x5500000000000000LL + (random() % 50);
+        int shard   = random();
+        string k    = random_key();
+        if( i & 1 ) shard |= 0x80000000;
+
+        MerkleLeaf l(d.data(), d.size());
+        bool found;
+        int pos = l.find(k, ver, &found);
+
+        if( found != (recs.count(std::make_pair(ver, k)) != 0) ) fail("find before insert", i);
+        if( found ) continue;
+
+        if( !MerkleLeaf::insert(&d, pos, k, ver, shard) ) fail("insert", i);
+        recs[ std::make_pair(ver, k) ] = shard;
+    }
+
+    check_leaf(d, recs);
+    check_hash(d, HASH_MD5);
+    check_hash(d, HASH_MURMUR3);
+    printf("inserted %d\n", (int)recs.size());
+
+    // remove about half
+    for(int i=0; i<nrec/2; i++){
+        MerkleLeaf l(d.data(), d.size());
+        if( !l.count() ) break;
+        int pos = random() % l.count();
+        recs.erase( std::make_pair(l.version(pos), l.keystr(pos)) );
+        MerkleLeaf::remove(&d, pos);
+    }
+
+    check_leaf(d, recs);
+    check_hash(d, HASH_MD5);
+    check_hash(d, HASH_MURMUR3);
+    printf("removed to %d\n", (int)recs.size());
+
+    // the longest key fits, one more does not
+    string big(MERKLE_MAXKEYLEN, 'x');
+    MerkleLeaf bl(d.data(), d.size());
+    bool found;
+    int pos = bl.find(big, 1, &found);
+    if( !MerkleLeaf::insert(&d, pos, big, 1, 1) ) fail("insert max key", 0);
+    recs[ std::make_pair((int64_t)1, big) ] = 1;
+
+    string sd = d;
+    big.push_back('x');
+    MerkleLeaf tl(d.data(), d.size());
+    pos = tl.find(big, 1, &found);
+    if( MerkleLeaf::insert(&d, pos, big, 1, 1) ) fail("insert long key", 0);
+    if( d != sd ) fail("leaf changed by long key", 0);
+
+    check_leaf(d, recs);
+    check_hash(d, HASH_MD5);
+
+    // remove everything
+    while( recs.size() ){
+        recs.erase( recs.begin() );
+        MerkleLeaf::remove(&d, 0);
+        if( recs.size() % 97 == 0 ) check_leaf(d, recs);
+    }
+    if( !d.empty() ) fail("empty", d.size());
+
+    printf("%s\n", nfail ? "FAILED" : "ok");
+    return nfail ? 1 : 0;
+}
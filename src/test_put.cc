@@ -35,7 +35,7 @@ main(int argc, char **argv){
     srandom( getpid() );
 
     req.set_hop( 0 );
-    req.set_expire( now + 1000000 );
+    req.set_expire( lr_usec() + 10000000 );
     req.set_sender( "localhost" );
     ACPY2MapDatum *d = req.mutable_data();
 
@@ -82,7 +82,7 @@ main(int argc, char **argv){
     debug_enabled = 1;
 
     req.set_hop( 0 );
-    req.set_expire( now + 1000000 );
+    req.set_expire( lr_usec() + 10000000 );
     req.set_sender( "localhost" );
     ACPY2MapDatum *d = req.mutable_data();
 
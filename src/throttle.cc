@@ -0,0 +1,239 @@
+/*
+  Copyright (c) 2015
+  Author: Jeff Weisberg <jaw @ solvemedia.com>
+  Created: 2015-Mar-25 11:30 (EDT)
+  Function: background traffic throttling
+
+*/
+
+#define CURRENT_SUBSYSTEM	'h'
+
+#include "defs.h"
+#include "diag.h"
+#include "config.h"
+#include "misc.h"
+#include "lock.h"
+#include "hrtime.h"
+#include "network.h"
+#include "throttle.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// a token bucket per class + resource, refilled at the configured rate.
+// takers go into debt, and then wait it out - so concurrent takers are
+// spaced out correctly. the background classes get a smaller share
+// of their rate as the server gets busy with client requests.
+
+#define BURST		1	// seconds of budget that can accumulate
+#define MAXWAIT		10	// seconds, most we make anyone wait at once
+
+struct ThrotBucket {
+    int		rate;		// KB/sec. 0 => unlimited
+    int		confrate;	// per the config file
+    bool	console;	// set from the console, overrides the config
+    double	tokens;		// bytes
+    hrtime_t	last;
+    int64_t	total;		// bytes
+    int64_t	waited;		// usec
+};
+
+static Mutex       throt_lock;
+static ThrotBucket bucket[THROT_NCLASS][THROT_NRES];
+
+static const char *classname[THROT_NCLASS] = { "foreground", "replication", "maintenance" };
+static const char *resname[THROT_NRES]     = { "disk", "net" };
+
+
+// when the server is busy, back off
+static double
+throt_share(int cls){
+    double s = 1;
+
+    switch(cls){
+    case THROT_REPLICATION:
+        s = 1 - net_busyness / 2;
+        if( s < .25 ) s = .25;
+        break;
+    case THROT_MAINTENANCE:
+        s = 1 - net_busyness;
+        if( s < .05 ) s = .05;
+        break;
+    }
+
+    return s;
+}
+
+// charge the bucket. returns how long to wait, usec
+static int64_t
+throt_take(int cls, int res, int64_t n){
+    int64_t wait = 0;
+
+    if( cls < 0 || cls >= THROT_NCLASS || res < 0 || res >= THROT_NRES ) return 0;
+
+    throt_lock.lock();
+    ThrotBucket *b = & bucket[cls][res];
+    b->total += n;
+
+    if( b->rate && cls != THROT_FOREGROUND ){
+        hrtime_t now = hr_usec();
+        double rate  = b->rate * 1024.0 * throt_share(cls);	// bytes/sec
+
+        if( b->last ) b->tokens += (now - b->last) * rate / 1000000;
+        if( b->tokens > rate * BURST ) b->tokens = rate * BURST;
+        b->last = now;
+
+        b->tokens -= n;
+        if( b->tokens < 0 ){
+            wait = (int64_t)(- b->tokens * 1000000 / rate);
+            if( wait > MAXWAIT * 1000000LL ) wait = MAXWAIT * 1000000LL;
+            b->waited += wait;
+        }
+    }
+    throt_lock.unlock();
+
+    return wait;
+}
+
+void
+throttle(int cls, int res, int64_t n){
+
+    int64_t wait = throt_take(cls, res, n);
+    if( wait <= 0 ) return;
+
+    if( wait >= 1000000 ) sleep( wait / 1000000 );
+    usleep( wait % 1000000 );
+}
+
+void
+throttle_note(int cls, int res, int64_t n){
+    throt_take(cls, res, n);
+}
+
+// with lock held
+static void
+throt_set(int c, int r, int rate){
+    ThrotBucket *b = & bucket[c][r];
+
+    if( b->rate == rate ) return;
+    b->rate   = rate;
+    b->tokens = 0;
+    b->last   = 0;
+}
+
+static bool
+throt_lookup(const string& cls, const string& res, int *pc, int *pr, string *err){
+    int c, r;
+
+    for(c=0; c<THROT_NCLASS; c++){
+        if( cls == classname[c] ) break;
+    }
+    for(r=0; r<THROT_NRES; r++){
+        if( res == resname[r] ) break;
+    }
+
+    if( c == THROT_NCLASS ){
+        err->assign("unknown class");
+        return 0;
+    }
+    if( r == THROT_NRES ){
+        err->assign("unknown resource");
+        return 0;
+    }
+
+    *pc = c;
+    *pr = r;
+    return 1;
+}
+
+// from the console. stays in effect across config reloads
+bool
+throttle_set(const string& cls, const string& res, int rate, string *err){
+    int c, r;
+
+    if( ! throt_lookup(cls, res, &c, &r, err) ) return 0;
+    if( rate < 0 ){
+        err->assign("invalid rate");
+        return 0;
+    }
+
+    throt_lock.lock();
+    bucket[c][r].console = 1;
+    throt_set(c, r, rate);
+    throt_lock.unlock();
+
+    VERBOSE("throttle %s %s %d KB/s", cls.c_str(), res.c_str(), rate);
+    return 1;
+}
+
+void
+throttle_report(string *dst){
+    char buf[128];
+
+    snprintf(buf, sizeof(buf), "%-12s %-5s %10s %10s %14s %10s\n", "class", "res", "KB/s", "share", "total KB", "waited s");
+    dst->append(buf);
+
+    throt_lock.lock();
+    for(int c=0; c<THROT_NCLASS; c++){
+        for(int r=0; r<THROT_NRES; r++){
+            ThrotBucket *b = & bucket[c][r];
+
+            snprintf(buf, sizeof(buf), "%-12s %-5s %10d %10.2f %14lld %10lld\n",
+                     classname[c], resname[r], b->rate, (c == THROT_FOREGROUND) ? 1.0 : throt_share(c),
+                     b->total / 1024, b->waited / 1000000);
+            dst->append(buf);
+        }
+    }
+    throt_lock.unlock();
+}
+
+// config: throttle <class> <resource> <KB/sec>
+// called at startup, and on every reload. only limits that changed in the
+// config are applied, and not if they were set from the console.
+// a limit removed from the config goes back to unlimited
+void
+throttle_configure(Config *cf){
+    int want[THROT_NCLASS][THROT_NRES];
+    string err;
+
+    memset(want, 0, sizeof(want));
+
+    for(list<string>::iterator it=cf->throttle.begin(); it != cf->throttle.end(); it++){
+        char cn[32], rn[32];
+        int rate, c, r;
+
+        if( sscanf(it->c_str(), "%31s %31s %d", cn, rn, &rate) != 3 || rate < 0 ){
+            PROBLEM("invalid throttle '%s'", it->c_str());
+            continue;
+        }
+        if( ! throt_lookup(cn, rn, &c, &r, &err) ){
+            PROBLEM("invalid throttle '%s': %s", it->c_str(), err.c_str());
+            continue;
+        }
+        want[c][r] = rate;
+    }
+
+    throt_lock.lock();
+    for(int c=0; c<THROT_NCLASS; c++){
+        for(int r=0; r<THROT_NRES; r++){
+            ThrotBucket *b = & bucket[c][r];
+
+            if( b->confrate == want[c][r] ) continue;
+            b->confrate = want[c][r];
+            if( b->console ) continue;
+
+            throt_set(c, r, want[c][r]);
+            VERBOSE("throttle %s %s %d KB/s", classname[c], resname[r], want[c][r]);
+        }
+    }
+    throt_lock.unlock();
+}
+
+// the traffic class the sender asked for, or foreground
+int
+throttle_class(int cls){
+    if( cls < 0 || cls >= THROT_NCLASS ) return THROT_FOREGROUND;
+    return cls;
+}